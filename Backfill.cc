@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "Backfill.h"
+
+
+BackfillPlanner::BackfillPlanner(int32_t from, int32_t to, bool daily)
+{
+  next = from;
+  this->to = to;
+  this->daily = daily;
+  chunk_to = 0;
+  chunk_length = (daily) ? BACKFILL_CHUNK_DAILY : BACKFILL_CHUNK_5M;
+  // Never report a cursor before the start of the range
+  settled = to - ((daily) ? BACKFILL_SETTLE_DAILY : BACKFILL_SETTLE_5M);
+  settled = (settled < from - 1) ? from - 1 : settled;
+  request = -1;
+  sink = NULL;
+  chunk_records = 0;
+  chunk_last = 0;
+  Chunks = NoRecords = 0;
+}
+
+// Request next chunk
+int BackfillPlanner::Begin(ProtocolManager *pm, HistoricYieldSink& sink)
+{
+  if (Finished() || Busy())
+  {
+    return PM_ERROR_SENDING_COMMAND;
+  }
+  chunk_to = (to - next >= chunk_length) ? next + chunk_length - 1 : to;
+  chunk_records = 0;
+  chunk_last = next - 1;
+  this->sink = &sink;
+  request = pm->BeginHistoricYield(next, chunk_to, *this, daily);
+  return request;
+}
+
+// Wait for chunk; continue after it on success
+int BackfillPlanner::Wait(ProtocolManager *pm)
+{
+  int status = pm->Wait(request);
+  request = -1;
+  if (status == 0)
+  {
+    int32_t base = (daily) ? BACKFILL_CHUNK_DAILY : BACKFILL_CHUNK_5M;
+    next = (chunk_records > 0 && chunk_length > base) ? chunk_last + 1 : chunk_to + 1;
+    Chunks++;
+    // Gallop over empty history, back to normal chunks when records are found
+    chunk_length = (chunk_records > 0) ? base : (chunk_length > INT32_MAX / 2) ? INT32_MAX : chunk_length * 2;
+  }
+  return status;
+}
+
+// Records of the chunk in flight
+int BackfillPlanner::Records(HistoricInfoItem *records, int no_records)
+{
+  chunk_records += no_records;
+  NoRecords += no_records;
+  for (int i = 0; i < no_records; i++)
+  {
+    chunk_last = (records[i].TimeStamp > chunk_last) ? records[i].TimeStamp : chunk_last;
+  }
+  return sink->Records(records, no_records);
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "ProtocolManager.h"
+
+#ifndef __BACKFILL_H__
+#define __BACKFILL_H__
+
+// Length of the chunks a historic range is fetched in [s]: a week of 5 minute values (2016 records), a year of 
+// daily values
+#define BACKFILL_CHUNK_5M             (7*24*3600)
+#define BACKFILL_CHUNK_DAILY          (366*24*3600)
+// Records younger than this may not be available yet; the cursor does not move past them [s]
+#define BACKFILL_SETTLE_5M            3600
+#define BACKFILL_SETTLE_DAILY         (2*24*3600)
+// Maximum number of chunks fetched per series in one session
+#define BACKFILL_MAX_CHUNKS           26
+
+// Splits a large historic yield range [from, to] in chunks and fetches them in order, one chunk in flight. After each
+// chunk, everything up to Cursor() has been received; a next run resumes from there. Chunks without records (e.g. 
+// before the inverter was installed) double the length of the next chunk, so empty history is skipped quickly. A long
+// chunk that does return records may have been cut off by the inverter: the next chunk starts after its last record.
+class BackfillPlanner : public HistoricYieldSink
+{
+  int32_t next;           // start of the next chunk
+  int32_t to;
+  int32_t chunk_to;       // end of the chunk in flight
+  int32_t chunk_length;
+  int32_t settled;        // latest timestamp that can be final
+  bool daily;
+  int request;            // request id of the chunk in flight, < 0 when none
+  HistoricYieldSink *sink;
+  uint32_t chunk_records; // records received in the chunk in flight
+  int32_t chunk_last;     // latest timestamp received in the chunk in flight
+  
+  public:
+  
+  // Number of chunks and records received
+  uint32_t Chunks;
+  uint32_t NoRecords;
+  
+  BackfillPlanner(int32_t from, int32_t to, bool daily);
+  
+  // All chunks received, or session limit reached
+  bool Finished()
+  {
+    return next > to || Chunks >= BACKFILL_MAX_CHUNKS;
+  }
+  
+  // Chunk in flight
+  bool Busy()
+  {
+    return request >= 0;
+  }
+  
+  // Request the next chunk; records go to sink. Returns request id (>= 0) or error
+  int Begin(ProtocolManager *pm, HistoricYieldSink& sink);
+  
+  // Wait for the chunk in flight. Returns 0 when it was received completely (Cursor advanced), error otherwise
+  int Wait(ProtocolManager *pm);
+  
+  // All records up to and including this timestamp have been received
+  int32_t Cursor()
+  {
+    return (next - 1 < settled) ? next - 1 : settled;
+  }
+  
+  // Count records, pass them on to the sink
+  int Records(HistoricInfoItem *records, int no_records);
+};
+
+#endif
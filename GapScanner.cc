@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "Backfill.h"
+#include "YieldStore.h"
+#include "GapScanner.h"
+
+GapScanner::GapScanner(bool daily)
+{
+  step = (daily) ? 24 * 3600 : 300;
+  slack = (daily) ? 2 * 3600 : 150;
+  max_length = (daily) ? BACKFILL_CHUNK_DAILY : BACKFILL_CHUNK_5M;
+  previous = records = NULL;
+  NoRanges = 0;
+  Gaps = 0;
+  Truncated = false;
+  ScannedFrom = 0;
+  ScannedTo = -1;
+}
+
+int GapScanner::Scan(sqlite3 *db, int table, int32_t to)
+{
+  sqlite3_stmt *bounds = NULL, *checked = NULL;
+  char query[256];
+  int status = -1;
+  NoRanges = 0;
+  Gaps = 0;
+  Truncated = false;
+  ScannedFrom = 0;
+  ScannedTo = -1;
+  snprintf(query, sizeof(query), "SELECT MIN(timestamp), MAX(timestamp) FROM %s", YieldStore::Table(table));
+  if (sqlite3_prepare_v2(db, query, -1, &bounds, NULL) == SQLITE_OK)
+  {
+    snprintf(query, sizeof(query), "SELECT timestamp FROM %s WHERE timestamp < ? ORDER BY timestamp DESC LIMIT 1", YieldStore::Table(table));
+    sqlite3_prepare_v2(db, query, -1, &previous, NULL);
+    snprintf(query, sizeof(query), "SELECT timestamp FROM %s WHERE timestamp >= ? ORDER BY timestamp", YieldStore::Table(table));
+    sqlite3_prepare_v2(db, query, -1, &records, NULL);
+    sqlite3_prepare_v2(db, "SELECT from_timestamp, to_timestamp FROM checked_ranges WHERE series = ? AND to_timestamp >= ? "
+                           "ORDER BY from_timestamp", -1, &checked, NULL);
+  }
+  if (previous != NULL && records != NULL && checked != NULL)
+  {
+    status = 0;
+    if (sqlite3_step(bounds) == SQLITE_ROW && sqlite3_column_type(bounds, 0) != SQLITE_NULL)
+    {
+      int32_t start = sqlite3_column_int(bounds, 0);
+      int32_t last = sqlite3_column_int(bounds, 1);
+      last = (to < last) ? to : last;
+      // Walk the segments between the checked ranges
+      sqlite3_bind_text(checked, 1, YieldStore::Table(table), -1, SQLITE_STATIC);
+      sqlite3_bind_int(checked, 2, start);
+      while (status == 0 && !Truncated && start <= last && sqlite3_step(checked) == SQLITE_ROW)
+      {
+        int32_t checked_from = sqlite3_column_int(checked, 0);
+        int32_t checked_to = sqlite3_column_int(checked, 1);
+        if (checked_from > start)
+        {
+          status = Walk(start, (checked_from - 1 < last) ? checked_from - 1 : last);
+        }
+        if (checked_to >= last)
+        {
+          start = last + 1;
+          break;
+        }
+        start = (checked_to + 1 > start) ? checked_to + 1 : start;
+      }
+      if (status == 0 && !Truncated && start <= last)
+      {
+        status = Walk(start, last);
+      }
+      if (status == 0)
+      {
+        ScannedFrom = sqlite3_column_int(bounds, 0);
+        ScannedTo = (Truncated) ? Ranges[NoRanges - 1].To : last;
+      }
+    }
+  }
+  sqlite3_finalize(bounds);
+  sqlite3_finalize(checked);
+  sqlite3_finalize(previous);
+  sqlite3_finalize(records);
+  previous = records = NULL;
+  return status;
+}
+
+int GapScanner::Walk(int32_t from, int32_t to)
+{
+  // The record before the segment: a gap may start before it
+  bool found = false;
+  int32_t last = 0;
+  sqlite3_bind_int(previous, 1, from);
+  if (sqlite3_step(previous) == SQLITE_ROW)
+  {
+    last = sqlite3_column_int(previous, 0);
+    found = true;
+  }
+  sqlite3_reset(previous);
+  // The records in the segment, and the first one after it: a gap may end after it
+  int status = SQLITE_DONE;
+  sqlite3_bind_int(records, 1, from);
+  while (!Truncated && (status = sqlite3_step(records)) == SQLITE_ROW)
+  {
+    int32_t timestamp = sqlite3_column_int(records, 0);
+    if (found && timestamp - last > step + slack)
+    {
+      // The part of the gap in the segment; a part cut off by a checked range must still be long enough for a record
+      int32_t gap_from = (last + 1 > from) ? last + 1 : from;
+      int32_t gap_to = (timestamp - 1 < to) ? timestamp - 1 : to;
+      if (gap_to - gap_from + 1 >= step - slack)
+      {
+        Add(gap_from, gap_to);
+      }
+    }
+    last = timestamp;
+    found = true;
+    if (timestamp > to)
+    {
+      status = SQLITE_DONE;
+      break;
+    }
+  }
+  sqlite3_reset(records);
+  return (status == SQLITE_DONE || Truncated) ? 0 : -1;
+}
+
+void GapScanner::Add(int32_t from, int32_t to)
+{
+  Gaps++;
+  while (from <= to)
+  {
+    GapRange *range = (NoRanges > 0) ? &Ranges[NoRanges - 1] : NULL;
+    if (range != NULL && from - range->To <= GAP_MERGE_RECORDS * step && to - range->From < max_length)
+    {
+      // Close to the previous range: extend it
+      range->To = to;
+      return;
+    }
+    if (NoRanges == GAP_MAX_RANGES)
+    {
+      Truncated = true;
+      return;
+    }
+    // New range, split when longer than a chunk
+    range = &Ranges[NoRanges++];
+    range->From = from;
+    range->To = (to - from >= max_length) ? from + max_length - 1 : to;
+    from = range->To + 1;
+  }
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sqlite3.h>
+#include "ProtocolManager.h"
+
+#ifndef __GAP_SCANNER_H__
+#define __GAP_SCANNER_H__
+
+// Maximum number of ranges fetched per series in one session; more gaps are left for the next session
+#define GAP_MAX_RANGES                16
+// Gaps closer than this many records are fetched as one range: re-fetching the records between them costs less radio
+// time than the round trip of another request (a telegram carries up to 60 records)
+#define GAP_MERGE_RECORDS             60
+// Gap requests in flight at the same time
+#define GAP_IN_FLIGHT                 4
+
+// Range of missing records, from up to (including) to
+typedef struct
+{
+  int32_t From;
+  int32_t To;
+} GapRange;
+
+// Finds the missing 5 minute slots or days in a yield table, between its first record and a given time, and plans
+// the fewest GetHistoricYield ranges that cover them. Parts of the table in its checked ranges (see YieldStore) were
+// fetched completely or scanned before and are skipped without reading their records. The rest is walked in timestamp order
+// over the primary key, so a scan reads only the unchecked records and one index seek per unchecked segment. Gaps
+// closer than GAP_MERGE_RECORDS records are merged; ranges are at most a backfill chunk long.
+class GapScanner
+{
+  int32_t step;           // between records [s]
+  int32_t slack;          // tolerated deviation of the step (daylight saving time for days) [s]
+  int32_t max_length;     // of a range [s]
+  sqlite3_stmt *previous; // latest record before a timestamp
+  sqlite3_stmt *records;  // records from a timestamp on
+
+  // Find the gaps in unchecked segment [from, to]. Returns 0 on success
+  int Walk(int32_t from, int32_t to);
+
+  // Add gap [from, to] to the ranges
+  void Add(int32_t from, int32_t to);
+
+  public:
+
+  GapRange Ranges[GAP_MAX_RANGES];
+  int NoRanges;
+  uint32_t Gaps;          // gaps found (counted before merging)
+  bool Truncated;         // more gaps than GAP_MAX_RANGES ranges: the rest is left for the next session
+  int32_t ScannedFrom;    // part of the table that was scanned, up to the last range when truncated (ScannedTo <
+  int32_t ScannedTo;      // ScannedFrom: none). Outside the ranges it has no gaps
+
+  GapScanner(bool daily);
+
+  // Scan yield table (YIELD_5M or YIELD_DAILY) for gaps between its first record and min(to, its last record).
+  // Returns 0 on success, -1 on a database error
+  int Scan(sqlite3 *db, int table, int32_t to);
+};
+
+#endif
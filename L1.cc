@@ -7,31 +7,81 @@
 #include "L1.h"
 
 
-  // Read L1 packet from stream  
-  bool L1Packet::Read(int s)
+  // Read L1 packet from stream. Only reads from the stream when no complete packet is buffered
+  bool L1Packet::Read(L1Reader *reader, double deadline)
   {
-    // Read (blocking) L1_BodyLength bytes. Either gets the data, or time out
-    int bytes_read = read(s, &packet, L1_BodyLength);
-    if (bytes_read != L1_BodyLength || !CheckCheckSum())
-    { // Time-out, connection broken, packet invalid: return false
-      return false;
-    }
-           
-    // Read data, when present
-    if (packet.length > L1_BodyLength)
+    while (!reader->Next((uint8_t *) &packet))
     {
-      uint8_t data_length = packet.length - L1_BodyLength; 
-      bytes_read = read(s, (((char *) &packet) + L1_BodyLength), data_length);
-      if (bytes_read != data_length)
-      { // Failure reading data
+      // Read (blocking) more data. Either gets data, or time out
+      if (reader->Fill(deadline) <= 0)
+      { // Time-out, connection broken: return false
         return false;
       }
     }
-    
     // Success
     return true;    
   }
   
+  // Read available bytes from stream, append to buffer
+  int L1Reader::Fill(double deadline)
+  {
+    // Move unprocessed bytes (at most one partial packet) to the start of the buffer
+    if (start > 0)
+    {
+      memmove(buffer, buffer + start, end - start);
+      end -= start;
+      start = 0;
+    }
+    int bytes_read = (deadline > 0) ? t->Read(buffer + end, L1_ReadBufferSize - end, deadline) : t->Read(buffer + end, L1_ReadBufferSize - end);
+    Reads++;
+    TimedOut = (bytes_read == TRANSPORT_TIMED_OUT);
+    if (bytes_read > 0)
+    {
+      end += bytes_read;
+    }
+    return bytes_read;
+  }
+  
+  // Extract next complete packet from buffer. Skips garbage up to the next valid packet header.
+  bool L1Reader::Next(uint8_t *packet)
+  {
+    while (end - start >= L1_BodyLength)
+    {
+      uint8_t *p = buffer + start;
+      // Resync: scan for identity byte
+      if (p[0] != L1_Identity)
+      {
+        uint8_t *next = (uint8_t *) memchr(p + 1, L1_Identity, end - start - 1);
+        int skip = (next == NULL) ? (end - start) : (next - p);
+        BytesSkipped += skip;
+        start += skip;
+        continue;
+      }
+      // Check header: checksum and length (identity, length, unknown, check)
+      if ((p[0] ^ p[1] ^ p[2]) != p[3] || p[1] < L1_BodyLength)
+      { // Not a packet header, skip the identity byte
+        BytesSkipped++;
+        start++;
+        continue;
+      }
+      // Complete packet present?
+      if (end - start < p[1])
+      {
+        break;
+      }
+      // Return packet
+      memcpy(packet, p, p[1]);
+      start += p[1];
+      Packets++;
+      return true;
+    }
+    // Empty buffer: start at the front again
+    if (start == end)
+    {
+      start = end = 0;
+    }
+    return false;
+  }
   // Set packet header info
   void L1Packet::SetHeader(bdaddr_t *source, bdaddr_t *destination, uint16_t command)
   {
@@ -42,10 +92,23 @@
     memcpy(&packet.destination, destination, sizeof(bdaddr_t));
   }
   
+  // Write complete header of a packet with data_length data bytes
+  void L1Packet::WriteHeader(uint8_t *destination, bdaddr_t *source, bdaddr_t *destination_mac, uint16_t command, int data_length)
+  {
+    L1Packet_t *p = (L1Packet_t *) destination;
+    p->identity = L1_Identity;
+    p->length = L1_BodyLength + data_length;
+    p->unknown = 0;
+    p->check = p->identity ^ p->length ^ p->unknown;
+    memcpy(&p->source, source, sizeof(bdaddr_t));
+    memcpy(&p->destination, destination_mac, sizeof(bdaddr_t));
+    p->command = htobs(command);
+  }
+  
   // Send packet including data. Returns number of bytes sent.
-  int L1Packet::Send(int s, uint8_t *data, int length)  
+  int L1Packet::Send(Transport *t, uint8_t *data, int length)  
   {
     SetData(data, length);    
     SetCheckSum();            
-    return write(s, &packet, packet.length) == packet.length;              
+    return t->Write((uint8_t *) &packet, packet.length) == packet.length;              
   }
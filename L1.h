@@ -4,6 +4,10 @@
 #include <fcntl.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
+#include "Transport.h"
+
+#ifndef __L1_H__
+#define __L1_H__
 
 // Command values
 #define L1_Command_L2_Packet          0x0001
@@ -26,6 +30,9 @@
 // Identity byte at start of packet
 #define L1_Identity                   0x7e                                            
 
+// Size of the receive buffer of L1Reader (holds many complete packets)
+#define L1_ReadBufferSize             4096
+
 // L1 packet structure
 typedef struct __attribute__ ((__packed__)) 
 {
@@ -60,6 +67,60 @@ typedef struct __attribute__ ((__packed__))
 } L1BluetoothStrengthData_t;
 
 
+// Buffered reader of L1 packets from a transport. Reads as many bytes as are available in a single read() call
+// and extracts complete packets from its buffer. Partial packets are kept until the rest arrives. On garbage
+// (wrong identity byte, wrong header checksum) it scans forward to the next identity byte.
+class L1Reader
+{
+  uint8_t buffer[L1_ReadBufferSize];
+  int start;          // first unprocessed byte in buffer
+  int end;            // end of received data in buffer
+  Transport *t;       // stream
+  
+  public:
+  
+  // Number of bytes skipped while resynchronizing
+  uint32_t BytesSkipped;
+  // Number of read() calls and packets extracted
+  uint32_t Reads;
+  uint32_t Packets;
+  // Last Fill ended because its deadline passed
+  bool TimedOut;
+  
+  L1Reader()
+  {
+    Attach(NULL);
+  }
+  
+  // Use given transport, drop buffered data
+  void Attach(Transport *transport)
+  {
+    t = transport;
+    start = end = 0;
+    BytesSkipped = Reads = Packets = 0;
+    TimedOut = false;
+  }
+  
+  // Number of buffered bytes not yet returned as packet
+  int Buffered()
+  {
+    return end - start;
+  }
+  
+  // Wait at most timeout_ms [ms] for data. Returns > 0 when data is buffered or can be read, 0 on time-out, < 0 on error
+  int Poll(int timeout_ms)
+  {
+    return (Buffered() > 0) ? 1 : t->Poll(timeout_ms);
+  }
+  
+  // Read (blocking) available bytes from stream, waiting until deadline at most (0: no deadline, the transport's
+  // time-out applies). Returns number of bytes read, 0 on end of stream, < 0 on time-out/error
+  int Fill(double deadline = 0);
+  
+  // Extract next complete packet from the buffer. Returns false when no complete packet is buffered
+  bool Next(uint8_t *packet);
+};
+
 // Class around L1Packet_t
 class L1Packet
 {
@@ -81,11 +142,20 @@ class L1Packet
   // Set packet header info
   void SetHeader(bdaddr_t *source, bdaddr_t *destination, uint16_t command);
   
+  // Write complete header (L1_BodyLength bytes, including length and checksum) of a packet with data_length data bytes
+  static void WriteHeader(uint8_t *destination, bdaddr_t *source, bdaddr_t *destination_mac, uint16_t command, int data_length);
+  
   // Send packet including data
-  int Send(int s, uint8_t *data, int length);
+  int Send(Transport *t, uint8_t *data, int length);
   
-  // Read L1 packet from stream  
-  bool Read(int s);
+  // Read L1 packet from stream (through buffered reader), waiting until deadline at most (0: no deadline)
+  bool Read(L1Reader *reader, double deadline = 0);
+  
+  // Take next packet from the reader's buffer, without reading from the stream. Returns false when none is buffered
+  bool Take(L1Reader *reader)
+  {
+    return reader->Next((uint8_t *) &packet);
+  }
              
   // Return data (and length of data in len)
   uint8_t *Data(int* len)
@@ -161,3 +231,4 @@ class L1Packet
   } 
 };
 
+#endif
@@ -27,6 +27,34 @@ int L2Packet::ReadPacket(uint8_t *data, int len)
     int new_len = UnescapeData(data + 1, len - 1) + 1;
     // Get checksum
     uint16_t fcs = (uint16_t) data[new_len-3] + (((uint16_t)data[new_len-2])<<8);    
+    return ReadUnescaped(data, new_len - 3, fcs);
+}
+
+// Reconstruct request from data (alters content of data!). Requests carry their checksum unescaped (see PreparePacket),
+// so it is taken from the end before the header and data are unescaped.
+int L2Packet::ReadRequest(uint8_t *data, int len)
+{
+    if (data == NULL || len < (int) sizeof(L2PacketHeader) + 3)
+    {
+      return ERR_SMA_INVALID_PACKET;
+    }
+    if (data[0] != L2_head || data[len-1] != L2_tail)
+    {
+      return ERR_SMA_INVALID_PACKET;
+    }
+    uint16_t fcs = (uint16_t) data[len-3] + (((uint16_t)data[len-2])<<8);
+    int new_len = UnescapeData(data + 1, len - 4) + 1;
+    return ReadUnescaped(data, new_len, fcs);
+}
+
+// Check header and checksum of an unescaped packet of length bytes (head byte, header, and data), move the data to the
+// start. Returns data length or < 0 on failure.
+int L2Packet::ReadUnescaped(uint8_t *data, int length, uint16_t fcs)
+{
+    if (length < (int) sizeof(L2PacketHeader))
+    {
+      return ERR_SMA_INVALID_PACKET;
+    }
     // Copy header part to header
     memcpy((uint8_t *) &header, data, sizeof(L2PacketHeader));
     // Check header
@@ -34,8 +62,8 @@ int L2Packet::ReadPacket(uint8_t *data, int len)
     { // No match...
       return ERR_SMA_INVALID_PACKET;
     }
-    // Calculate length of data portion    
-    int data_length = new_len - sizeof(L2PacketHeader) - 3;   // data length: total length minus header minus checksum minus end byte    
+    // Calculate length of data portion: total length minus header
+    int data_length = length - sizeof(L2PacketHeader);
     // Copy data to data
     memmove(data, data + sizeof(L2PacketHeader), data_length);    
     // Check checksum (checksum is calculate over header, copied in code above, and the data)
@@ -51,67 +79,232 @@ int L2Packet::ReadPacket(uint8_t *data, int len)
 }
   
 
-// Escape L2 packet (make it ready for sending as payload of L1 packets) and add checksum and footer. User should free returned array.
-uint8_t* L2Packet::PreparePacket(const uint8_t *data, int data_length, int *len)
+// Escape L2 packet (make it ready for sending as payload of L1 packets) and add checksum and footer. The result is
+// written to destination, which should hold L2_MaxPacketLength bytes. Returns length of the result.
+// The checksum of a request is sent unescaped, as it always has been: inverters accept it, and there is no trace of
+// one that expects it escaped. Replies from the inverter do escape it, see PrepareReply.
+int L2Packet::PreparePacket(uint8_t *destination, const uint8_t *data, int data_length)
 {
-  std::vector<uint8_t> result;
-  uint8_t *p = (uint8_t*) &header;
-  // Set packet length
-  header.length = (sizeof(L2PacketHeader) - 5 + data_length) / 4;
-  // Add first byte of header without escaping (0x7E)
-  result.push_back(*p++);
-  // Add escaped header  
-  EscapeData(result, p, sizeof(L2PacketHeader)-1);
-  // Add escaped data
-  EscapeData(result, data, data_length);
-  // Calculate and add checksum
-  uint16_t fcs = CheckSum(data, data_length);
-  result.push_back((uint8_t) (fcs&0xFF));
-  result.push_back((uint8_t) ((fcs>>8)&0xFF));
-  result.push_back(L2_tail);
-  // Return result. Make a copy, something nasty with local variables and references. Don't know how to do it differently (get internal buffer, ...)
-  p = (uint8_t *) malloc(result.size());
-  memcpy(p, (uint8_t *) result.data(), result.size()); // &result[0] works
-  *len = (int) result.size();
+  uint16_t fcs;
+  int length = EscapePacket(destination, data, data_length, &fcs);
+  // Add checksum and footer
+  destination[length++] = (uint8_t) (fcs&0xFF);
+  destination[length++] = (uint8_t) ((fcs>>8)&0xFF);
+  destination[length++] = L2_tail;
 #ifdef __DEBUG  
 printf("packet index: %d\n", PacketIndex());  
 #endif        
-  return p;  
+  return length;  
 }
 
-// Calculate PPP checksum, http://tools.ietf.org/html/rfc1662#page-19 and https://github.com/stuartpittaway/nanodesmapvmonitor  
-uint16_t L2Packet::CheckSum(const uint8_t *data, int data_length)
+// Escape L2 packet as the inverter sends it: the checksum is escaped like the data
+int L2Packet::PrepareReply(uint8_t *destination, const uint8_t *data, int data_length, uint16_t fcs_error)
 {
-  uint16_t fcs = 0xFFFF;
-  const uint8_t *p;
-  
-  // Checksum over header (excluding first byte) [could be optimized using real pointer addressing]
-  p = (uint8_t *) &header;
-  for(int i = 1; i < sizeof(L2PacketHeader); i++) 
-  {        
-    fcs = (fcs >> 8) ^ fcstab[(fcs ^ p[i]) & 0xff];
+  uint16_t fcs;
+  int length = EscapePacket(destination, data, data_length, &fcs);
+  fcs ^= fcs_error;
+  uint8_t checksum[2] = { (uint8_t) (fcs&0xFF), (uint8_t) ((fcs>>8)&0xFF) };
+  length += EscapeData(destination + length, checksum, sizeof(checksum));
+  destination[length++] = L2_tail;
+  return length;
+}
+
+// Write head byte, escaped header and data to destination, and return the length. The checksum of header and data is
+// calculated while they are in cache.
+int L2Packet::EscapePacket(uint8_t *destination, const uint8_t *data, int data_length, uint16_t *fcs)
+{
+  const uint8_t *p = ((uint8_t *) &header) + 1;
+  int length = 0;
+  // Set packet length
+  header.length = (sizeof(L2PacketHeader) - 5 + data_length) / 4;
+  // Add first byte of header without escaping (0x7E)
+  destination[length++] = header.head;
+  *fcs = FCS16Update(FCS16_INIT, p, sizeof(L2PacketHeader)-1);
+  length += EscapeData(destination + length, p, sizeof(L2PacketHeader)-1);
+  *fcs = FCS16Final(FCS16Update(*fcs, data, data_length));
+  length += EscapeData(destination + length, data, data_length);
+  return length;
+}
+
+// Encode request from template: copy the precomputed part, escape and checksum packet index, command, and data
+int L2FrameTemplate::Encode(uint8_t *destination, uint8_t packet_index, const uint8_t *data, int length) const
+{
+  uint8_t tail[6];
+  if (length != data_length || length > L2_MaxDataLength)
+  {
+    return ERR_SMA_INVALID_PACKET;
+  }
+  memcpy(destination, prefix, prefix_length);
+  int result = prefix_length;
+  tail[0] = packet_index;
+  memcpy(tail + 1, command, 5);
+  uint16_t fcs = FCS16Update(this->fcs, tail, sizeof(tail));
+  result += L2Packet::EscapeData(destination + result, tail, sizeof(tail));
+  fcs = FCS16Final(FCS16Update(fcs, data, length));
+  result += L2Packet::EscapeData(destination + result, data, length);
+  // Add checksum and footer
+  destination[result++] = (uint8_t) (fcs&0xFF);
+  destination[result++] = (uint8_t) ((fcs>>8)&0xFF);
+  destination[result++] = L2_tail;
+  return result;
+}
+
+// Add escaped part of a packet: unescape to the buffer, check header as soon as it is complete, update checksum
+int L2Decoder::Add(const uint8_t *data, int data_length)
+{
+  if (status < 0 || data_length <= 0)
+  {
+    return status;
+  }
+  // Unescaped data is never longer than the escaped data
+  if (length + data_length > L2_MaxReceiveLength)
+  {
+    return status = ERR_SMA_INVALID_PACKET;
+  }
+  last = data[data_length-1];
+  // First byte of the packet is not escaped
+  if (length == 0)
+  {
+    if (data[0] != L2_head)
+    {
+      return status = ERR_SMA_INVALID_PACKET;
+    }
+    buffer[length++] = *data++;
+    data_length--;
+    checked = 1;
+  }
+  // Escape byte at the end of the previous part
+  if (escape && data_length > 0)
+  {
+    buffer[length++] = *data++ ^ 0x20;
+    data_length--;
+    escape = false;
+  }
+  // An odd number of escape bytes at the end: the last one escapes the first byte of the next part
+  int n = 0;
+  while (n < data_length && data[data_length-1-n] == 0x7D)
+  {
+    n++;
+  }
+  if (n & 1)
+  {
+    escape = true;
+    data_length--;
+  }
+  int previous_length = length;
+  length += L2Packet::UnescapeData(buffer + length, data, data_length);
+  // Check header as soon as it is complete
+  if (previous_length < (int) sizeof(L2PacketHeader) && length >= (int) sizeof(L2PacketHeader))
+  {
+    if (memcmp(Header()->header, L2_default_header, sizeof(L2_default_header)))
+    {
+      return status = ERR_SMA_INVALID_PACKET;
+    }
+  }
+  // Checksum everything except the last three bytes, which may be checksum and footer
+  if (length - 3 > checked)
+  {
+    fcs = FCS16Update(fcs, buffer + checked, length - 3 - checked);
+    checked = length - 3;
+  }
+  return 0;
+}
+
+// All parts added; check footer and checksum
+int L2Decoder::Finish()
+{
+  if (status < 0)
+  {
+    return status;
+  }
+  // Escape byte at the end is kept as data
+  if (escape)
+  {
+    buffer[length++] = 0x7D;
+    escape = false;
+  }
+  if (length < (int) sizeof(L2PacketHeader) + 3 || last != L2_tail)
+  {
+    return status = ERR_SMA_INVALID_PACKET;
+  }
+  if (length - 3 > checked)
+  {
+    fcs = FCS16Update(fcs, buffer + checked, length - 3 - checked);
+    checked = length - 3;
+  }
+  uint16_t expected_fcs = (uint16_t) buffer[length-3] + (((uint16_t) buffer[length-2]) << 8);
+  if (FCS16Final(fcs) != expected_fcs)
+  {
+    return status = ERR_SMA_L2_CHECKSUM;
+  }
+  return length - sizeof(L2PacketHeader) - 3;
+}
+
+// Slicing-by-8 tables: fcstab8[0] is fcstab, fcstab8[k][i] is the state after feeding byte i followed by k zero bytes
+static uint16_t fcstab8[8][256];
+
+// Fill slicing tables at program start
+static struct FCS16Tables
+{
+  FCS16Tables()
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      fcstab8[0][i] = fcstab[i];
+    }
+    for (int k = 1; k < 8; k++)
+    {
+      for (int i = 0; i < 256; i++)
+      {
+        uint16_t fcs = fcstab8[k-1][i];
+        fcstab8[k][i] = (fcs >> 8) ^ fcstab[fcs & 0xff];
+      }
+    }
+  }
+} fcs16_tables;
+
+// Update PPP checksum state, http://tools.ietf.org/html/rfc1662#page-19. Eight bytes per step, remainder byte-wise.
+uint16_t FCS16Update(uint16_t fcs, const uint8_t *p, int length)
+{
+  while (length >= 8)
+  {
+    uint16_t x = fcs ^ (p[0] | (p[1] << 8));
+    fcs = fcstab8[7][x & 0xff] ^ fcstab8[6][x >> 8] ^ 
+          fcstab8[5][p[2]] ^ fcstab8[4][p[3]] ^ fcstab8[3][p[4]] ^ 
+          fcstab8[2][p[5]] ^ fcstab8[1][p[6]] ^ fcstab8[0][p[7]];
+    p += 8;
+    length -= 8;
   }
-  // Checksum over data [dito, (*p++) style]
-  p = data;
-  for (int i = 0; i < data_length; i++)
+  while (length-- > 0)
   {
-    fcs = (fcs >> 8) ^ fcstab[(fcs ^ p[i]) & 0xff];
+    fcs = (fcs >> 8) ^ fcstab[(fcs ^ *p++) & 0xff];
   }
-  // Final xor
-  fcs =fcs ^ 0xffff;
   return fcs;
+}
+
+// Calculate PPP checksum over header (excluding first byte) and data, https://github.com/stuartpittaway/nanodesmapvmonitor  
+uint16_t L2Packet::CheckSum(const uint8_t *data, int data_length)
+{
+  uint16_t fcs = FCS16Update(FCS16_INIT, ((uint8_t *) &header) + 1, sizeof(L2PacketHeader) - 1);
+  fcs = FCS16Update(fcs, data, data_length);
+  return FCS16Final(fcs);
 } 
 
 
-// Unescape data in-place, return length of data.
-int L2Packet::UnescapeData(uint8_t *src, int length)
+// Returns true when byte c has to be escaped
+static inline bool NeedsEscape(uint8_t c)
+{
+  return c == 0x7D || c == 0x7E || c == 0x11 || c == 0x12 || c == 0x13;
+}
+
+// Unescape length bytes from src to dest (dest <= src when they overlap), return length of unescaped data. Reference implementation.
+static int UnescapeScalar(uint8_t *dest, const uint8_t *src, int length)
 {
-  uint8_t *dest = src;
   int d_len = 0;
   for (int i = 0; i < length; i++)
   {
     int c = src[i]; 
-    if (c == 0x7D && i < (length-1))  // can be made faster
+    if (c == 0x7D && i < (length-1))
     {
       i++;
       *dest++ = src[i]^0x20;            
@@ -125,21 +318,213 @@ int L2Packet::UnescapeData(uint8_t *src, int length)
   return d_len;
 }
 
-// Escape data, append to destination vector
-void L2Packet::EscapeData(std::vector<uint8_t>& destination, const uint8_t *src, unsigned int length)
+// Escape data into destination, return length of escaped data. Reference implementation.
+static int EscapeScalar(uint8_t *destination, const uint8_t *src, int length)
 {
+  uint8_t *dest = destination;
   for (int i = 0; i < length; i++)
   { 
-    uint8_t c = *src;
-    if (c == 0x7D || c == 0x7E || c == 0x11 || c == 0x12 || c == 0x13) 
+    uint8_t c = src[i];
+    if (NeedsEscape(c)) 
     {
-      destination.push_back(0x7D);
-      destination.push_back(c ^0x20);
+      *dest++ = 0x7D;
+      *dest++ = c ^ 0x20;
     }
     else
     { 
-      destination.push_back(c);
+      *dest++ = c;
+    }
+  }
+  return dest - destination;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// SIMD versions: find bytes that need (un)escaping 16 or 32 bytes at a time and copy clean blocks in bulk. Blocks 
+// containing such bytes, and the tail, are handled by the scalar code.
+
+__attribute__((target("sse2")))
+static int EscapeSSE2(uint8_t *destination, const uint8_t *src, int length)
+{
+  uint8_t *dest = destination;
+  const __m128i e7d = _mm_set1_epi8(0x7D), e7e = _mm_set1_epi8(0x7E);
+  const __m128i e11 = _mm_set1_epi8(0x11), e12 = _mm_set1_epi8(0x12), e13 = _mm_set1_epi8(0x13);
+  int i = 0;
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, e7d), _mm_cmpeq_epi8(v, e7e)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, e11), _mm_cmpeq_epi8(v, e12)), _mm_cmpeq_epi8(v, e13)));
+    unsigned int mask = _mm_movemask_epi8(m);
+    // Copy block, keep the clean bytes before the first byte to escape, escape the rest of the block
+    _mm_storeu_si128((__m128i *) dest, v);
+    if (mask == 0)
+    {
+      dest += 16;
+    }
+    else
+    {
+      int n = __builtin_ctz(mask);
+      dest += n;
+      dest += EscapeScalar(dest, src + i + n, 16 - n);
     }
-    src++;
   }
+  dest += EscapeScalar(dest, src + i, length - i);
+  return dest - destination;
+}
+
+__attribute__((target("sse2")))
+static int UnescapeSSE2(uint8_t *destination, const uint8_t *src, int length)
+{
+  uint8_t *dest = destination;
+  const __m128i e7d = _mm_set1_epi8(0x7D);
+  int i = 0;
+  while (i + 16 <= length)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, e7d));
+    if (mask == 0)
+    { // Clean block. In-place, the write position never passes the read position
+      _mm_storeu_si128((__m128i *) dest, v);
+      dest += 16;
+      i += 16;
+      continue;
+    }
+    // Block contains escape bytes: unescape scalar up to the end of the block
+    int end = i + 16;
+    while (i < end)
+    {
+      uint8_t c = src[i];
+      if (c == 0x7D && i < (length-1))
+      {
+        *dest++ = src[i+1] ^ 0x20;
+        i += 2;
+      }
+      else
+      {
+        *dest++ = c;
+        i++;
+      }
+    }
+  }
+  return (dest - destination) + UnescapeScalar(dest, src + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static int EscapeAVX2(uint8_t *destination, const uint8_t *src, int length)
+{
+  uint8_t *dest = destination;
+  const __m256i e7d = _mm256_set1_epi8(0x7D), e7e = _mm256_set1_epi8(0x7E);
+  // 0x11, 0x12, 0x13: (c - 0x11) < 3 unsigned, i.e. min(c - 0x11, 2) == c - 0x11
+  const __m256i e11 = _mm256_set1_epi8(0x11), two = _mm256_set1_epi8(2);
+  int i = 0;
+  for (; i + 32 <= length; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i d = _mm256_sub_epi8(v, e11);
+    __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, e7d), _mm256_cmpeq_epi8(v, e7e)),
+                                _mm256_cmpeq_epi8(_mm256_min_epu8(d, two), d));
+    unsigned int mask = _mm256_movemask_epi8(m);
+    // Copy block, keep the clean bytes before the first byte to escape, escape the rest of the block
+    _mm256_storeu_si256((__m256i *) dest, v);
+    if (mask == 0)
+    {
+      dest += 32;
+    }
+    else
+    {
+      int n = __builtin_ctz(mask);
+      dest += n;
+      dest += EscapeScalar(dest, src + i + n, 32 - n);
+    }
+  }
+  dest += EscapeSSE2(dest, src + i, length - i);
+  return dest - destination;
+}
+
+__attribute__((target("avx2")))
+static int UnescapeAVX2(uint8_t *destination, const uint8_t *src, int length)
+{
+  uint8_t *dest = destination;
+  const __m256i e7d = _mm256_set1_epi8(0x7D);
+  int i = 0;
+  while (i + 32 <= length)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, e7d));
+    if (mask == 0)
+    { // Clean block. In-place, the write position never passes the read position
+      _mm256_storeu_si256((__m256i *) dest, v);
+      dest += 32;
+      i += 32;
+      continue;
+    }
+    // Block contains escape bytes: unescape scalar up to the end of the block
+    int end = i + 32;
+    while (i < end)
+    {
+      uint8_t c = src[i];
+      if (c == 0x7D && i < (length-1))
+      {
+        *dest++ = src[i+1] ^ 0x20;
+        i += 2;
+      }
+      else
+      {
+        *dest++ = c;
+        i++;
+      }
+    }
+  }
+  return (dest - destination) + UnescapeScalar(dest, src + i, length - i);
+}
+
+#endif
+
+// Selected implementations
+static int (*escape_kernel)(uint8_t *, const uint8_t *, int) = EscapeScalar;
+static int (*unescape_kernel)(uint8_t *, const uint8_t *, int) = UnescapeScalar;
+
+// Select (un)escape implementation
+int L2SelectKernel(int kernel)
+{
+  escape_kernel = EscapeScalar;
+  unescape_kernel = UnescapeScalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (kernel >= L2_KERNEL_AVX2 && __builtin_cpu_supports("avx2"))
+  {
+    escape_kernel = EscapeAVX2;
+    unescape_kernel = UnescapeAVX2;
+    return L2_KERNEL_AVX2;
+  }
+  if (kernel >= L2_KERNEL_SSE2 && __builtin_cpu_supports("sse2"))
+  {
+    escape_kernel = EscapeSSE2;
+    unescape_kernel = UnescapeSSE2;
+    return L2_KERNEL_SSE2;
+  }
+#endif
+  return L2_KERNEL_SCALAR;
+}
+
+// Use best implementation from program start
+static int l2_kernel = L2SelectKernel(L2_KERNEL_AVX2);
+
+// Unescape data in-place, return length of data.
+int L2Packet::UnescapeData(uint8_t *src, int length)
+{
+  return unescape_kernel(src, src, length);
+}
+
+// Unescape data from src to destination (destination <= src when they overlap), return length of data.
+int L2Packet::UnescapeData(uint8_t *destination, const uint8_t *src, int length)
+{
+  return unescape_kernel(destination, src, length);
+}
+
+// Escape data into destination, return length of escaped data
+int L2Packet::EscapeData(uint8_t *destination, const uint8_t *src, int length)
+{
+  return escape_kernel(destination, src, length);
 }
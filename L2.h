@@ -16,32 +16,50 @@
 #define ERR_SMA_L2_CHECKSUM           -2
 #define ERR_SMA_INVALID_PACKET        -3
 
+// Maximum length of the data of an L2 packet we send, and of the resulting escaped packet
+#define L2_MaxDataLength              64
+#define L2_MaxPacketLength            (2 * (sizeof(L2PacketHeader) - 1 + L2_MaxDataLength) + 4)
+// Length of an escaped reply (see L2Packet::PrepareReply) with data_length data bytes, at most
+#define L2_MaxReplyLength(data_length) (2 * (sizeof(L2PacketHeader) - 1 + (data_length) + 2) + 2)
+
+// Buffer size for a received (unescaped) L2 packet. The length field in the header counts 4-byte words.
+#define L2_MaxReceiveLength           2048
+
 // Head & tail bytes
 #define L2_head     0x7e
 #define L2_tail     0x7e
 
 // Default header, destination, and source
-const uint8_t L2_default_header[] = { 0xff, 0x03, 0x60, 0x65 };
-const uint8_t L2_default_destination[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-const uint8_t L2_default_source[] = { 0x5c, 0xaf, 0xf0, 0x1d, 0x50, 0x00 };
+constexpr uint8_t L2_default_header[] = { 0xff, 0x03, 0x60, 0x65 };
+constexpr uint8_t L2_default_destination[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+constexpr uint8_t L2_default_source[] = { 0x5c, 0xaf, 0xf0, 0x1d, 0x50, 0x00 };
 
 // Collection of commands & corresponding data
 
 // L2: login 1. Inverter sends L2 packet in reply
-const uint8_t L2_command_login_1[5] = { 0x80, 0x00, 0x02, 0x00, 0x00};
-const uint8_t L2_data_login_1[8] = { 0, 0, 0, 0, 0, 0, 0, 0};
+constexpr uint8_t L2_command_login_1[5] = { 0x80, 0x00, 0x02, 0x00, 0x00};
+constexpr uint8_t L2_data_login_1[8] = { 0, 0, 0, 0, 0, 0, 0, 0};
 // L2: login 2. Inverter does not reply
-const uint8_t L2_command_login_2[5] = { 0x80, 0x0E, 0x01, 0xFD, 0xFF};
-const uint8_t L2_data_login_2[4] = { 0xFF, 0xFF, 0xFF, 0xFF};
+constexpr uint8_t L2_command_login_2[5] = { 0x80, 0x0E, 0x01, 0xFD, 0xFF};
+constexpr uint8_t L2_data_login_2[4] = { 0xFF, 0xFF, 0xFF, 0xFF};
 // L2: logon. Replace data bytes 16...27 by the password (byte values + 0x88)
-const uint8_t L2_command_logon[5] = { 0x80, 0x0C, 0x04, 0xFD, 0xFF };
-const uint8_t L2_data_logon[28] = { 0x07, 0x00, 0x00, 0x00, 0x84, 0x03, 0x00, 0x00, 0xAA, 0xAA, 0xBB, 0xBB, 0x00, 0x00, 0x00, 0x00, 0,0,0,0,0,0,0,0,0,0,0,0 };
+constexpr uint8_t L2_command_logon[5] = { 0x80, 0x0C, 0x04, 0xFD, 0xFF };
+constexpr uint8_t L2_data_logon[28] = { 0x07, 0x00, 0x00, 0x00, 0x84, 0x03, 0x00, 0x00, 0xAA, 0xAA, 0xBB, 0xBB, 0x00, 0x00, 0x00, 0x00, 0,0,0,0,0,0,0,0,0,0,0,0 };
 // L2: request daily yield, total yield, feed-in time, ...
-const uint8_t L2_command_daily_yield[5] = { 0x80, 0x00, 0x02, 0x00, 0x54 };    
-const uint8_t L2_data_daily_yield[8] = { 0x00, 0x00, 0x20, 0x00, 0xff, 0xff, 0x5f, 0x00 };
+constexpr uint8_t L2_command_daily_yield[5] = { 0x80, 0x00, 0x02, 0x00, 0x54 };    
+constexpr uint8_t L2_data_daily_yield[8] = { 0x00, 0x00, 0x20, 0x00, 0xff, 0xff, 0x5f, 0x00 };
+// L2: request spot values (AC, inverter status/temperature, DC) in a range of value codes, see L2_data_value_range
+constexpr uint8_t L2_command_spot_ac[5] = { 0x80, 0x00, 0x02, 0x00, 0x51 };
+constexpr uint8_t L2_command_spot_status[5] = { 0x80, 0x00, 0x02, 0x00, 0x52 };
+constexpr uint8_t L2_command_spot_dc[5] = { 0x80, 0x00, 0x02, 0x80, 0x53 };
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t first;         // first value code << 8
+  uint32_t last;          // last value code << 8 | 0xFF
+} L2_data_value_range;
 // L2: request historic 5 min interval data
-const uint8_t L2_command_historic_yield_5[5] = { 0x80, 0x00, 0x02, 0x00, 0x70 };
-const uint8_t L2_command_historic_yield_daily[5] = { 0x80, 0x00, 0x02, 0x20, 0x70 };
+constexpr uint8_t L2_command_historic_yield_5[5] = { 0x80, 0x00, 0x02, 0x00, 0x70 };
+constexpr uint8_t L2_command_historic_yield_daily[5] = { 0x80, 0x00, 0x02, 0x20, 0x70 };
 typedef struct __attribute__ ((__packed__))
 {
   uint32_t timestamp_from;
@@ -49,9 +67,10 @@ typedef struct __attribute__ ((__packed__))
 } L2_data_historic_yield; 
 
 // checksum: uint16 0xFFFF
+#define FCS16_INIT  0xFFFF
 
 // Copied from nanodesmapvmonitor
-const uint16_t  fcstab[256]  = {
+constexpr uint16_t  fcstab[256]  = {
   0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
   0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
   0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
@@ -62,6 +81,16 @@ const uint16_t  fcstab[256]  = {
   0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
 }; 
 
+// Update FCS-16 (PPP checksum) state with length bytes. Start with FCS16_INIT; can be called repeatedly, e.g. per
+// fragment. Processes 8 bytes per step (slicing-by-8).
+uint16_t FCS16Update(uint16_t fcs, const uint8_t *data, int length);
+
+// Final checksum value from FCS-16 state
+inline uint16_t FCS16Final(uint16_t fcs)
+{
+  return fcs ^ 0xFFFF;
+}
+
 typedef struct __attribute__ ((__packed__))
 {
   uint8_t head;
@@ -81,6 +110,77 @@ typedef struct __attribute__ ((__packed__))
   uint8_t command[5];           // command
 } L2PacketHeader;
 
+// Number of header bytes (after the head byte) that are the same for every request sent with the same command: up to
+// and including the telegram number. Packet index, command, and data follow.
+#define L2_FixedHeaderLength          26
+
+// Request frame with the fixed part of the header escaped and checksummed at compile time. Sending a request only
+// needs encoding of the packet index, command, and data. Create with L2FrameTemplate::Make.
+struct L2FrameTemplate
+{
+  uint8_t prefix[1 + 2 * L2_FixedHeaderLength];   // head byte and escaped fixed header bytes
+  int prefix_length;
+  uint16_t fcs;                                   // FCS-16 state after the fixed header bytes
+  uint8_t command[5];
+  int data_length;                                // length of the data sent with the command
+  
+  // Header values for the given command with data_length data bytes
+  static constexpr L2FrameTemplate Make(uint8_t destination_prefix, uint8_t source_prefix, uint8_t mystery_1b, const uint8_t (&command)[5], int data_length)
+  {
+    L2FrameTemplate t = {};
+    // Same as the header of a default L2Packet after SetFields
+    uint8_t h[L2_FixedHeaderLength] = {};
+    for (int i = 0; i < 4; i++)
+    {
+      h[i] = L2_default_header[i];
+    }
+    h[4] = (uint8_t) ((sizeof(L2PacketHeader) - 5 + data_length) / 4);
+    h[5] = destination_prefix;
+    for (int i = 0; i < 6; i++)
+    {
+      h[6+i] = L2_default_destination[i];
+      h[14+i] = L2_default_source[i];
+    }
+    h[13] = source_prefix;
+    h[21] = mystery_1b;
+    // Escape and checksum
+    t.prefix[t.prefix_length++] = L2_head;
+    t.fcs = FCS16_INIT;
+    for (int i = 0; i < L2_FixedHeaderLength; i++)
+    {
+      uint8_t c = h[i];
+      t.fcs = (t.fcs >> 8) ^ fcstab[(t.fcs ^ c) & 0xff];
+      if (c == 0x7D || c == 0x7E || c == 0x11 || c == 0x12 || c == 0x13)
+      {
+        t.prefix[t.prefix_length++] = 0x7D;
+        c ^= 0x20;
+      }
+      t.prefix[t.prefix_length++] = c;
+    }
+    for (int i = 0; i < 5; i++)
+    {
+      t.command[i] = command[i];
+    }
+    t.data_length = data_length;
+    return t;
+  }
+  
+  // Write complete escaped packet with given packet index and data to destination (room for L2_MaxPacketLength bytes
+  // needed). data_length must match the template. Returns length of the result, < 0 on error.
+  int Encode(uint8_t *destination, uint8_t packet_index, const uint8_t *data, int data_length) const;
+};
+
+// Templates of the requests we send
+constexpr L2FrameTemplate L2_frame_login_1 = L2FrameTemplate::Make(0xA0, 0x00, 0x00, L2_command_login_1, sizeof(L2_data_login_1));
+constexpr L2FrameTemplate L2_frame_login_2 = L2FrameTemplate::Make(0xA0, 0x03, 0x03, L2_command_login_2, sizeof(L2_data_login_2));
+constexpr L2FrameTemplate L2_frame_logon = L2FrameTemplate::Make(0xA0, 0x01, 0x01, L2_command_logon, sizeof(L2_data_logon));
+constexpr L2FrameTemplate L2_frame_daily_yield = L2FrameTemplate::Make(0xA0, 0x00, 0x00, L2_command_daily_yield, sizeof(L2_data_daily_yield));
+constexpr L2FrameTemplate L2_frame_spot_ac = L2FrameTemplate::Make(0xA0, 0x00, 0x00, L2_command_spot_ac, sizeof(L2_data_value_range));
+constexpr L2FrameTemplate L2_frame_spot_status = L2FrameTemplate::Make(0xA0, 0x00, 0x00, L2_command_spot_status, sizeof(L2_data_value_range));
+constexpr L2FrameTemplate L2_frame_spot_dc = L2FrameTemplate::Make(0xA0, 0x00, 0x00, L2_command_spot_dc, sizeof(L2_data_value_range));
+constexpr L2FrameTemplate L2_frame_historic_yield_5 = L2FrameTemplate::Make(0xA0, 0x00, 0x00, L2_command_historic_yield_5, sizeof(L2_data_historic_yield));
+constexpr L2FrameTemplate L2_frame_historic_yield_daily = L2FrameTemplate::Make(0xA0, 0x00, 0x00, L2_command_historic_yield_daily, sizeof(L2_data_historic_yield));
+
 // L2 packet structure
 class L2Packet 
 {
@@ -125,25 +225,88 @@ public:
   }
   
   
-  // Return contents of packet (including data, checksum, and footer) in escaped form ready for sending
-  uint8_t* PreparePacket(const uint8_t *data, int data_length, int *len);
+  // Write contents of packet (including data, checksum, and footer) in escaped form ready for sending to destination
+  // (room for L2_MaxPacketLength bytes needed). data_length is at most L2_MaxDataLength. Returns length of the result.
+  int PreparePacket(uint8_t *destination, const uint8_t *data, int data_length);
+  // Write contents of packet as the inverter sends it, for simulating one (room for L2_MaxReplyLength(data_length)
+  // bytes needed). fcs_error is XORed into the checksum, to send a damaged packet. Returns length of the result.
+  int PrepareReply(uint8_t *destination, const uint8_t *data, int data_length, uint16_t fcs_error = 0);
   // Construct L2 packet from escaped data. Check checksum, header bytes, ... 
   // Returns data length (>=0) on success, <0 on failure. The orignal data in *data will be overwritten with the data portion of the
   // L2 packet.
   int ReadPacket(uint8_t *data, int len);
+  // Construct L2 packet from an escaped request written by PreparePacket, as ReadPacket
+  int ReadRequest(uint8_t *data, int len);
   // Calculate checksum  
   uint16_t CheckSum(const uint8_t *data, int len);
   
-  private:
-  
-   
-  // Escape data, result to vector
-  void EscapeData(std::vector<uint8_t>& destintation, const uint8_t *src, unsigned int length);
+  // Escape data, result in destination (room for 2*length bytes needed). Returns length of escaped data
+  static int EscapeData(uint8_t *destination, const uint8_t *src, int length);
   // Unescape data in-place, return length of unescaped data
-  int UnescapeData(uint8_t *src, int length);
+  static int UnescapeData(uint8_t *src, int length);
+  // Unescape data to destination (room for length bytes needed), return length of unescaped data
+  static int UnescapeData(uint8_t *destination, const uint8_t *src, int length);
+
+private:
+  int EscapePacket(uint8_t *destination, const uint8_t *data, int data_length, uint16_t *fcs);
+  int ReadUnescaped(uint8_t *data, int length, uint16_t fcs);
+};
+
+// Incremental decoder of a received L2 packet. The escaped L1 payloads of the packet are added one at a time; they
+// are unescaped into a fixed buffer and checksummed as they arrive, so that the data is available without copying 
+// once the last part is added.
+class L2Decoder
+{
+  uint8_t buffer[L2_MaxReceiveLength];
+  int length;         // unescaped bytes in buffer
+  int checked;        // bytes included in fcs
+  uint16_t fcs;       // checksum state
+  bool escape;        // last part ended with an escape byte
+  uint8_t last;       // last (escaped) byte added
+  int status;         // 0, or error value when the packet is known to be invalid
+  
+  public:
+  
+  L2Decoder()
+  {
+    Reset();
+  }
+  
+  // Start a new packet
+  void Reset()
+  {
+    length = checked = 0;
+    fcs = FCS16_INIT;
+    escape = false;
+    status = 0;
+  }
+  
+  // Add escaped part of the packet. Returns < 0 when the packet is invalid (the remaining parts may still be added).
+  int Add(const uint8_t *data, int data_length);
+  
+  // Last part added: check footer and checksum. Returns data length (>=0) on success, < 0 on failure.
+  int Finish();
   
+  // Header of the packet (valid after Finish)
+  L2PacketHeader *Header()
+  {
+    return (L2PacketHeader *) buffer;
+  }
   
+  // Data of the packet (valid after Finish, until Reset)
+  uint8_t *Data()
+  {
+    return buffer + sizeof(L2PacketHeader);
+  }
 };
 
+// Implementations of EscapeData/UnescapeData. The fastest one supported by the CPU is selected at program start.
+#define L2_KERNEL_SCALAR              0
+#define L2_KERNEL_SSE2                1
+#define L2_KERNEL_AVX2                2
+
+// Select (un)escape implementation. Returns the selected kernel: the requested one, or the best supported one below it
+int L2SelectKernel(int kernel);
+
 
 #endif
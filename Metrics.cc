@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "Metrics.h"
+
+// Names in the export
+static const char *latency_names[METRICS_LATENCIES] =
+{
+  "connect", "handshake", "login_1", "login_2", "logon", "reply", "sink"
+};
+
+static const char *counter_names[METRICS_COUNTERS] =
+{
+  "bytes_sent", "bytes_received", "requests", "telegrams", "resent", "timeouts", "checksum_errors", "invalid_packets",
+  "unmatched_replies", "writer_stalls"
+};
+
+static const char *counter_help[METRICS_COUNTERS] =
+{
+  "Bytes sent to the inverter",
+  "Bytes received from the inverter",
+  "L2 requests sent, not counting resends",
+  "L2 replies to pending requests",
+  "Requests resent after a time-out",
+  "Requests that failed on a time-out",
+  "L2 packets with a bad checksum",
+  "L2 packets that could not be decoded",
+  "Replies whose packet index matched no pending request",
+  "Waits of the protocol thread for a full writer queue"
+};
+
+Metrics::Metrics(const char *label)
+{
+  SetLabel(label);
+  Reset();
+}
+
+void Metrics::SetLabel(const char *label)
+{
+  strncpy(Label, label, sizeof(Label) - 1);
+  Label[sizeof(Label) - 1] = 0;
+}
+
+void Metrics::Reset()
+{
+  memset(Counters, 0, sizeof(Counters));
+  memset(Latencies, 0, sizeof(Latencies));
+}
+
+void Metrics::Latency(MetricsLatency latency, double seconds)
+{
+  LatencyHistogram& h = Latencies[latency];
+  int bucket = 0;
+  for (double bound = METRICS_BUCKET_MIN; bucket < METRICS_BUCKETS - 1 && seconds > bound; bound *= 2, bucket++);
+  h.Buckets[bucket]++;
+  h.Count++;
+  h.Sum += seconds;
+  h.Max = (seconds > h.Max) ? seconds : h.Max;
+}
+
+void Metrics::Add(const Metrics& other)
+{
+  for (int c = 0; c < METRICS_COUNTERS; c++)
+  {
+    Counters[c] += other.Counters[c];
+  }
+  for (int l = 0; l < METRICS_LATENCIES; l++)
+  {
+    LatencyHistogram& h = Latencies[l];
+    const LatencyHistogram& o = other.Latencies[l];
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+    {
+      h.Buckets[b] += o.Buckets[b];
+    }
+    h.Count += o.Count;
+    h.Sum += o.Sum;
+    h.Max = (o.Max > h.Max) ? o.Max : h.Max;
+  }
+}
+
+// {"metrics": [{"label": ..., "counters": {...}, "latencies": {"connect": {"count": .., "sum": .., "max": ..,
+// "buckets": [..]}, ...}}, ...]}. Bucket i counts latencies up to METRICS_BUCKET_MIN * 2^i (not cumulative)
+bool Metrics::WriteJSON(FILE *f, Metrics **metrics, int count)
+{
+  fprintf(f, "{\"bucket_min\": %g, \"metrics\": [", METRICS_BUCKET_MIN);
+  for (int i = 0; i < count; i++)
+  {
+    Metrics& m = *metrics[i];
+    fprintf(f, "%s\n  {\"label\": \"%s\",\n   \"counters\": {", (i == 0) ? "" : ",", m.Label);
+    for (int c = 0; c < METRICS_COUNTERS; c++)
+    {
+      fprintf(f, "%s\"%s\": %llu", (c == 0) ? "" : ", ", counter_names[c], (unsigned long long) m.Counters[c]);
+    }
+    fprintf(f, "},\n   \"latencies\": {");
+    for (int l = 0; l < METRICS_LATENCIES; l++)
+    {
+      LatencyHistogram& h = m.Latencies[l];
+      fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"sum\": %.6f, \"max\": %.6f, \"buckets\": [", (l == 0) ? "" : ",",
+        latency_names[l], (unsigned long long) h.Count, h.Sum, h.Max);
+      for (int b = 0; b < METRICS_BUCKETS; b++)
+      {
+        fprintf(f, "%s%llu", (b == 0) ? "" : ", ", (unsigned long long) h.Buckets[b]);
+      }
+      fprintf(f, "]}");
+    }
+    fprintf(f, "}}");
+  }
+  fprintf(f, "\n]}\n");
+  return !ferror(f);
+}
+
+// Counters as sma_<name>_total, latencies as histogram sma_latency_seconds with label phase; every set has label
+// inverter
+bool Metrics::WritePrometheus(FILE *f, Metrics **metrics, int count)
+{
+  for (int c = 0; c < METRICS_COUNTERS; c++)
+  {
+    fprintf(f, "# HELP sma_%s_total %s\n# TYPE sma_%s_total counter\n", counter_names[c], counter_help[c], counter_names[c]);
+    for (int i = 0; i < count; i++)
+    {
+      fprintf(f, "sma_%s_total{inverter=\"%s\"} %llu\n", counter_names[c], metrics[i]->Label, (unsigned long long) metrics[i]->Counters[c]);
+    }
+  }
+  fprintf(f, "# HELP sma_latency_seconds Latency of the phases of the exchange with the inverter\n# TYPE sma_latency_seconds histogram\n");
+  for (int i = 0; i < count; i++)
+  {
+    for (int l = 0; l < METRICS_LATENCIES; l++)
+    {
+      LatencyHistogram& h = metrics[i]->Latencies[l];
+      uint64_t cumulative = 0;
+      double bound = METRICS_BUCKET_MIN;
+      for (int b = 0; b < METRICS_BUCKETS - 1; b++, bound *= 2)
+      {
+        cumulative += h.Buckets[b];
+        fprintf(f, "sma_latency_seconds_bucket{inverter=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n", metrics[i]->Label,
+          latency_names[l], bound, (unsigned long long) cumulative);
+      }
+      fprintf(f, "sma_latency_seconds_bucket{inverter=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n", metrics[i]->Label,
+        latency_names[l], (unsigned long long) h.Count);
+      fprintf(f, "sma_latency_seconds_sum{inverter=\"%s\",phase=\"%s\"} %.6f\n", metrics[i]->Label, latency_names[l], h.Sum);
+      fprintf(f, "sma_latency_seconds_count{inverter=\"%s\",phase=\"%s\"} %llu\n", metrics[i]->Label, latency_names[l],
+        (unsigned long long) h.Count);
+    }
+  }
+  return !ferror(f);
+}
+
+bool Metrics::Write(const char *filename, Metrics **metrics, int count)
+{
+  char temporary[1024];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+  FILE *f = fopen(temporary, "w");
+  if (f == NULL)
+  {
+    return false;
+  }
+  int length = strlen(filename);
+  bool prometheus = length > 5 && strcmp(filename + length - 5, ".prom") == 0;
+  bool ok = prometheus ? WritePrometheus(f, metrics, count) : WriteJSON(f, metrics, count);
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(temporary, filename) != 0)
+  {
+    unlink(temporary);
+    return false;
+  }
+  return true;
+}
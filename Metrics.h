@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+// Latency histogram buckets: upper bounds METRICS_BUCKET_MIN * 2^i [s], the last bucket counts all longer latencies
+#define METRICS_BUCKETS               18
+#define METRICS_BUCKET_MIN            100e-6
+#define METRICS_MAX_LABEL             32
+
+// Measured latencies
+enum MetricsLatency
+{
+  METRICS_CONNECT,              // transport connect
+  METRICS_HANDSHAKE,            // L1 handshake: login ping until Login_3
+  METRICS_LOGIN_1,              // logon steps, see LogonTiming
+  METRICS_LOGIN_2,
+  METRICS_LOGON,
+  METRICS_REPLY,                // L2 request until its first reply (not measured for resent requests)
+  METRICS_SINK,                 // storing/uploading data (SQLite, HTTP)
+  METRICS_LATENCIES
+};
+
+// Counters
+enum MetricsCounter
+{
+  METRICS_BYTES_SENT,
+  METRICS_BYTES_RECEIVED,
+  METRICS_REQUESTS,             // L2 requests sent (not counting resends)
+  METRICS_TELEGRAMS,            // L2 replies to pending requests
+  METRICS_RESENT,               // requests resent after a time-out
+  METRICS_TIMEOUTS,             // requests that failed on a time-out
+  METRICS_CHECKSUM_ERRORS,      // L2 packets with a bad checksum
+  METRICS_INVALID_PACKETS,      // L2 packets that could not be decoded otherwise
+  METRICS_UNMATCHED_REPLIES,    // replies whose packet index matched no pending request
+  METRICS_WRITER_STALLS,        // waits for a full writer queue (backpressure of the database writer thread)
+  METRICS_COUNTERS
+};
+
+typedef struct
+{
+  uint64_t Count;
+  double Sum;                   // [s]
+  double Max;                   // [s]
+  uint64_t Buckets[METRICS_BUCKETS];
+} LatencyHistogram;
+
+// Counters and latency histograms of the exchanges with one inverter (or a sink), exportable as JSON or in the
+// Prometheus text format
+class Metrics
+{
+  public:
+  char Label[METRICS_MAX_LABEL];      // identifies the set in the export, e.g. the MAC address of the inverter
+  uint64_t Counters[METRICS_COUNTERS];
+  LatencyHistogram Latencies[METRICS_LATENCIES];
+
+  Metrics(const char *label = "");
+
+  void SetLabel(const char *label);
+
+  // Clear counters and histograms
+  void Reset();
+
+  void Count(MetricsCounter counter, uint64_t n = 1)
+  {
+    Counters[counter] += n;
+  }
+
+  // Add latency measurement [s]
+  void Latency(MetricsLatency latency, double seconds);
+
+  // Add counters and histograms of another set
+  void Add(const Metrics& other);
+
+  // Write count sets. Returns false on failure
+  static bool WriteJSON(FILE *f, Metrics **metrics, int count);
+  static bool WritePrometheus(FILE *f, Metrics **metrics, int count);
+  // Write to a file: Prometheus text format when its name ends in .prom, JSON otherwise. The file is replaced at once
+  // (written under a temporary name first), so readers never see a partial file
+  static bool Write(const char *filename, Metrics **metrics, int count);
+};
+
+#endif
@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "PollEngine.h"
+
+// Inverter poll
+
+InverterPoll::InverterPoll(const char *mac_address, const uint8_t *password, const char *transport) : requests(&Stats)
+{
+  strncpy(mac, mac_address, sizeof(mac) - 1);
+  mac[sizeof(mac) - 1] = 0;
+  memset(this->password, 0, sizeof(this->password));
+  memcpy(this->password, password, strnlen((const char *) password, sizeof(this->password) - 1));
+  this->transport[0] = 0;
+  if (transport != NULL)
+  {
+    strncpy(this->transport, transport, sizeof(this->transport) - 1);
+    this->transport[sizeof(this->transport) - 1] = 0;
+  }
+  str2ba(mac, &sma_mac);
+  memset(&our_mac, 0, sizeof(bdaddr_t));
+  memset(&empty_mac, 0, sizeof(bdaddr_t));
+  s = NULL;
+  no_requests = 0;
+  state = DONE;
+  deadline = sent = phase_start = quiet_start = limit = 0;
+  time_limit = POLL_TIME_LIMIT;
+  get_5m = get_daily = false;
+  from_5m = from_daily = to = 0;
+  Status = 0;
+  memset(&Yield, 0, sizeof(Yield));
+  Started = Finished = 0;
+  Stats.SetLabel(mac);
+}
+
+InverterPoll::~InverterPoll()
+{
+  delete s;
+}
+
+// Also get historic yield
+void InverterPoll::RequestHistoric(int32_t from, int32_t to, bool daily)
+{
+  if (daily)
+  {
+    get_daily = true;
+    from_daily = from;
+  }
+  else
+  {
+    get_5m = true;
+    from_5m = from;
+  }
+  this->to = to;
+}
+
+// Start non-blocking connect
+bool InverterPoll::Start()
+{
+  char description[sizeof(transport) + 8];
+  Started = TimeNow();
+  limit = Started + time_limit;
+  if (transport[0] == 0)
+  {
+    snprintf(description, sizeof(description), "rfcomm:%s", mac);
+  }
+  else
+  {
+    strcpy(description, transport);
+  }
+  // Only sockets can be polled
+  Transport *t = Transport::Create(description, true);
+  s = dynamic_cast<SocketTransport *>(t);
+  if (s == NULL)
+  {
+    delete t;
+    Finish(POLL_ERROR_CONNECT);
+    return false;
+  }
+  reader.Attach(s);
+  decoder.Reset();
+  state = CONNECTING;
+  deadline = Started + POLL_TIMEOUT;
+  return true;
+}
+
+// Connect completed (or failed)
+void InverterPoll::Writable()
+{
+  if (state != CONNECTING)
+  {
+    return;
+  }
+  if (s->ConnectResult() != 0)
+  {
+    Finish(POLL_ERROR_CONNECT);
+    return;
+  }
+  // Wait for the login ping of the inverter
+  state = WAIT_PING;
+  phase_start = TimeNow();
+  Stats.Latency(METRICS_CONNECT, phase_start - Started);
+  deadline = phase_start + POLL_TIMEOUT;
+}
+
+// Read available data, handle all complete packets
+void InverterPoll::Readable()
+{
+  if (state == DONE || state == CONNECTING)
+  {
+    return;
+  }
+  int bytes_read = reader.Fill();
+  if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  { // Connection closed
+    Finish((state < LOGON) ? POLL_ERROR_CONNECT : PM_ERROR_RECEIVING_REPLY);
+    return;
+  }
+  L1Packet packet;
+  while (state != DONE && packet.Take(&reader))
+  {
+    Packet(&packet);
+  }
+}
+
+// Handle L1 packet; same steps as ProtocolManager::Connect and Logon
+void InverterPoll::Packet(L1Packet *packet)
+{
+  if (!packet->CheckSource(&sma_mac))
+  { // Not for us
+    return;
+  }
+  double now = TimeNow();
+  switch (state)
+  {
+    case WAIT_PING:
+      if (packet->Command() != L1_Command_LoginPing)
+      {
+        break;
+      }
+      // Respond with the same data
+      packet->SetHeader(&empty_mac, &sma_mac, L1_Command_LoginPing);
+      sent = now;
+      if (!packet->Send(s, packet->Data(), packet->DataLength()))
+      {
+        Finish(POLL_ERROR_CONNECT);
+        break;
+      }
+      state = WAIT_LOGIN_3;
+      deadline = now + POLL_TIMEOUT;
+    break;
+    case WAIT_LOGIN_3:
+      if (packet->Command() != L1_Command_Login_3)
+      {
+        break;
+      }
+      if (packet->DataLength() != sizeof(L1Login3Data_t))
+      {
+        Finish(POLL_ERROR_CONNECT);
+        break;
+      }
+      // First estimate of the round trip time; our MAC address is in the reply
+      requests.ResetRoundTripTime();
+      requests.UpdateRoundTripTime(now - sent);
+      memcpy(&our_mac, &((L1Login3Data_t *) packet->Data())->us, sizeof(bdaddr_t));
+      requests.Attach(s, &our_mac, &sma_mac);
+      Stats.Latency(METRICS_HANDSHAKE, now - phase_start);
+      logon.Start(password);
+      LogonStep();
+    break;
+    case LOGON:
+      if (logon.Quiet())
+      { // Link not quiet yet: drop packet, restart the quiet period
+        deadline = QuietDeadline(now);
+        break;
+      }
+    // fall through: reply to a logon step
+    case REQUESTS:
+      if (packet->Command() != L1_Command_L2_Packet && packet->Command() != L1_Command_L2_PacketPart)
+      {
+        break;
+      }
+      decoder.Add(packet->Data(), packet->DataLength());
+      if (packet->Command() == L1_Command_L2_Packet)
+      {
+        Reply(decoder.Finish());
+        decoder.Reset();
+      }
+    break;
+    default:
+    break;
+  }
+}
+
+// Pass reply to its request
+void InverterPoll::Reply(int data_length)
+{
+  if (data_length < 0)
+  { // Unreadable: we do not know whose reply it was. Drop it; its request is sent again
+    requests.Drop(data_length);
+  }
+  else
+  {
+    requests.Dispatch(decoder.Header(), decoder.Data(), data_length);
+  }
+  Progress();
+}
+
+// Timer events: quiet link (logon steps), resends and time-outs
+void InverterPoll::Timer()
+{
+  double now = TimeNow();
+  if (state == DONE || now < deadline)
+  {
+    return;
+  }
+  switch (state)
+  {
+    case LOGON:
+    case REQUESTS:
+      if (now >= limit)
+      { // Time limit of the poll passed: fail the pending requests
+        requests.CheckTimeouts(limit);
+        Finish(POLL_ERROR_TIMEOUT);
+        break;
+      }
+      if (state == LOGON && logon.Quiet())
+      {
+        logon.Next(0);
+        LogonStep();
+        break;
+      }
+      requests.CheckTimeouts(limit);
+      Progress();
+    break;
+    default:
+      // Connecting
+      Finish(POLL_ERROR_CONNECT);
+    break;
+  }
+}
+
+// Perform logon steps; they end waiting for a quiet link (Timer) or a reply (Progress)
+void InverterPoll::LogonStep()
+{
+  state = LOGON;
+  while (!logon.Finished())
+  {
+    if (logon.Quiet())
+    {
+      quiet_start = TimeNow();
+      deadline = QuietDeadline(quiet_start);
+      return;
+    }
+    if (!logon.Reply())
+    {
+      logon.Next(requests.Send(logon.Frame(), logon.Data(), logon.DataLength()) ? 0 : PM_ERROR_SENDING_COMMAND);
+      continue;
+    }
+    // Contents of the replies are ignored
+    no_requests = 0;
+    if (Submit(logon.Frame(), logon.Data(), logon.DataLength(), NULL, NULL))
+    {
+      deadline = requests.NextTimer(limit);
+      return;
+    }
+    logon.Next(PM_ERROR_SENDING_COMMAND);
+  }
+  if (logon.Current() == LogonSequence::FAILED)
+  {
+    Finish(POLL_ERROR_LOGON);
+    return;
+  }
+  Stats.Latency(METRICS_LOGIN_1, logon.Timing().Login1);
+  Stats.Latency(METRICS_LOGIN_2, logon.Timing().Login2);
+  Stats.Latency(METRICS_LOGON, logon.Timing().Logon);
+  SendRequests();
+}
+
+double InverterPoll::QuietDeadline(double now)
+{
+  double quiet = now + LogonSequence::Pacing(requests.RoundTripTime());
+  quiet = (quiet < quiet_start + POLL_TIMEOUT) ? quiet : quiet_start + POLL_TIMEOUT;
+  return (quiet < limit) ? quiet : limit;
+}
+
+// Send all requests at once
+void InverterPoll::SendRequests()
+{
+  L2_data_historic_yield hyd;
+  no_requests = 0;
+  memset(&Yield, 0, sizeof(YieldInfo));
+  bool ok = Submit(L2_frame_daily_yield, L2_data_daily_yield, sizeof(L2_data_daily_yield), ProtocolManager::YieldInfoReply, &Yield);
+  hyd.timestamp_to = htobl(to);
+  if (ok && get_5m)
+  {
+    hyd.timestamp_from = htobl(from_5m);
+    Minute5.Clear();
+    ok = Minute5.Reserve(HistoricInfo::ExpectedRecords(from_5m, to, false)) && Submit(L2_frame_historic_yield_5, (uint8_t *) &hyd, sizeof(hyd), ProtocolManager::HistoricYieldReply, &Minute5);
+  }
+  if (ok && get_daily)
+  {
+    hyd.timestamp_from = htobl(from_daily);
+    Daily.Clear();
+    ok = Daily.Reserve(HistoricInfo::ExpectedRecords(from_daily, to, true)) && Submit(L2_frame_historic_yield_daily, (uint8_t *) &hyd, sizeof(hyd), ProtocolManager::HistoricYieldReply, &Daily);
+  }
+  if (!ok)
+  {
+    Finish(PM_ERROR_SENDING_COMMAND);
+    return;
+  }
+  state = REQUESTS;
+  deadline = requests.NextTimer(limit);
+}
+
+bool InverterPoll::Submit(const L2FrameTemplate& frame, const uint8_t *data, int data_length, L2ReplyHandler handler, void *context)
+{
+  int id = requests.Submit(frame, data, data_length, handler, context);
+  if (id < 0)
+  {
+    return false;
+  }
+  request_ids[no_requests++] = id;
+  return true;
+}
+
+// Next step when the requests of the current one are done, otherwise wait for the next resend/time-out
+void InverterPoll::Progress()
+{
+  int status = 0;
+  for (int i = 0; i < no_requests; i++)
+  {
+    if (requests.Active(request_ids[i]))
+    {
+      deadline = requests.NextTimer(limit);
+      return;
+    }
+  }
+  for (int i = 0; i < no_requests; i++)
+  {
+    int result = requests.Collect(request_ids[i]);
+    status = (status == 0) ? result : status;
+  }
+  no_requests = 0;
+  if (state == LOGON)
+  {
+    logon.Next(status);
+    LogonStep();
+  }
+  else if (state == REQUESTS)
+  {
+    Finish((status == PM_ERROR_TIMEOUT) ? POLL_ERROR_TIMEOUT : status);
+  }
+}
+
+// Done: close connection
+void InverterPoll::Finish(int status)
+{
+  Status = status;
+  state = DONE;
+  Finished = TimeNow();
+  requests.Fail(PM_ERROR_RECEIVING_REPLY);
+  requests.Attach(NULL, &our_mac, &sma_mac);
+  reader.Attach(NULL);
+  if (s != NULL)
+  {
+    Stats.Count(METRICS_BYTES_SENT, s->BytesWritten);
+    Stats.Count(METRICS_BYTES_RECEIVED, s->BytesRead);
+  }
+  delete s;
+  s = NULL;
+}
+
+// Poll engine
+
+PollEngine::PollEngine()
+{
+  epoll_fd = epoll_create1(0);
+  count = 0;
+}
+
+PollEngine::~PollEngine()
+{
+  if (epoll_fd >= 0)
+  {
+    close(epoll_fd);
+  }
+}
+
+bool PollEngine::Add(InverterPoll *inverter)
+{
+  if (count == POLL_MAX_INVERTERS)
+  {
+    return false;
+  }
+  inverters[count++] = inverter;
+  return true;
+}
+
+// Wait for writable while connecting, readable after
+bool PollEngine::Watch(InverterPoll *inverter, int operation)
+{
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = inverter->WantWrite() ? EPOLLOUT : EPOLLIN;
+  event.data.ptr = inverter;
+  return epoll_ctl(epoll_fd, operation, inverter->Fd(), &event) == 0;
+}
+
+// Run all inverter polls to completion
+int PollEngine::Run(PollDoneHandler done, void *context)
+{
+  struct epoll_event events[POLL_MAX_INVERTERS];
+  bool reported[POLL_MAX_INVERTERS];
+  int remaining = count;
+  int succeeded = 0;
+  if (epoll_fd < 0)
+  {
+    return -1;
+  }
+  // Start all connects
+  for (int i = 0; i < count; i++)
+  {
+    reported[i] = false;
+    if (inverters[i]->Start() && !Watch(inverters[i], EPOLL_CTL_ADD))
+    { // Transport without pollable socket
+      inverters[i]->Finish(POLL_ERROR_CONNECT);
+    }
+  }
+  while (true)
+  {
+    // Report finished polls
+    for (int i = 0; i < count; i++)
+    {
+      if (!reported[i] && inverters[i]->Done())
+      {
+        reported[i] = true;
+        remaining--;
+        if (inverters[i]->Status == 0)
+        {
+          succeeded++;
+        }
+        if (done != NULL)
+        {
+          done(inverters[i], context);
+        }
+      }
+    }
+    if (remaining == 0)
+    {
+      break;
+    }
+    // Wait for data or the first timer
+    double now = TimeNow();
+    double first = now + POLL_TIMEOUT;
+    for (int i = 0; i < count; i++)
+    {
+      if (!inverters[i]->Done() && inverters[i]->Deadline() < first)
+      {
+        first = inverters[i]->Deadline();
+      }
+    }
+    int timeout_ms = (first > now) ? (int) ((first - now) * 1000 + 0.999) : 0;
+    int n = epoll_wait(epoll_fd, events, POLL_MAX_INVERTERS, timeout_ms);
+    if (n < 0 && errno != EINTR)
+    {
+      return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+      InverterPoll *inverter = (InverterPoll *) events[i].data.ptr;
+      if (inverter->Done())
+      { // Finished (connection closed) earlier in this round
+        continue;
+      }
+      if (inverter->WantWrite())
+      {
+        inverter->Writable();
+        if (!inverter->Done() && !Watch(inverter, EPOLL_CTL_MOD))
+        {
+          inverter->Finish(POLL_ERROR_CONNECT);
+        }
+      }
+      else
+      {
+        inverter->Readable();
+      }
+    }
+    for (int i = 0; i < count; i++)
+    {
+      inverters[i]->Timer();
+    }
+  }
+  return succeeded;
+}
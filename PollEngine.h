@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "ProtocolManager.h"
+
+#ifndef __POLL_ENGINE_H__
+#define __POLL_ENGINE_H__
+
+#define POLL_MAX_INVERTERS            64
+// Time-out while waiting for the inverter (connect, reply) [s]
+#define POLL_TIMEOUT                  TRANSPORT_TIMEOUT
+// Default maximum duration of a poll [s]
+#define POLL_TIME_LIMIT               (60 * POLL_TIMEOUT)
+
+#define POLL_ERROR_CONNECT            -10
+#define POLL_ERROR_LOGON              -11
+#define POLL_ERROR_TIMEOUT            -12
+
+// Non-blocking poll of one inverter: connect, logon, yield info and (optionally) historic yield. Driven by the
+// PollEngine: it reads when the transport is readable and advances on timers; it never blocks. Requests, resends and
+// time-outs (PendingRequests) and the logon steps (LogonSequence) are those of the ProtocolManager.
+class InverterPoll
+{
+  public:
+  enum PollState { CONNECTING, WAIT_PING, WAIT_LOGIN_3, LOGON, REQUESTS, DONE };
+
+  private:
+  char mac[18];
+  uint8_t password[13];
+  char transport[1024];
+  bdaddr_t our_mac;
+  bdaddr_t sma_mac;
+  bdaddr_t empty_mac;
+  SocketTransport *s;         // connection (non-blocking)
+  L1Reader reader;
+  L2Decoder decoder;
+  PendingRequests requests;
+  LogonSequence logon;
+  int request_ids[3];         // of the current logon step or the requests
+  int no_requests;
+  PollState state;
+  double deadline;            // time of the next timer event [s]
+  double sent;                // time the L1 handshake reply was sent [s]
+  double phase_start;         // start of the connect phase [s]
+  double quiet_start;         // start of the wait for a quiet link [s]
+  double time_limit;          // maximum duration of the poll [s]
+  double limit;               // the poll ends with POLL_ERROR_TIMEOUT at this time [s]
+  // Historic yield requests
+  bool get_5m;
+  bool get_daily;
+  int32_t from_5m, from_daily, to;
+
+  public:
+
+  // Results: 0 or error (PM_ERROR_..., POLL_ERROR_...), current yield, historic yield
+  int Status;
+  YieldInfo Yield;
+  HistoricInfo Minute5;
+  HistoricInfo Daily;
+  // Time spent [s]
+  double Started;
+  double Finished;
+  // Counters and latencies of this poll
+  Metrics Stats;
+
+  // Poll inverter with given MAC address and password; over Bluetooth RFCOMM unless a transport is given
+  InverterPoll(const char *mac_address, const uint8_t *password, const char *transport = NULL);
+  ~InverterPoll();
+
+  // Also get historic yield between from and to (call before Start)
+  void RequestHistoric(int32_t from, int32_t to, bool daily);
+
+  // Maximum duration of the poll in seconds, POLL_TIME_LIMIT by default (call before Start)
+  void SetTimeLimit(double seconds)
+  {
+    time_limit = seconds;
+  }
+
+  // Start connecting. Returns false when the connection cannot be started (Status is set)
+  bool Start();
+
+  // Transport has data / is writable (connected)
+  void Readable();
+  void Writable();
+  // Timer expired (now >= Deadline())
+  void Timer();
+
+  int Fd()
+  {
+    return (s == NULL) ? -1 : s->Fd();
+  }
+
+  // Waiting for connect to complete
+  bool WantWrite()
+  {
+    return state == CONNECTING;
+  }
+
+  double Deadline()
+  {
+    return deadline;
+  }
+
+  bool Done()
+  {
+    return state == DONE;
+  }
+
+  const char *MAC()
+  {
+    return mac;
+  }
+
+  double RoundTripTime()
+  {
+    return requests.RoundTripTime();
+  }
+
+  // End the poll with given status
+  void Finish(int status);
+
+  private:
+  // Handle received L1 packet
+  void Packet(L1Packet *packet);
+  // Handle received L2 reply
+  void Reply(int data_length);
+  // Perform the current logon step until it waits (for a quiet link or a reply); requests when logged on
+  void LogonStep();
+  // End of the wait for a quiet link after a packet at now: a link that does not get quiet within POLL_TIMEOUT is taken
+  // as quiet enough, as in ProtocolManager::WaitQuiet
+  double QuietDeadline(double now);
+  // Send the yield requests
+  void SendRequests();
+  // Send request, add it to request_ids. Returns false on failure
+  bool Submit(const L2FrameTemplate& frame, const uint8_t *data, int data_length, L2ReplyHandler handler, void *context);
+  // After a reply or time-out: next step when the requests of the current one are done
+  void Progress();
+};
+
+// Called when an inverter poll is done
+typedef void (*PollDoneHandler)(InverterPoll *inverter, void *context);
+
+// Single threaded engine that polls many inverters at the same time: one epoll loop drives the InverterPoll state
+// machines, so the total time is about that of the slowest inverter instead of the sum.
+class PollEngine
+{
+  int epoll_fd;
+  InverterPoll *inverters[POLL_MAX_INVERTERS];
+  int count;
+
+  public:
+  PollEngine();
+  ~PollEngine();
+
+  // Add inverter (owned by the caller). Returns false when full
+  bool Add(InverterPoll *inverter);
+
+  // Poll all inverters; done is called for every inverter as soon as it has finished. Returns the number of
+  // successful polls, < 0 on error
+  int Run(PollDoneHandler done, void *context);
+
+  private:
+  // Register/update the events we wait for on the inverter's transport
+  bool Watch(InverterPoll *inverter, int operation);
+};
+
+#endif
@@ -2,13 +2,17 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include "ProtocolManager.h"
   
-  ProtocolManager::ProtocolManager()
+  ProtocolManager::ProtocolManager() : requests(&metrics)
   {
-    packet_index = 0;
+    s = NULL;
+    deadline = 0;
+    decoding = false;
+    memset(&logon_timing, 0, sizeof(logon_timing));
     // Initialize empty_mac to zero (needed, not zero by default?)
     memset(&empty_mac, 0, sizeof(bdaddr_t));
   }
@@ -18,20 +22,50 @@
     Close();
   }
   
-  // Connect to inverter. Returns 0 on failure, negative value on connect error, positive value on protocol error
-  int ProtocolManager::Connect(char* mac_address)
+  // Connect to inverter. Returns 0 on success, negative value on connect error, positive value on protocol error
+  int ProtocolManager::Connect(char* mac_address, const char* transport)
   {
-      // Convert string to mac address
-      str2ba(mac_address, &sma_mac);  
-      // Make bluetooth RFCOMM connection, return on error
-      int status;
-      if ((status = BTConnect(&sma_mac)) < 0)
+      char description[1024];
+      // Use given transport, Bluetooth RFCOMM by default
+      if (transport != NULL && transport[0] != 0)
       {
-        return status;
+        snprintf(description, sizeof(description), "%s", transport);
       }
+      else
+      {
+        snprintf(description, sizeof(description), "rfcomm:%s", mac_address);
+      }
+      // Connect non-blocking, so the wait is bounded
+      double start = TimeNow();
+      Transport *t = Transport::Create(description, true);
+      if (t == NULL)
+      {
+        return -1;
+      }
+      if (t->WaitConnected(Limit(PM_CONNECT_TIMEOUT)) < 0)
+      {
+        delete t;
+        return -1;
+      }
+      metrics.Latency(METRICS_CONNECT, TimeNow() - start);
+      return Connect(t, mac_address);
+  }
+  
+  // Connect to inverter over given transport. Returns 0 on success, positive value on protocol error
+  int ProtocolManager::Connect(Transport *transport, char* mac_address)
+  {
+      // Convert string to mac address
+      str2ba(mac_address, &sma_mac);  
+      metrics.SetLabel(mac_address);
+      // Use the new transport
+      Close();
+      double start = TimeNow();
+      s = transport;
+      // Read L1 packets from the new stream
+      reader.Attach(s);
       // Read login ping packet, try twice. Check for read failure, correct command, and correct source address.      
       L1Packet packet;
-      for (int attempt = 0; !packet.Read(s) || packet.Command() != L1_Command_LoginPing || !packet.CheckSource(&sma_mac); attempt++)
+      for (int attempt = 0; !packet.Read(&reader, Limit(PM_RTO_INITIAL)) || packet.Command() != L1_Command_LoginPing || !packet.CheckSource(&sma_mac); attempt++)
       {
         if (attempt == 2)
         { // Could not understand login packet twice                  
@@ -40,18 +74,24 @@
       }
       // Respond. Note that I use the same packet, and set the data to its own data (which is the way to connect)
       packet.SetHeader(&empty_mac, &sma_mac, L1_Command_LoginPing);
+      double sent = TimeNow();
       if (!packet.Send(s, packet.Data(), packet.DataLength()))
       { // Error sending data
         return 2;
       }
       // Wait for reply L1_Command_Login_3 (last in the series of 3)  
-      if (!WaitForPacket(L1_Command_Login_3, &sma_mac, &packet) || packet.DataLength()!= sizeof(L1Login3Data_t))
+      if (!WaitForPacket(L1_Command_Login_3, &sma_mac, &packet, Limit(PM_RTO_INITIAL)) || packet.DataLength()!= sizeof(L1Login3Data_t))
       { // Did not receive Login_3 packet
         return 3;
       }
+      // First estimate of the round trip time
+      requests.ResetRoundTripTime();
+      requests.UpdateRoundTripTime(TimeNow() - sent);
+      metrics.Latency(METRICS_HANDSHAKE, TimeNow() - start);
       // Copy our MAC address from this reply
       // @@@ LAME but I don't know how to get it from bluez...
       memcpy(&our_mac, &((L1Login3Data_t *) packet.Data())->us, sizeof(bdaddr_t));
+      requests.Attach(s, &our_mac, &sma_mac);
       // Done, success
       return 0;      
   
@@ -60,11 +100,17 @@
   // Close connection
   void ProtocolManager::Close()
   {
-    if (s != 0)
+    if (s != NULL)
     {
-      close(s);
-      s = 0;
+      metrics.Count(METRICS_BYTES_SENT, s->BytesWritten);
+      metrics.Count(METRICS_BYTES_RECEIVED, s->BytesRead);
+      delete s;
+      s = NULL;
     }
+    reader.Attach(NULL);
+    decoding = false;
+    requests.Fail(PM_ERROR_RECEIVING_REPLY);
+    requests.Attach(NULL, &our_mac, &sma_mac);
   }
   
   // Return bluetooth signal strength (@ inverter)
@@ -78,138 +124,124 @@
     { // error sending
       return -1;
     }
-    if (!WaitForPacket(L1_Command_ResponseToRequest, &sma_mac, &packet) || packet.DataLength() != sizeof(L1BluetoothStrengthData_t))
+    if (!WaitForPacket(L1_Command_ResponseToRequest, &sma_mac, &packet, Limit(Timeout())) || packet.DataLength() != sizeof(L1BluetoothStrengthData_t))
     { // received nothing or something wrong
       return -2;
     }
     double strength = (((L1BluetoothStrengthData_t *) packet.Data())->strength)*100.0/256.0; 
+    requests.SetSignalStrength(strength);
     return strength;
   }
   
-// Read one or more L1 packets that transmit an L2 packet. Return the concatenated data.
-// Waits (indefinitely) for L1_Command_L2_Packet or L1_Command_L2_PacketPart. Checks source address of the packets. Concatenates data. 
-// Returns when the final L1_Comamand_L2_Packet is received   
-uint8_t *ProtocolManager::ReadL2Packet(int* length)
+// Read one or more L1 packets that transmit an L2 packet and decode their data as it arrives.
+// Waits until limit for L1_Command_L2_Packet or L1_Command_L2_PacketPart. Checks source address of the packets.
+// Returns when the final L1_Comamand_L2_Packet is received: data length, or < 0 on failure/time-out. After a time-out
+// the next call continues with the same L2 packet.
+int ProtocolManager::ReadL2Packet(double limit)
 {
   L1Packet packet;
-  uint8_t *data = NULL;
-  int data_length = 0;
   
+  if (!decoding)
+  {
+    decoder.Reset();
+    decoding = true;
+  }
   do
   {
     bool status;
-    // Wait for a L2 packet (part). Wait indefinitely, not good/nice...
-    while ( (status = packet.Read(s)) &&          // status has to be ok
+    // Wait for a L2 packet (part), until the limit: unrelated packets do not extend the wait
+    while ( (status = packet.Read(&reader, limit)) &&          // status has to be ok
             (
               !packet.CheckSource(&sma_mac) ||     // ignore packet not for us  
               ((packet.Command() != L1_Command_L2_Packet && packet.Command() != L1_Command_L2_PacketPart))  // should be L2 packet (part)
             )
           );
-    // Something bad happened; return null
+    // Time-out, or something bad happened
     if (!status)
     {
-      if (data != NULL)
+      if (reader.TimedOut)
       {
-        free(data);
+        return PM_ERROR_TIMEOUT;
       }
-      *length = 0;
-      return NULL;
+      decoding = false;
+      return ERR_SMA_CONNECTION_BROKEN;
     }
-    // Enlarge our data buffer
-    data = (uint8_t *) realloc(data, data_length + packet.DataLength());
-    // Copy new packet data to buffer
-    memcpy(data + data_length, packet.Data(), packet.DataLength());
-    // Update buffer size
-    data_length += packet.DataLength();
+    // Decode data. When the packet turns out invalid, keep reading its parts
+    decoder.Add(packet.Data(), packet.DataLength());
   } while (packet.Command() != L1_Command_L2_Packet); 
-  // Done, return result
-  *length = data_length;
-  return data;  
+  // Done, check and return result
+  decoding = false;
+  return decoder.Finish();
 } 
   
 
-// Logon to inverter  
+// Logon to inverter: steps through the LogonSequence, which advances when the inverter replies (login_1, logon) or
+// the link is quiet (before login_1, after login_2, which has no reply).
 bool ProtocolManager::Logon(uint8_t* password)
 {
-    L2Packet l2;
-    uint8_t data_logon[sizeof(L2_data_logon)];
-       
-    // Send login_1 command
-    usleep(3000);
-    l2.SetFields(0xA0, 0, 0, ++packet_index, L2_command_login_1); 
-    if (!SendL2(&l2, L2_data_login_1, sizeof(L2_data_login_1))) 
-    { // Error sending L2 packet
-      return false; 
-    }
-    // Ignore response
-    if (!DummyL2Read())
-    {
-#ifdef __DEBUG    
-      printf("login 1 failed\n");
-#endif
-// We sometimes seem to recover. Mostly this fails when we left the SMA inverter
-// in a confused state after a protocol error (by us...).     
-//      return false;
-    }
-    
-    // Send login_2 command (no reply)
-    usleep(3000);
-    l2.SetFields(0xA0, 0x03, 0x03, ++packet_index, L2_command_login_2);
-    if (!SendL2(&l2, L2_data_login_2, sizeof(L2_data_login_2)))
-    { // Error sending L2 packet
-      return false;
-    }                       
-    // No response   
-         
-    // Create login data including the password        
-    memcpy(data_logon, L2_data_logon, sizeof(L2_data_logon)); 
-    for (int i = 0; i < 12 && password[i] != 0; i++)
+    LogonSequence logon;
+    logon.Start(password);
+    while (!logon.Finished())
     {
-      data_logon[i+16] = (uint8_t) (password[i] + 0x88);
-    }
-    // Send logon command
-    usleep(3000);
-    l2.SetFields(0xA0, 0x01, 0x01, ++packet_index, L2_command_logon);
-    if (!SendL2(&l2, data_logon, sizeof(data_logon)))
-    { // Error sending L2 packet
-      return false;
+      if (logon.Quiet())
+      {
+        logon.Next(WaitQuiet(LogonSequence::Pacing(requests.RoundTripTime())) ? 0 : PM_ERROR_RECEIVING_REPLY);
+      }
+      else if (logon.Reply())
+      {
+        // Contents of the replies are ignored
+        logon.Next(Wait(Submit(logon.Frame(), logon.Data(), logon.DataLength(), NULL, NULL)));
+      }
+      else
+      {
+        logon.Next(requests.Send(logon.Frame(), logon.Data(), logon.DataLength()) ? 0 : PM_ERROR_SENDING_COMMAND);
+      }
     }
-    /// Ignore response
-    if (!DummyL2Read())
+    logon_timing = logon.Timing();
+    if (logon.Current() == LogonSequence::DONE)
     {
-      return false;
+      metrics.Latency(METRICS_LOGIN_1, logon_timing.Login1);
+      metrics.Latency(METRICS_LOGIN_2, logon_timing.Login2);
+      metrics.Latency(METRICS_LOGON, logon_timing.Logon);
     }
-    return true;
+#ifdef __DEBUG__
+printf("logon: login_1 %.1f ms (%d attempts), login_2 %.1f ms, logon %.1f ms, total %.1f ms, rtt %.1f ms\n", logon_timing.Login1 * 1e3, 
+  logon_timing.Login1Attempts, logon_timing.Login2 * 1e3, logon_timing.Logon * 1e3, logon_timing.Total * 1e3, requests.RoundTripTime() * 1e3);
+#endif
+    return logon.Current() == LogonSequence::DONE;
 }
   
-  
-  
-  
-  
   // Get yield info
   int ProtocolManager::GetYieldInfo(YieldInfo& yi)
   {
-    L2Packet l2;
-    uint8_t *data;
-    int data_length;
-    // Set structure to zer
+    return Wait(BeginYieldInfo(yi));
+  }
+  
+  // Get historic yield. daily = true: daily values, daily = false: 5 minute updates
+  int ProtocolManager::GetHistoricYield(int32_t from, int32_t to, HistoricInfo& hi, bool daily)
+  {
+    return Wait(BeginHistoricYield(from, to, hi, daily));
+  }
+  
+  // Request yield info
+  int ProtocolManager::BeginYieldInfo(YieldInfo& yi)
+  {
+    // Set structure to zero
     memset(&yi, 0, sizeof(YieldInfo));
-    // Send command
-    l2.SetFields(0xA0, 0x00, 0x00, ++packet_index, L2_command_daily_yield);    
-    if (!SendL2(&l2, L2_data_daily_yield, sizeof(L2_data_daily_yield)))
+    return Submit(L2_frame_daily_yield, L2_data_daily_yield, sizeof(L2_data_daily_yield), YieldInfoReply, &yi);
+  }
+  
+  // Interpret yield info reply. We assume the fields will be present, otherwise zero's are returned!
+  int ProtocolManager::YieldInfoReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request)
+  {
+    YieldInfo& yi = *(YieldInfo *) context;
+    // Check size of the returned data
+    int no_frames = CheckFramedReply(data, data_length, sizeof(_ValueInfo));
+    if (no_frames < 0)
     {
-      return PM_ERROR_SENDING_COMMAND;
+      return no_frames;
     }
-    
-    // Get reply. Checks size of the returned data.
-    data = GetFramedReply(&l2, &data_length, sizeof(_ValueInfo));
-    if (data == NULL)
-    {
-      return PM_ERROR_INTERPRETING_REPLY;
-    }        
-    // Interpret data. We assume the fields will be present, otherwise zero's are returned!                                
     _ValueInfo *vi =  (_ValueInfo *) (data + sizeof(_FrameInfo));
-    int no_frames = (((_FrameInfo *)data)->end_frame - ((_FrameInfo *)data)->start_frame) + 1;    
     for (int i = 0; i < no_frames; i++)
     {
       switch(btohs(vi[i].code))
@@ -223,90 +255,421 @@ bool ProtocolManager::Logon(uint8_t* password)
         case 0x462F: yi.FeedInTime = btohl(vi[i].value); break;            
       }
     }
-    // Done: free data and return result
-    free(data);
     return 0;
   }
   
+  // Get historic yield, stream records to sink
+  int ProtocolManager::GetHistoricYield(int32_t from, int32_t to, HistoricYieldSink& sink, bool daily)
+  {
+    return Wait(BeginHistoricYield(from, to, sink, daily));
+  }
   
+  // Request historic yield
+  int ProtocolManager::BeginHistoricYield(int32_t from, int32_t to, HistoricInfo& hi, bool daily)
+  {
+    // Clear records, reserve room for the whole range
+    hi.Clear();
+    if (!hi.Reserve(HistoricInfo::ExpectedRecords(from, to, daily)))
+    {
+      return PM_ERROR_INTERPRETING_REPLY;
+    }
+    return SubmitHistoricYield(from, to, daily, HistoricYieldReply, &hi);
+  }
   
-  // Get historic yield. daily = true: daily values, daily = false: 5 minute updates
-  int ProtocolManager::GetHistoricYield(int32_t from, int32_t to, HistoricInfo& hi, bool daily)
+  // Request historic yield for a sink
+  int ProtocolManager::BeginHistoricYield(int32_t from, int32_t to, HistoricYieldSink& sink, bool daily)
+  {
+    return SubmitHistoricYield(from, to, daily, HistoricYieldSinkReply, &sink);
+  }
+  
+  int ProtocolManager::SubmitHistoricYield(int32_t from, int32_t to, bool daily, L2ReplyHandler handler, void *context)
   {
-    L2Packet l2;
-    uint8_t *data;
-    int data_length;
-    
-    // Clear structure
-    memset(&hi, 0, sizeof(HistoricInfo));
     // Set request data: start and end of enquiry interval
     L2_data_historic_yield hyd;
-    hyd.timestamp_from = from; 
-    hyd.timestamp_to = to;     
-    // Send command    
-    l2.SetFields(0xA0, 0x00, 0x00, ++packet_index, (daily) ? L2_command_historic_yield_daily : L2_command_historic_yield_5);    
-    if (!SendL2(&l2, (uint8_t*) &hyd, sizeof(L2_data_historic_yield)))
+    hyd.timestamp_from = htobl(from); 
+    hyd.timestamp_to = htobl(to);     
+    return Submit((daily) ? L2_frame_historic_yield_daily : L2_frame_historic_yield_5, (uint8_t*) &hyd, sizeof(L2_data_historic_yield), handler, context);
+  }
+  
+  // Store records of a historic yield telegram
+  int ProtocolManager::HistoricYieldReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request)
+  {
+    HistoricInfo& hi = *(HistoricInfo *) context;
+    // Check size of the returned data
+    int no_frames = CheckFramedReply(data, data_length, sizeof(_HistoricYieldInfo));
+    if (no_frames < 0)
     {
-      return PM_ERROR_SENDING_COMMAND;
+      return no_frames;
+    }
+    ResumeHistoricYield(data, no_frames, request);
+    // Copy data to our storage; room for the requested range is reserved already, unless the inverter sends more
+    if (!hi.Grow(no_frames))
+    {
+      return PM_ERROR_INTERPRETING_REPLY;
+    }
+    CopyHistoricYield(data, no_frames, hi.TimeStamps() + hi.NoRecords, hi.Values() + hi.NoRecords);
+    // Update record counter
+    hi.NoRecords += no_frames;
+    // Continue until we have read all records (or reach a limit)
+    return (hi.NoRecords < PM_MAX_RECORDS) ? 0 : PM_REQUEST_DONE;
+  }
+  
+  // Pass records of a historic yield telegram to the sink
+  int ProtocolManager::HistoricYieldSinkReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request)
+  {
+    HistoricInfoItem records[L2_MaxReceiveLength / sizeof(_HistoricYieldInfo)];
+    int no_frames = CheckFramedReply(data, data_length, sizeof(_HistoricYieldInfo));
+    if (no_frames < 0)
+    {
+      return no_frames;
+    }
+    CopyHistoricYield(data, no_frames, records);
+    ResumeHistoricYield(data, no_frames, request);
+    return ((HistoricYieldSink *) context)->Records(records, no_frames);
+  }
+  
+  // Sent again, the request starts after the last record of this telegram
+  void ProtocolManager::ResumeHistoricYield(uint8_t *data, int no_frames, uint8_t *request)
+  {
+    if (no_frames > 0)
+    {
+      _HistoricYieldInfo *vi =  (_HistoricYieldInfo *) (data + sizeof(_FrameInfo));    
+      ((L2_data_historic_yield *) request)->timestamp_from = htobl(btohl(vi[no_frames - 1].timestamp) + 1);
+    }
+  }
+  
+  // Copy records from reply data
+  void ProtocolManager::CopyHistoricYield(uint8_t *data, int no_frames, HistoricInfoItem *records)
+  {
+    _HistoricYieldInfo *vi =  (_HistoricYieldInfo *) (data + sizeof(_FrameInfo));    
+    for (int i = 0; i < no_frames; i++)
+    {                                   
+      records[i].TimeStamp = btohl(vi[i].timestamp);
+      records[i].Value = btohl(vi[i].value); 
+    }
+  }
+  
+  void ProtocolManager::CopyHistoricYield(uint8_t *data, int no_frames, int32_t *timestamps, uint32_t *values)
+  {
+    _HistoricYieldInfo *vi =  (_HistoricYieldInfo *) (data + sizeof(_FrameInfo));    
+    for (int i = 0; i < no_frames; i++)
+    {                                   
+      timestamps[i] = btohl(vi[i].timestamp);
+      values[i] = btohl(vi[i].value); 
+    }
+  }
+  
+  void HistoricInfo::Swap(HistoricInfo& other)
+  {
+    int32_t *t = timestamps;
+    uint32_t *v = values;
+    uint32_t c = capacity, n = NoRecords;
+    timestamps = other.timestamps;
+    values = other.values;
+    capacity = other.capacity;
+    NoRecords = other.NoRecords;
+    other.timestamps = t;
+    other.values = v;
+    other.capacity = c;
+    other.NoRecords = n;
+  }
+  
+  bool HistoricInfo::Reserve(uint32_t n)
+  {
+    if (n <= capacity)
+    {
+      return true;
+    }
+    int32_t *t = (int32_t *) realloc(timestamps, n * sizeof(int32_t));
+    if (t == NULL)
+    {
+      return false;
+    }
+    timestamps = t;
+    uint32_t *v = (uint32_t *) realloc(values, n * sizeof(uint32_t));
+    if (v == NULL)
+    {
+      return false;
+    }
+    values = v;
+    capacity = n;
+    return true;
+  }
+  
+  uint32_t HistoricInfo::ExpectedRecords(int32_t from, int32_t to, bool daily)
+  {
+    if (to < from)
+    {
+      return 0;
+    }
+    // Records at every 5 minutes/day in the range, plus the one at or before from
+    int64_t n = ((int64_t) to - from) / (daily ? 86400 : 300) + 2;
+    return (n < PM_MAX_RECORDS) ? (uint32_t) n : PM_MAX_RECORDS;
+  }
+  
+  // Value code ranges of the spot value groups, by L2 command. Ranges of the same command are merged into one request:
+  // the inverter only returns the codes it has.
+  typedef struct
+  {
+    int group;
+    const L2FrameTemplate *frame;
+    uint16_t first;
+    uint16_t last;
+  } SpotValueRange;
+  
+  static const SpotValueRange spot_value_ranges[] = 
+  {
+    { SPOT_AC,          &L2_frame_spot_ac,     0x263F, 0x263F },   // AC power
+    { SPOT_AC,          &L2_frame_spot_ac,     0x4640, 0x4657 },   // AC power, voltage, current per phase, frequency
+    { SPOT_TEMPERATURE, &L2_frame_spot_status, 0x2377, 0x2377 },   // temperature
+    { SPOT_DC,          &L2_frame_spot_dc,     0x251E, 0x251E },   // DC power
+    { SPOT_DC,          &L2_frame_spot_dc,     0x451F, 0x4521 }    // DC voltage, current
+  };
+  
+  // Field of a spot value code; values of codes with count > 1 are stored by the index (phase/string) of the record
+  typedef struct
+  {
+    uint16_t code;
+    size_t offset;
+    int count;
+  } SpotValueCode;
+  
+  static const SpotValueCode spot_value_codes[] =
+  {
+    { 0x263F, offsetof(SpotValues, ACPower),         1 },
+    { 0x4640, offsetof(SpotValues, ACPhasePower[0]), 1 },
+    { 0x4641, offsetof(SpotValues, ACPhasePower[1]), 1 },
+    { 0x4642, offsetof(SpotValues, ACPhasePower[2]), 1 },
+    { 0x4648, offsetof(SpotValues, ACVoltage[0]),    1 },
+    { 0x4649, offsetof(SpotValues, ACVoltage[1]),    1 },
+    { 0x464A, offsetof(SpotValues, ACVoltage[2]),    1 },
+    { 0x4653, offsetof(SpotValues, ACCurrent[0]),    1 },
+    { 0x4654, offsetof(SpotValues, ACCurrent[1]),    1 },
+    { 0x4655, offsetof(SpotValues, ACCurrent[2]),    1 },
+    { 0x4657, offsetof(SpotValues, GridFrequency),   1 },
+    { 0x2377, offsetof(SpotValues, Temperature),     1 },
+    { 0x251E, offsetof(SpotValues, DCPower),         SPOT_MAX_STRINGS },
+    { 0x451F, offsetof(SpotValues, DCVoltage),       SPOT_MAX_STRINGS },
+    { 0x4521, offsetof(SpotValues, DCCurrent),       SPOT_MAX_STRINGS }
+  };
+  
+  // Get spot values
+  int ProtocolManager::GetSpotValues(SpotValues& sv, int groups)
+  {
+    int ids[SPOT_MAX_REQUESTS];
+    int requests = BeginSpotValues(sv, ids, groups);
+    int status = (requests < 0) ? requests : 0;
+    for (int i = 0; i < requests; i++)
+    {
+      int result = Wait(ids[i]);
+      status = (status == 0) ? result : status;
+    }
+    return status;
+  }
+  
+  // Request spot values: all requests are sent before waiting for a reply
+  int ProtocolManager::BeginSpotValues(SpotValues& sv, int *ids, int groups)
+  {
+    const L2FrameTemplate *frames[SPOT_MAX_REQUESTS];
+    L2_data_value_range data[SPOT_MAX_REQUESTS];
+    ClearSpotValues(sv);
+    int requests = SpotValueRequests(groups, frames, data);
+    for (int i = 0; i < requests; i++)
+    {
+      ids[i] = Submit(*frames[i], (uint8_t *) &data[i], sizeof(L2_data_value_range), SpotValuesReply, &sv);
+      if (ids[i] < 0)
+      {
+        // Do not leave the requests that were sent, sv must stay valid for them
+        for (int j = 0; j < i; j++)
+        {
+          Wait(ids[j]);
+        }
+        return ids[i];
+      }
     }
-            
-    // Read answer to our request and store data in structure
-    do
-    {  
-      // Get reply. Checks size of the returned data.
-      data = GetFramedReply(&l2, &data_length, sizeof(_HistoricYieldInfo));
-      if (data == NULL)
+    return requests;
+  }
+  
+  int ProtocolManager::SpotValueRequests(int groups, const L2FrameTemplate **frames, L2_data_value_range *data)
+  {
+    int requests = 0;
+    uint16_t first[SPOT_MAX_REQUESTS], last[SPOT_MAX_REQUESTS];
+    for (unsigned int i = 0; i < sizeof(spot_value_ranges) / sizeof(SpotValueRange); i++)
+    {
+      const SpotValueRange& range = spot_value_ranges[i];
+      if ((range.group & groups) == 0)
       {
-        return PM_ERROR_INTERPRETING_REPLY;
+        continue;
       }
-      int no_frames = (((_FrameInfo *)data)->end_frame - ((_FrameInfo *)data)->start_frame) + 1;
-      // Reserve memory for the new frames
-      hi.Records = (HistoricInfoItem *) realloc(hi.Records, (hi.NoRecords + no_frames) * sizeof(HistoricInfoItem));    
-      // Copy date to our storage                        
-      _HistoricYieldInfo *vi =  (_HistoricYieldInfo *) (data + sizeof(_FrameInfo));    
-      for (int i = 0; i < no_frames; i++)
-      {                                   
-        hi.Records[hi.NoRecords + i].TimeStamp = btohl(vi[i].timestamp);
-        hi.Records[hi.NoRecords + i].Value = btohl(vi[i].value); 
-      }
-      // Update record counter
-      hi.NoRecords += no_frames;
-      // Continue until we have read all records (or reach a limit)
-    } while (l2.TelegramNumber() != 0 && hi.NoRecords < PM_MAX_RECORDS);
-    // Success
+      // Merge with the request for the same command
+      int r;
+      for (r = 0; r < requests && frames[r] != range.frame; r++);
+      if (r == requests)
+      {
+        frames[requests++] = range.frame;
+        first[r] = range.first;
+        last[r] = range.last;
+      }
+      else
+      {
+        first[r] = (range.first < first[r]) ? range.first : first[r];
+        last[r] = (range.last > last[r]) ? range.last : last[r];
+      }
+    }
+    for (int r = 0; r < requests; r++)
+    {
+      data[r].first = htobl((uint32_t) first[r] << 8);
+      data[r].last = htobl((uint32_t) last[r] << 8 | 0xFF);
+    }
+    return requests;
+  }
+  
+  void ProtocolManager::ClearSpotValues(SpotValues& sv)
+  {
+    int32_t *values = (int32_t *) &sv;
+    for (unsigned int i = 0; i < sizeof(SpotValues) / sizeof(int32_t); i++)
+    {
+      values[i] = SPOT_NAN;
+    }
+    sv.TimeStamp = 0;
+  }
+  
+  // Store the values of a spot value reply in their fields. Unknown codes and values are skipped
+  int ProtocolManager::SpotValuesReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request)
+  {
+    SpotValues& sv = *(SpotValues *) context;
+    int no_frames = CheckFramedReply(data, data_length, sizeof(_SpotValueInfo));
+    if (no_frames < 0)
+    {
+      return no_frames;
+    }
+    _SpotValueInfo *vi = (_SpotValueInfo *) (data + sizeof(_FrameInfo));
+    for (int i = 0; i < no_frames; i++)
+    {
+      int32_t value = btohl(vi[i].value);
+      if (value == SPOT_NAN || (uint32_t) value == 0xFFFFFFFF)
+      {
+        continue;
+      }
+      uint16_t code = btohs(vi[i].code);
+      unsigned int c;
+      for (c = 0; c < sizeof(spot_value_codes) / sizeof(SpotValueCode) && spot_value_codes[c].code != code; c++);
+      if (c == sizeof(spot_value_codes) / sizeof(SpotValueCode))
+      {
+        continue;
+      }
+      int index = (spot_value_codes[c].count > 1) ? vi[i].index - 1 : 0;
+      if (index < 0 || index >= spot_value_codes[c].count)
+      {
+        continue;
+      }
+      ((int32_t *) ((uint8_t *) &sv + spot_value_codes[c].offset))[index] = value;
+      int32_t timestamp = btohl(vi[i].timestamp);
+      sv.TimeStamp = (timestamp > sv.TimeStamp) ? timestamp : sv.TimeStamp;
+    }
     return 0;
   }
   
-  // Private part
+  // Send request, register it as pending. Returns request id
+  int ProtocolManager::Submit(const L2FrameTemplate& frame, const uint8_t *data, int data_length, L2ReplyHandler handler, void *context)
+  {
+    return (s == NULL) ? PM_ERROR_SENDING_COMMAND : requests.Submit(frame, data, data_length, handler, context);
+  }
   
+  // Wait for request to complete, return its status
+  int ProtocolManager::Wait(int id)
+  {
+    if (id < 0 || id >= PM_MAX_PENDING)
+    { // Error submitting request
+      return id;
+    }
+    while (requests.Active(id))
+    {
+      if (ProcessReply(requests.NextTimer(deadline)) == PM_ERROR_TIMEOUT)
+      {
+        requests.CheckTimeouts(deadline);
+      }
+    }
+    return requests.Collect(id);
+  }
   
+  // Wait for all requests whose result was not returned yet (also those that are done already). Returns 0, or the
+  // status of the first failed request
+  int ProtocolManager::WaitAll()
+  {
+    int status = 0;
+    for (int id = 0; id < PM_MAX_PENDING; id++)
+    {
+      int result = requests.Reserved(id) ? Wait(id) : 0;
+      if (status == 0 && result < 0)
+      {
+        status = result;
+      }
+    }
+    return status;
+  }
   
-  // Bluetooth connect; returns < 0 on error.  
-  int ProtocolManager::BTConnect(bdaddr_t* mac_address)
+  // Read a reply and pass it to the request with the same packet index. Replies to requests that are not pending 
+  // (anymore) are ignored.
+  int ProtocolManager::ProcessReply(double limit)
   {
-    struct sockaddr_rc addr = { 0 };
-    // Close (when needed)
-    Close();
-    // allocate a socket (I do not specify non-blocking, so it should be blocking)
-    s = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-    // Set time-out to 4s
-    struct timeval timeout;      
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));    
-    // set the connection parameters (who to connect to)
-    addr.rc_family = AF_BLUETOOTH;                                                                  
-    addr.rc_channel = (uint8_t) 1;
-    memcpy(&addr.rc_bdaddr, &sma_mac, sizeof(bdaddr_t));    
-    // connect to server, return status
-    return connect(s, (struct sockaddr *)&addr, sizeof(addr));
-  }
-  
-  // Wait (indefinitely...) for packet with given command from given sender. Returns false on connection failure.
-  bool ProtocolManager::WaitForPacket(uint16_t command, bdaddr_t *sender, L1Packet *p)
+    int data_length = ReadL2Packet(limit);
+    if (data_length == PM_ERROR_TIMEOUT)
+    {
+      return data_length;
+    }
+    if (data_length == ERR_SMA_CONNECTION_BROKEN)
+    {
+      requests.Fail(PM_ERROR_RECEIVING_REPLY);
+      return data_length;
+    }
+    if (data_length < 0)
+    { // Reply unreadable: we do not know whose reply it was. Drop it; its request is sent again
+      requests.Drop(data_length);
+      return 0;
+    }
+    requests.Dispatch(decoder.Header(), decoder.Data(), data_length);
+    return 0;
+  }
+  
+  // Now + timeout, capped by the deadline
+  double ProtocolManager::Limit(double timeout)
+  {
+    double limit = TimeNow() + timeout;
+    return (deadline > 0 && deadline < limit) ? deadline : limit;
+  }
+  
+  // Private part
+  
+  // Wait until the link is quiet for the given time. Packets that arrive in the mean time are read and dropped. A link
+  // that does not get quiet within the time-out is taken as quiet enough; the deadline is not.
+  bool ProtocolManager::WaitQuiet(double quiet)
+  {
+    L1Packet packet;
+    int status;
+    int timeout_ms = (int) (quiet * 1000 + 0.999);
+    double limit = Limit(Timeout());
+    while ((status = reader.Poll(timeout_ms)) > 0)
+    {
+      if (!packet.Read(&reader, limit))
+      {
+        return false;
+      }
+      if (TimeNow() >= limit)
+      {
+        return deadline == 0 || TimeNow() < deadline;
+      }
+    }
+    return status == 0;
+  }
+  
+  
+  
+  // Wait (until limit) for packet with given command from given sender. Returns false on connection failure/time-out.
+  bool ProtocolManager::WaitForPacket(uint16_t command, bdaddr_t *sender, L1Packet *p, double limit)
   {
     bool status;
-    while ((status = p->Read(s)) && (p->Command() != command || !p->CheckSource(sender)));
+    while ((status = p->Read(&reader, limit)) && (p->Command() != command || !p->CheckSource(sender)));
     return status;
   }
 
@@ -316,25 +679,374 @@ bool ProtocolManager::Logon(uint8_t* password)
     printf("[%02X:%02X:%02X:%02X:%02X:%02X]", m->b[0],m->b[1],m->b[2],m->b[3],m->b[4],m->b[5]);
   }        
   
-  // Send L2 packet as L1 data (over on or more L1 packets)
-  bool ProtocolManager::SendL2(L2Packet *l2, const uint8_t *packet_data, int data_length)
+  // Send L2 request as L1 data (over one or more L1 packets). All L1 packets are sent with a single write; no 
+  // allocations.
+  bool ProtocolManager::SendL2(Transport *t, bdaddr_t *our, bdaddr_t *sma, const L2FrameTemplate& frame, uint8_t index, const uint8_t *packet_data, int data_length)
   {
-    L1Packet l1;
-    int bytes_left;
-    uint8_t *data = l2->PreparePacket(packet_data, data_length, &bytes_left);
-    // Send    
-    while (bytes_left > 0)
+    const int max_packets = (L2_MaxPacketLength + L1_MaxDataLength - 1) / L1_MaxDataLength;
+    uint8_t data[L2_MaxPacketLength];
+    uint8_t headers[max_packets][L1_BodyLength];
+    struct iovec iov[2 * max_packets];
+    static_assert(2 * max_packets <= TRANSPORT_MAX_IOV, "L2 packet needs more buffers than Writev takes");
+    int count = 0;
+    int length = frame.Encode(data, index, packet_data, data_length);
+    if (length < 0)
+    {
+      return false;
+    }
+    // Split in L1 packets: header, followed by at most L1_MaxDataLength bytes of L2 data
+    for (int offset = 0; offset < length; offset += L1_MaxDataLength)
     {     
-      int bytes_to_sent = (bytes_left > L1_MaxDataLength) ? L1_MaxDataLength : bytes_left;
-      bytes_left -= bytes_to_sent;
-      l1.SetHeader(&our_mac, &sma_mac, (bytes_left == 0) ? L1_Command_L2_Packet : L1_Command_L2_PacketPart);
-      if (!l1.Send(s, data, bytes_to_sent)) 
-      { // error sending
-        return false;
+      int bytes_to_send = (length - offset > L1_MaxDataLength) ? L1_MaxDataLength : length - offset;
+      uint8_t *header = headers[count / 2];
+      L1Packet::WriteHeader(header, our, sma, (offset + bytes_to_send == length) ? L1_Command_L2_Packet : L1_Command_L2_PacketPart, bytes_to_send);
+      iov[count].iov_base = header;
+      iov[count++].iov_len = L1_BodyLength;
+      iov[count].iov_base = data + offset;
+      iov[count++].iov_len = bytes_to_send;
+    }
+    return t->Writev(iov, count) == length + (count / 2) * L1_BodyLength;
+  }
+  
+  // Pending requests
+  
+  PendingRequests::PendingRequests(Metrics *metrics)
+  {
+    memset(pending, 0, sizeof(pending));
+    s = NULL;
+    our_mac = sma_mac = NULL;
+    packet_index = 0;
+    rtt = rtt_variance = 0;
+    signal_strength = 0;
+    dropped = false;
+    this->metrics = metrics;
+  }
+  
+  void PendingRequests::Attach(Transport *t, bdaddr_t *our, bdaddr_t *sma)
+  {
+    s = t;
+    dropped = false;
+    // New link: the ids of the requests on the previous one are not waited for anymore
+    for (int id = 0; id < PM_MAX_PENDING; id++)
+    {
+      pending[id].reserved = false;
+    }
+    our_mac = our;
+    sma_mac = sma;
+  }
+  
+  // Send request, register it as pending. Returns request id
+  int PendingRequests::Submit(const L2FrameTemplate& frame, const uint8_t *data, int data_length, L2ReplyHandler handler, void *context)
+  {
+    // Find free slot
+    int id;
+    for (id = 0; id < PM_MAX_PENDING && (pending[id].active || pending[id].reserved); id++);
+    if (id == PM_MAX_PENDING || s == NULL)
+    {
+      return PM_ERROR_SENDING_COMMAND;
+    }
+    if (!ProtocolManager::SendL2(s, our_mac, sma_mac, frame, ++packet_index, data, data_length))
+    {
+      return PM_ERROR_SENDING_COMMAND;
+    }
+    metrics->Count(METRICS_REQUESTS);
+    PendingRequest& r = pending[id];
+    r.active = true;
+    r.reserved = true;
+    r.packet_index = packet_index;
+    r.sent = TimeNow();
+    r.telegram_number = 0xFFFF;
+    r.status = 0;
+    r.handler = handler;
+    r.context = context;
+    // Keep request for resending
+    r.retry_at = r.sent + Timeout();
+    r.attempts = 0;
+    r.resumes = 0;
+    r.lost = false;
+    r.frame = &frame;
+    r.data_length = (data_length > L2_MaxDataLength) ? 0 : data_length;
+    memcpy(r.data, data, r.data_length);
+    return id;
+  }
+  
+  bool PendingRequests::Send(const L2FrameTemplate& frame, const uint8_t *data, int data_length)
+  {
+    return s != NULL && ProtocolManager::SendL2(s, our_mac, sma_mac, frame, ++packet_index, data, data_length);
+  }
+  
+  // Pass reply to the pending request with the same packet index
+  bool PendingRequests::Dispatch(L2PacketHeader *header, uint8_t *data, int data_length)
+  {
+    uint16_t telegram_number = ntohs(header->telegram_number);
+    double now = TimeNow();
+    bool after_drop = dropped;
+    dropped = false;
+    for (int id = 0; id < PM_MAX_PENDING; id++)
+    {
+      PendingRequest& r = pending[id];
+      if (!r.active || r.packet_index != header->packet_index)
+      {
+        continue;
       }
-      // Move data pointer
-      data += bytes_to_sent;
-    }    
-    return true;
+      metrics->Count(METRICS_TELEGRAMS);
+      // The next telegram should follow within the time-out
+      r.retry_at = now + Timeout();
+      // Ignore repeated telegram
+      if (telegram_number == r.telegram_number)
+      {
+        return true;
+      }
+      if (r.telegram_number == 0xFFFF && r.sent > 0)
+      { // Round trip time from the first reply
+        UpdateRoundTripTime(now - r.sent);
+        metrics->Latency(METRICS_REPLY, now - r.sent);
+      }
+      // Telegram numbers count down. Lost (dropped) before this one: one in between, or, when this is the first one
+      // we get, the telegram dropped just before it may have been the real first one
+      if (r.lost || ((r.telegram_number == 0xFFFF) ? after_drop : telegram_number != r.telegram_number - 1))
+      { // Ignore the rest of the reply, send the request again when it ended
+        r.lost = true;
+        r.telegram_number = telegram_number;
+        r.retry_at = (telegram_number == 0) ? now : r.retry_at;
+        return true;
+      }
+      r.telegram_number = telegram_number;
+      uint8_t request[L2_MaxDataLength];
+      memcpy(request, r.data, r.data_length);
+      int result = (r.handler == NULL) ? 0 : r.handler(r.context, header, data, data_length, r.data);
+      if (memcmp(request, r.data, r.data_length) != 0)
+      { // The handler moved the resume point on: progress
+        r.resumes = 0;
+      }
+      if (result != 0 || telegram_number == 0)
+      { // Done (success or failure)
+        r.status = (result < 0) ? result : 0;
+        r.active = false;
+      }
+      return true;
+    }
+#ifdef __DEBUG__
+printf("\tignored reply with packet index %d\n", header->packet_index);
+#endif
+    metrics->Count(METRICS_UNMATCHED_REPLIES);
+    return false;
+  }
+  
+  // Resend requests that got no reply in time (backing off), fail the others that timed out
+  void PendingRequests::CheckTimeouts(double deadline)
+  {
+    double now = TimeNow();
+    for (int id = 0; id < PM_MAX_PENDING; id++)
+    {
+      PendingRequest& r = pending[id];
+      if (!r.active || now < r.retry_at)
+      {
+        continue;
+      }
+      // Resend when there was no reply at all, or when a telegram of the reply was lost (or the last one did not come).
+      // Then the request gets a new packet index, so the rest of the old reply is not taken for the new one; its data
+      // was updated by the reply handler to resume after the telegrams that did arrive.
+      bool partial = (r.telegram_number != 0xFFFF);
+      if (((partial) ? r.resumes < PM_MAX_RESUMES : r.attempts < PM_MAX_RETRIES) && r.frame != NULL &&
+          (deadline == 0 || now < deadline))
+      {
+#ifdef __DEBUG__
+printf("\tresending request with packet index %d\n", r.packet_index);
+#endif
+        if (partial)
+        {
+          r.resumes++;
+          r.packet_index = ++packet_index;
+          r.telegram_number = 0xFFFF;
+          r.lost = false;
+          r.retry_at = now + Timeout();
+        }
+        else
+        {
+          r.attempts++;
+          r.retry_at = now + Timeout() * (1 << r.attempts);
+        }
+        r.sent = 0;
+        metrics->Count(METRICS_RESENT);
+        if (s == NULL || !ProtocolManager::SendL2(s, our_mac, sma_mac, *r.frame, r.packet_index, r.data, r.data_length))
+        {
+          Fail(PM_ERROR_SENDING_COMMAND);
+          return;
+        }
+        continue;
+      }
+      r.status = PM_ERROR_TIMEOUT;
+      r.active = false;
+      metrics->Count(METRICS_TIMEOUTS);
+    }
+    if (deadline > 0 && now >= deadline)
+    {
+      Fail(PM_ERROR_TIMEOUT);
+    }
+  }
+  
+  // Earliest resend/time-out
+  double PendingRequests::NextTimer(double deadline)
+  {
+    double next = deadline;
+    for (int id = 0; id < PM_MAX_PENDING; id++)
+    {
+      if (pending[id].active && (next == 0 || pending[id].retry_at < next))
+      {
+        next = pending[id].retry_at;
+      }
+    }
+    return next;
+  }
+  
+  // The telegram that follows tells whose reply it may have been
+  void PendingRequests::Drop(int error)
+  {
+    metrics->Count((error == ERR_SMA_L2_CHECKSUM) ? METRICS_CHECKSUM_ERRORS : METRICS_INVALID_PACKETS);
+    dropped = true;
+  }
+  
+  // End all pending requests with given status
+  void PendingRequests::Fail(int status)
+  {
+    for (int id = 0; id < PM_MAX_PENDING; id++)
+    {
+      if (pending[id].active)
+      {
+        pending[id].status = status;
+        pending[id].active = false;
+      }
+    }
+  }
+  
+  bool PendingRequests::Active()
+  {
+    for (int id = 0; id < PM_MAX_PENDING; id++)
+    {
+      if (pending[id].active)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+  
+  // Add round trip time measurement; exponential averages of the time and its deviation
+  void PendingRequests::UpdateRoundTripTime(double sample)
+  {
+    if (rtt == 0)
+    {
+      rtt = sample;
+      rtt_variance = sample / 2;
+      return;
+    }
+    rtt_variance = (3 * rtt_variance + ((rtt > sample) ? rtt - sample : sample - rtt)) / 4;
+    rtt = (7 * rtt + sample) / 8;
+  }
+  
+  // Reply time-out: RTO as in TCP (RFC 6298), stretched when the Bluetooth signal is weak
+  double PendingRequests::Timeout()
+  {
+    if (rtt == 0)
+    {
+      return PM_RTO_INITIAL;
+    }
+    double rto = rtt + 4 * rtt_variance;
+    if (signal_strength > 0 && signal_strength < 50)
+    {
+      rto *= 1 + (50 - signal_strength) / 50;
+    }
+    return (rto < PM_RTO_MIN) ? PM_RTO_MIN : (rto > PM_RTO_MAX) ? PM_RTO_MAX : rto;
+  }
+  
+  // Logon sequence
+  
+  // Logon data includes the password
+  void LogonSequence::Start(const uint8_t *password)
+  {
+    memcpy(data_logon, L2_data_logon, sizeof(L2_data_logon)); 
+    for (int i = 0; i < 12 && password[i] != 0; i++)
+    {
+      data_logon[i+16] = (uint8_t) (password[i] + 0x88);
+    }
+    memset(&timing, 0, sizeof(timing));
+    start = phase_start = TimeNow();
+    // Send login_1 when the inverter has finished sending after the L1 handshake
+    step = QUIET_1;
+  }
+  
+  void LogonSequence::Next(int status)
+  {
+    double now = TimeNow();
+    switch (step)
+    {
+      case QUIET_1:
+        step = (status < 0) ? FAILED : LOGIN_1;
+        timing.Login1Attempts++;
+      break;
+      case LOGIN_1:
+#ifdef __DEBUG    
+        if (status < 0)
+        {
+          printf("login 1 failed\n");
+        }
+#endif
+        // Retry. After the last attempt, continue: we sometimes seem to recover. Mostly this fails when we left the 
+        // SMA inverter in a confused state after a protocol error (by us...).     
+        if (status < 0 && timing.Login1Attempts < PM_LOGIN_1_ATTEMPTS)
+        {
+          step = QUIET_1;
+          break;
+        }
+        timing.Login1 = now - phase_start;
+        phase_start = now;
+        step = LOGIN_2;
+      break;
+      case LOGIN_2:
+        // No reply: give the inverter time to process it, wait for a quiet link
+        step = (status < 0) ? FAILED : QUIET_2;
+      break;
+      case QUIET_2:
+        timing.Login2 = now - phase_start;
+        phase_start = now;
+        step = (status < 0) ? FAILED : LOGON;
+      break;
+      case LOGON:
+        timing.Logon = now - phase_start;
+        step = (status < 0) ? FAILED : DONE;
+      break;
+      default:
+      break;
+    }
+    if (Finished())
+    {
+      timing.Total = now - start;
+    }
+  }
+  
+  const L2FrameTemplate& LogonSequence::Frame()
+  {
+    return (step == LOGIN_1) ? L2_frame_login_1 : (step == LOGIN_2) ? L2_frame_login_2 : L2_frame_logon;
+  }
+  
+  const uint8_t *LogonSequence::Data()
+  {
+    return (step == LOGIN_1) ? L2_data_login_1 : (step == LOGIN_2) ? L2_data_login_2 : data_logon;
+  }
+  
+  int LogonSequence::DataLength()
+  {
+    return (step == LOGIN_1) ? sizeof(L2_data_login_1) : (step == LOGIN_2) ? sizeof(L2_data_login_2) : sizeof(data_logon);
+  }
+  
+  // A quarter of the round trip time, within limits
+  double LogonSequence::Pacing(double rtt)
+  {
+    if (rtt == 0)
+    { // Unknown link
+      return PM_PACING_INITIAL;
+    }
+    double pacing = rtt / 4;
+    return (pacing < PM_PACING_MIN) ? PM_PACING_MIN : (pacing > PM_PACING_MAX) ? PM_PACING_MAX : pacing;
   }
-
@@ -1,17 +1,43 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include "L2.h"
+#include "Metrics.h"
 
+#ifndef __PROTOCOL_MANAGER_H__
+#define __PROTOCOL_MANAGER_H__
 
 #define PM_ERROR_SENDING_COMMAND      -1
 #define PM_ERROR_RECEIVING_REPLY      -2
 #define PM_ERROR_INTERPRETING_REPLY   -3
+#define PM_ERROR_TIMEOUT              -4
 
 #define PM_MAX_RECORDS                10000     // maximum 10000 historic records retreived in a single read
+#define PM_MAX_PENDING                8         // maximum number of requests in flight
+#define PM_REQUEST_DONE               1         // reply handler: request complete
+#define PM_LOGIN_1_ATTEMPTS           2         // send login_1 at most twice when there is no (valid) reply
+#define PM_MAX_RETRIES                2         // resend a request at most twice when it gets no reply
+#define PM_MAX_RESUMES                2         // send a request again at most twice in a row after a lost telegram,
+                                                // unless the reply handler moved its resume point on in between
+
+// Time-out for a reply: smoothed round trip time + 4 x its variation, longer on a weak Bluetooth signal, within these
+// limits [s]. Until the round trip time is known PM_RTO_INITIAL is used.
+#define PM_RTO_MIN                    0.5
+#define PM_RTO_MAX                    10.0
+#define PM_RTO_INITIAL                TRANSPORT_TIMEOUT
+// Time-out for connecting [s]
+#define PM_CONNECT_TIMEOUT            (2*TRANSPORT_TIMEOUT)
+
+// Pacing between logon steps: wait until the link has been quiet for a quarter of the round trip time, within these
+// limits [s]. A local TCP link (simulator) measures a few ms, Bluetooth tens of ms, a weak Bluetooth signal more.
+// Until the round trip time is known PM_PACING_INITIAL (the former fixed wait) is used.
+#define PM_PACING_MIN                 0.001
+#define PM_PACING_MAX                 0.05
+#define PM_PACING_INITIAL             0.003
 
 typedef struct
 {
@@ -22,17 +48,138 @@ typedef struct
   uint32_t FeedInTime;    // [s]
 } YieldInfo;
 
+// Spot value groups, see BeginSpotValues
+#define SPOT_AC                       0x01      // AC power (total, per phase), voltage, current and grid frequency
+#define SPOT_DC                       0x02      // DC power, voltage and current per string
+#define SPOT_TEMPERATURE              0x04      // inverter temperature
+#define SPOT_ALL                      (SPOT_AC | SPOT_DC | SPOT_TEMPERATURE)
+#define SPOT_MAX_PHASES               3
+#define SPOT_MAX_STRINGS              2
+#define SPOT_MAX_REQUESTS             3         // one per L2 command
+// Value of a field that was not requested or not returned by the inverter
+#define SPOT_NAN                      INT32_MIN
+
+// Spot values, SPOT_NAN when unknown
+typedef struct
+{
+  int32_t TimeStamp;                            // of the most recent value
+  int32_t ACPower;                              // [W]
+  int32_t ACPhasePower[SPOT_MAX_PHASES];        // [W]
+  int32_t ACVoltage[SPOT_MAX_PHASES];           // [0.01 V]
+  int32_t ACCurrent[SPOT_MAX_PHASES];           // [mA]
+  int32_t GridFrequency;                        // [0.01 Hz]
+  int32_t DCPower[SPOT_MAX_STRINGS];            // [W]
+  int32_t DCVoltage[SPOT_MAX_STRINGS];          // [0.01 V]
+  int32_t DCCurrent[SPOT_MAX_STRINGS];          // [mA]
+  int32_t Temperature;                          // [0.01 degrees C]
+} SpotValues;
+
 typedef struct
 {
   int32_t TimeStamp;
   uint32_t Value;
 } HistoricInfoItem;
 
+// Duration of the phases of the last Logon [s]
 typedef struct
 {
+  double Login1;          // login_1 sent (after quiet link) until its reply
+  double Login2;          // login_2 sent until the link is quiet
+  double Logon;           // logon sent until its reply
+  double Total;
+  int Login1Attempts;
+} LogonTiming;
+
+// Historic yield records, with the timestamps and the values in separate contiguous arrays (e.g. for computing
+// deltas/power in one pass over the values). Frees its arrays when destroyed; can be moved, not copied.
+class HistoricInfo
+{
+  int32_t *timestamps;
+  uint32_t *values;
+  uint32_t capacity;
+  
+  public:
+  
   uint32_t NoRecords;
-  HistoricInfoItem *Records;
-} HistoricInfo;
+  
+  HistoricInfo()
+  {
+    timestamps = NULL;
+    values = NULL;
+    capacity = NoRecords = 0;
+  }
+  
+  ~HistoricInfo()
+  {
+    free(timestamps);
+    free(values);
+  }
+  
+  // Take over the records of other, which is left empty
+  HistoricInfo(HistoricInfo&& other)
+  {
+    timestamps = NULL;
+    values = NULL;
+    capacity = NoRecords = 0;
+    Swap(other);
+  }
+  
+  HistoricInfo& operator=(HistoricInfo&& other)
+  {
+    Swap(other);
+    return *this;
+  }
+  
+  HistoricInfo(const HistoricInfo&) = delete;
+  HistoricInfo& operator=(const HistoricInfo&) = delete;
+  
+  void Swap(HistoricInfo& other);
+  
+  // Make room for at least n records. Returns false when out of memory
+  bool Reserve(uint32_t n);
+  
+  // Remove all records; the capacity is kept
+  void Clear()
+  {
+    NoRecords = 0;
+  }
+  
+  // Make room for no_records more records, growing the capacity at least 1.5 times when needed. Returns false when
+  // out of memory
+  bool Grow(uint32_t no_records)
+  {
+    return (NoRecords + no_records <= capacity) || Reserve((NoRecords + no_records > capacity + capacity / 2) ? (NoRecords + no_records) : (capacity + capacity / 2));
+  }
+  
+  int32_t *TimeStamps()
+  {
+    return timestamps;
+  }
+  
+  uint32_t *Values()
+  {
+    return values;
+  }
+  
+  int32_t TimeStamp(uint32_t i) const
+  {
+    return timestamps[i];
+  }
+  
+  uint32_t Value(uint32_t i) const
+  {
+    return values[i];
+  }
+  
+  uint32_t Capacity() const
+  {
+    return capacity;
+  }
+  
+  // Number of records in [from, to] for 5 minute or daily values, at most PM_MAX_RECORDS: the capacity to reserve
+  // for a request
+  static uint32_t ExpectedRecords(int32_t from, int32_t to, bool daily);
+};
 
 
 
@@ -59,6 +206,230 @@ typedef struct __attribute__ ((__packed__))
   uint32_t fill;
 } _HistoricYieldInfo;
 
+typedef struct __attribute__ ((__packed__))
+{
+  uint8_t index;          // phase/string (1...), 0 for values of the inverter
+  uint16_t code;
+  uint8_t type;
+  int32_t timestamp;
+  int32_t value;          // 0x80000000 (signed) or 0xFFFFFFFF (unsigned values) when unknown
+  int32_t fill[4];        // minimum, maximum, ...
+} _SpotValueInfo;
+
+
+// Receives historic yield records as they arrive, one telegram at a time
+class HistoricYieldSink
+{
+  public:
+  
+  virtual ~HistoricYieldSink()
+  {
+  }
+  
+  // Records of one telegram (only valid during the call). Returns 0 to continue, PM_REQUEST_DONE to end the request 
+  // early, or < 0 on failure (ends the request with this status)
+  virtual int Records(HistoricInfoItem *records, int no_records) = 0;
+};
+
+// Called for every reply (telegram) to a request. Returns 0 to continue (the request is done after the last telegram),
+// PM_REQUEST_DONE to end the request early, or < 0 when the reply is invalid (ends the request with this status).
+// request is the data of the request. When a telegram of the reply is lost, the request is sent again with this
+// data: the handler of a reply of several telegrams may update it to resume after the telegrams it got.
+typedef int (*L2ReplyHandler)(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request);
+
+// Request waiting for its reply
+typedef struct
+{
+  bool active;
+  bool reserved;              // the request id was handed out and its status is not collected yet (Collect)
+  uint8_t packet_index;       // replies carry the packet index of the request
+  double sent;                // time the request was sent [s], 0 when it was resent (no round trip time measurement)
+  uint16_t telegram_number;   // telegram number of the last reply; they count down, the last telegram has number 0
+  bool lost;                  // a telegram of the reply was lost: the rest of it is ignored, the request is sent again
+  int status;                 // result when done
+  L2ReplyHandler handler;     // NULL: ignore reply contents
+  void *context;
+  // Resending
+  double retry_at;            // resend at this time [s]
+  int attempts;               // number of times resent without a reply
+  int resumes;                // number of times sent again after a lost telegram, since the last progress
+  const L2FrameTemplate *frame;
+  uint8_t data[L2_MaxDataLength];
+  int data_length;
+} PendingRequest;
+
+// Requests in flight on one link: sends them, matches the replies to their request by packet index, resends requests
+// that get no reply and times out the others. Also keeps the round trip time that sets the time-outs. Shared by the
+// ProtocolManager, which blocks until a request is done, and the InverterPoll, which is driven by an event loop.
+class PendingRequests
+{
+  PendingRequest pending[PM_MAX_PENDING];
+  // Link: transport and our/inverter MAC addresses (read on every send; ours is known after the L1 handshake)
+  Transport *s;
+  bdaddr_t *our_mac;
+  bdaddr_t *sma_mac;
+  // Packet index (8 bits in the L2 header)
+  uint8_t packet_index;
+  // Smoothed round trip time and its mean deviation [s], 0 when not measured yet
+  double rtt;
+  double rtt_variance;
+  // Last measured Bluetooth signal strength [%], 0 when unknown
+  double signal_strength;
+  // An unreadable reply was dropped since the last telegram
+  bool dropped;
+  // Counters and latencies of the owner
+  Metrics *metrics;
+
+  public:
+  PendingRequests(Metrics *metrics);
+
+  // Send over transport t (NULL: not connected) from our MAC address to the inverter
+  void Attach(Transport *t, bdaddr_t *our, bdaddr_t *sma);
+
+  // Send request from frame template with given data. handler is called for every reply (telegram); NULL ignores
+  // the replies. Returns request id (>= 0) or PM_ERROR_SENDING_COMMAND. The id is not reused for another request until
+  // its status is collected, or until Attach
+  int Submit(const L2FrameTemplate& frame, const uint8_t *data, int data_length, L2ReplyHandler handler, void *context);
+
+  // Send request that gets no reply. Returns false on failure
+  bool Send(const L2FrameTemplate& frame, const uint8_t *data, int data_length);
+
+  // Pass a decoded reply to the request with the same packet index; its next telegram is due within the time-out.
+  // After a lost telegram the rest of the reply is ignored. Returns false when no request matches
+  bool Dispatch(L2PacketHeader *header, uint8_t *data, int data_length);
+
+  // Drop an unreadable reply (L2 error ERR_SMA_L2_CHECKSUM or ERR_SMA_INVALID_PACKET) instead of failing all requests:
+  // the request it belonged to loses a telegram and is sent again
+  void Drop(int error);
+
+  // Resend requests that got no reply in time (backing off) or lost a telegram of their reply, fail the others that
+  // timed out; all of them when the deadline (TimeNow() based, 0: none) passed
+  void CheckTimeouts(double deadline);
+
+  // Time of the next resend/time-out of a pending request, or the deadline (0: none) when that is earlier. 0 when
+  // there is neither
+  double NextTimer(double deadline);
+
+  // End all pending requests with given status
+  void Fail(int status);
+
+  // Request id is still waiting for its reply
+  bool Active(int id)
+  {
+    return pending[id].active;
+  }
+
+  // Any request is waiting for its reply
+  bool Active();
+
+  // Result of request id when done
+  int Status(int id)
+  {
+    return pending[id].status;
+  }
+
+  // Result of request id when done; frees the id for a next request
+  int Collect(int id)
+  {
+    pending[id].reserved = false;
+    return pending[id].status;
+  }
+
+  // Request id was handed out and its status is not collected yet
+  bool Reserved(int id)
+  {
+    return pending[id].reserved;
+  }
+
+  // Add round trip time measurement [s]; Reset forgets the measurements (new link)
+  void UpdateRoundTripTime(double sample);
+  void ResetRoundTripTime()
+  {
+    rtt = rtt_variance = 0;
+  }
+
+  // Smoothed round trip time [s], 0 when unknown
+  double RoundTripTime()
+  {
+    return rtt;
+  }
+
+  // Bluetooth signal strength [%] (0: unknown), stretches the time-out when weak
+  void SetSignalStrength(double strength)
+  {
+    signal_strength = strength;
+  }
+
+  // Current time-out for a reply [s]
+  double Timeout();
+};
+
+// Steps of a logon: quiet link, login_1 (sent again when it gets no valid reply), login_2 (no reply), quiet link,
+// logon. Shared by ProtocolManager::Logon, which blocks, and the InverterPoll, which is driven by an event loop: the
+// owner performs the current step (waits for a quiet link, or sends its request and waits for the reply) and passes
+// its result to Next.
+class LogonSequence
+{
+  public:
+  enum Step { QUIET_1, LOGIN_1, LOGIN_2, QUIET_2, LOGON, DONE, FAILED };
+
+  private:
+  Step step;
+  uint8_t data_logon[sizeof(L2_data_logon)];
+  double start;
+  double phase_start;
+  LogonTiming timing;
+
+  public:
+  LogonSequence()
+  {
+    step = DONE;
+    memset(data_logon, 0, sizeof(data_logon));
+    start = phase_start = 0;
+    memset(&timing, 0, sizeof(timing));
+  }
+
+  // Start logging on with password
+  void Start(const uint8_t *password);
+
+  // Current step ended with status (< 0: failed): go to the next step
+  void Next(int status);
+
+  Step Current()
+  {
+    return step;
+  }
+
+  bool Finished()
+  {
+    return step == DONE || step == FAILED;
+  }
+
+  // The current step waits until the link has been quiet for Pacing()
+  bool Quiet()
+  {
+    return step == QUIET_1 || step == QUIET_2;
+  }
+
+  // Request of the current step (LOGIN_1, LOGIN_2, LOGON); Reply: a reply is expected
+  const L2FrameTemplate& Frame();
+  const uint8_t *Data();
+  int DataLength();
+  bool Reply()
+  {
+    return step != LOGIN_2;
+  }
+
+  // Phase durations, complete when finished
+  const LogonTiming& Timing()
+  {
+    return timing;
+  }
+
+  // Time the link should be quiet between logon steps for the given round trip time (0: unknown) [s]
+  static double Pacing(double rtt);
+};
+
 
 class ProtocolManager
 {
@@ -68,122 +439,186 @@ class ProtocolManager
   bdaddr_t sma_mac;
   bdaddr_t empty_mac;
   // Stream for communication
-  int s;
-  // Packet index
-  uint16_t packet_index;
+  Transport *s;
+  // Buffered reader of L1 packets from stream s
+  L1Reader reader;
+  // Decoder of received L2 packets (holds the data of the last one)
+  L2Decoder decoder;
+  // Counters and latencies of all exchanges; bytes of closed transports only
+  Metrics metrics;
+  // Requests in flight
+  PendingRequests requests;
+  // Hard deadline of all operations (TimeNow() based) [s], 0: none
+  double deadline;
+  // An L2 packet is being decoded (a read ended at its time-out between the L1 packets)
+  bool decoding;
+  // Phase durations of the last logon
+  LogonTiming logon_timing;
   
   public:  
   ProtocolManager();
   ~ProtocolManager();
   
-  // Connect to inverter with given MAC address
-  int Connect(char* mac_address);
+  // Connect to inverter with given MAC address. Uses Bluetooth RFCOMM, unless a transport description is given
+  // (see Transport::Create)
+  int Connect(char* mac_address, const char* transport = NULL);
   
-  // Get bluetooth strength (0-99.x%)
+  // Connect to inverter with given MAC address over an opened transport. The protocol manager takes ownership of
+  // the transport (closes and deletes it).
+  int Connect(Transport *transport, char* mac_address);
+  
+  // Get bluetooth strength (0-99.x%); also used to adapt the time-outs
   double BluetoothStrength();
+  
+  // Logon with password. Steps through login_1, login_2, and logon as the inverter replies; paced by the measured
+  // round trip time
   bool Logon(uint8_t* password);
+  
+  // Phase durations of the last Logon
+  const LogonTiming& LastLogonTiming()
+  {
+    return logon_timing;
+  }
+  
+  // Counters and latencies of all exchanges so far, including the bytes of the current connection
+  Metrics GetMetrics()
+  {
+    Metrics current = metrics;
+    if (s != NULL)
+    {
+      current.Count(METRICS_BYTES_SENT, s->BytesWritten);
+      current.Count(METRICS_BYTES_RECEIVED, s->BytesRead);
+    }
+    return current;
+  }
+  
+  // Smoothed round trip time of the link [s], 0 when unknown
+  double RoundTripTime()
+  {
+    return requests.RoundTripTime();
+  }
+  
+  // Set hard deadline (TimeNow() based) [s] for all following operations, 0 for none. Operations that cannot complete
+  // before it fail with PM_ERROR_TIMEOUT (connect/logon: error). Independent of the deadline, every wait for the 
+  // inverter is limited by Timeout().
+  void SetDeadline(double deadline)
+  {
+    this->deadline = deadline;
+  }
+  
+  double Deadline()
+  {
+    return deadline;
+  }
+  
+  // Current time-out for a reply [s]: adapts to the measured round trip time and Bluetooth signal strength
+  double Timeout()
+  {
+    return requests.Timeout();
+  }
+  
   int GetYieldInfo(YieldInfo& yi);
   
+  // Get historic yield in hi (cleared first). Capacity for the requested range is reserved before the request is sent,
+  // so the records are not copied while they arrive.
   int GetHistoricYield(int32_t from, int32_t to, HistoricInfo& hi, bool daily);
   
+  // Get historic yield; records are passed to the sink per telegram as soon as it is received and checked. Memory use
+  // is bounded to one telegram and there is no record limit.
+  int GetHistoricYield(int32_t from, int32_t to, HistoricYieldSink& sink, bool daily);
+  
+  // Get spot values of the given groups (SPOT_...) in one round trip. Note: waits for all pending requests
+  int GetSpotValues(SpotValues& sv, int groups = SPOT_ALL);
+  
+  // Pipelined requests: Begin... sends the request and returns a request id (>= 0) or an error (< 0). Several requests 
+  // can be in flight; replies are matched to their request by packet index. Wait(id) or WaitAll() reads replies until
+  // the request(s) are done and returns the result. yi/hi must stay valid until then. A request id is not reused
+  // before its result was returned by Wait or WaitAll, so every id must be waited for.
+  int BeginYieldInfo(YieldInfo& yi);
+  int BeginHistoricYield(int32_t from, int32_t to, HistoricInfo& hi, bool daily);
+  int BeginHistoricYield(int32_t from, int32_t to, HistoricYieldSink& sink, bool daily);
+  int Wait(int id);
+  int WaitAll();
+  
+  // Request spot values of the given groups: one request per L2 command, covering the value codes of all groups that 
+  // use it. Returns the number of requests sent, their ids in ids (room for SPOT_MAX_REQUESTS; wait for each of them),
+  // or an error (< 0) after waiting for the requests that were sent
+  int BeginSpotValues(SpotValues& sv, int *ids, int groups = SPOT_ALL);
+  
+  // Send request from frame template with given data. handler is called for every reply (telegram); NULL ignores 
+  // the replies. Returns request id (>= 0) or PM_ERROR_SENDING_COMMAND
+  int Submit(const L2FrameTemplate& frame, const uint8_t *data, int data_length, L2ReplyHandler handler, void *context);
+  
   // Close connection
   void Close();
   
+  // Building blocks, shared with the PollEngine
+  
+  // Send L2 request built from a frame template with given packet index and data from our MAC to the inverter
+  static bool SendL2(Transport *t, bdaddr_t *our, bdaddr_t *sma, const L2FrameTemplate& frame, uint8_t index, const uint8_t *data, int data_length);
+  
+  // Reply handlers
+  static int YieldInfoReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request);
+  static int HistoricYieldReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request);
+  static int HistoricYieldSinkReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request);
+  static int SpotValuesReply(void *context, L2PacketHeader *header, uint8_t *data, int data_length, uint8_t *request);
+  
+  // Set all spot values to SPOT_NAN
+  static void ClearSpotValues(SpotValues& sv);
+  // Fill value range requests for the given spot value groups; frames/data get at most SPOT_MAX_REQUESTS entries. 
+  // Returns the number of requests
+  static int SpotValueRequests(int groups, const L2FrameTemplate **frames, L2_data_value_range *data);
+  
   private:
-  // Send L2 packet. Note that the data and length of the data is provided separately
-  bool SendL2(L2Packet *l2, const uint8_t *data, int data_length);
-  // Read L2 packet by combining the data read from one or more L1 packets. 
-  uint8_t *ReadL2Packet(int* length);
+  // Send historic yield request; replies go to handler
+  int SubmitHistoricYield(int32_t from, int32_t to, bool daily, L2ReplyHandler handler, void *context);
+  // Copy no_frames records of a historic yield reply
+  static void CopyHistoricYield(uint8_t *data, int no_frames, HistoricInfoItem *records);
+  // Update historic yield request data to resume after the no_frames records of a reply
+  static void ResumeHistoricYield(uint8_t *data, int no_frames, uint8_t *request);
+  static void CopyHistoricYield(uint8_t *data, int no_frames, int32_t *timestamps, uint32_t *values);
+
+  // Read L2 packet by decoding the data read from one or more L1 packets, until limit at most. Returns data length, 
+  // PM_ERROR_TIMEOUT when the limit passed (call again to continue), other value < 0 on failure
+  int ReadL2Packet(double limit);
+  // Read one reply until limit at most and pass it to its request. Returns PM_ERROR_TIMEOUT when the limit passed, 
+  // other value < 0 when reading failed (all pending requests fail)
+  int ProcessReply(double limit);
+  // Now + timeout, but not after the deadline
+  double Limit(double timeout);
+  // Wait until no data arrives for the given time [s]; received packets are dropped. Returns false on failure
+  bool WaitQuiet(double quiet);
   
-  int BTConnect(bdaddr_t* mac_address);
-  bool WaitForPacket(uint16_t command, bdaddr_t *sender, L1Packet *p);
+  // Wait until limit at most for packet with given command from given sender
+  bool WaitForPacket(uint16_t command, bdaddr_t *sender, L1Packet *p, double limit);
   void PrintMac(bdaddr_t *m);
   
-  // Read L2 packet from inverter. Check validity of the packet (counter, etc) and return contents. Note: when receiving an
-  // out-of-order packet (invalid packet number), we ignore it and try again...
-  uint8_t *ReadAndCheck(L2Packet *l2, int *data_length)
+  // Check length of a framed reply (_FrameInfo followed by frames of frame_size bytes). Returns number of frames, < 0
+  // when the length does not match
+  static int CheckFramedReply(uint8_t *data, int data_length, int frame_size)
   {
-    uint8_t *data;
-    do
-    {
-      // Read packet as array of bytes (may return null)
-      data = ReadL2Packet(data_length);
-      // Interpret packet data (handles data = null)    
-      *data_length = l2->ReadPacket(data, *data_length);
-      if (*data_length < 0)
-      { // Error interpreting packet
-          free(data);
-          return NULL;
-      }
-#ifdef __DEBUG__      
-if (l2->PacketIndex() != packet_index)
-{      
-printf("\tpacket index mismatch received %d != local %d\n", l2->PacketIndex(), packet_index);
-printf("\t\tpacket index mismatch received %d != local %d\n", l2->PacketIndex(), packet_index);
-}
-for (int i = 0; i < sizeof(L2PacketHeader); i++)
-{
-  printf("%02X ", ((uint8_t *) &l2->header)[i]);
-}
-printf("\n");
-#endif      
-    } while (l2->PacketIndex() != packet_index);
-    // Succesfully read and ignored an L2 packet
-    return data;
-  }
-  
-  // Read L2 packet from inverter. Only check presence and validity of the packet, ignore contents
-  bool DummyL2Read()
-  {
-    L2Packet l2;
-    uint8_t *data;
-    int data_length;
-    // Read data
-    data = ReadAndCheck(&l2, &data_length);
-    if (data == NULL)
-    { // failure
-      return false;
-    }
-    // Succesfully read and ignored an L2 packet
-    free(data);
-    return true;
-  }
-  
-  uint8_t *GetFramedReply(L2Packet* l2, int* data_length, int frame_size)
-  {
-      uint8_t *data;      
-      // Read reply
-      data = ReadAndCheck(l2, data_length);
-      if (data == NULL)
-      {
-#ifdef __DEBUG__      
-printf("GetFramedReply: data = null\n");
-#endif      
-        return NULL;
-      }
       // Check minimum reply length
-      if (*data_length < sizeof(_FrameInfo))
+      if (data_length < (int) sizeof(_FrameInfo))
       {
 #ifdef __DEBUG__      
-printf("GetFramedReply: Response too short\n");
+printf("CheckFramedReply: Response too short\n");
 #endif      
-        free(data);
-        return NULL;
+        return PM_ERROR_INTERPRETING_REPLY;
       }      
       // Check reply length
-      int expected_size = sizeof(_FrameInfo) + (((_FrameInfo *)data)->end_frame - ((_FrameInfo *)data)->start_frame + 1) * frame_size; 
-      if (*data_length != expected_size)
+      int no_frames = btohl(((_FrameInfo *)data)->end_frame) - btohl(((_FrameInfo *)data)->start_frame) + 1;
+      int expected_size = sizeof(_FrameInfo) + no_frames * frame_size; 
+      if (no_frames < 0 || data_length != expected_size)
       {
 #ifdef __DEBUG__      
-printf("GetFramedReply: Size mismatch, expected != actual: %d != %d!", expected_size, *data_length);
+printf("CheckFramedReply: Size mismatch, expected != actual: %d != %d!", expected_size, data_length);
 #endif
-        free(data);
-        return NULL;        
+        return PM_ERROR_INTERPRETING_REPLY;
       }
       // Ok!
-      return data;
+      return no_frames;
   }
   
 };
 
-
+#endif
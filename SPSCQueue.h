@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifndef __SPSC_QUEUE_H__
+#define __SPSC_QUEUE_H__
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread: a ring of Size items (a power
+// of 2). head is only written by the consumer, tail only by the producer; an item is published by the release store
+// of tail and handed back by the release store of head, so neither side ever takes a lock. Push and Pop do not
+// block: the caller decides how to wait (backpressure) when the queue is full or empty.
+template <class T, uint32_t Size> class SPSCQueue
+{
+  static_assert(Size != 0 && (Size & (Size - 1)) == 0, "SPSCQueue size must be a power of 2");
+
+  // Counters keep running; the index in the ring is counter % Size. On separate cache lines, so the two threads do
+  // not invalidate each other's line on every item
+  alignas(64) std::atomic<uint32_t> head;     // next item to pop
+  alignas(64) std::atomic<uint32_t> tail;     // next free slot
+  alignas(64) T items[Size];
+
+  public:
+
+  SPSCQueue()
+  {
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+  }
+
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  // Producer: copy item into the queue. Returns false when the queue is full
+  bool Push(const T& item)
+  {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == Size)
+    {
+      return false;
+    }
+    items[t & (Size - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer: oldest item, NULL when the queue is empty. It stays valid until Pop
+  T *Front()
+  {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (tail.load(std::memory_order_acquire) == h)
+    {
+      return NULL;
+    }
+    return &items[h & (Size - 1)];
+  }
+
+  // Consumer: release the item returned by Front
+  void Pop()
+  {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Consumer: move the oldest item to item. Returns false when the queue is empty
+  bool Pop(T& item)
+  {
+    T *front = Front();
+    if (front == NULL)
+    {
+      return false;
+    }
+    item = *front;
+    Pop();
+    return true;
+  }
+
+  // Number of items in the queue (a snapshot, when called while the other thread is active)
+  uint32_t Count() const
+  {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+  }
+
+  bool Empty() const
+  {
+    return Count() == 0;
+  }
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "Session.h"
+
+
+Session::Session(const char *mac_address, const uint8_t *password, const char *transport)
+{
+  strncpy(mac, mac_address, sizeof(mac) - 1);
+  mac[sizeof(mac) - 1] = 0;
+  strncpy((char *) this->password, (const char *) password, sizeof(this->password) - 1);
+  this->password[sizeof(this->password) - 1] = 0;
+  this->transport[0] = 0;
+  if (transport != NULL)
+  {
+    strncpy(this->transport, transport, sizeof(this->transport) - 1);
+    this->transport[sizeof(this->transport) - 1] = 0;
+  }
+  open = false;
+  last_activity = 0;
+  Connects = Logons = 0;
+}
+
+// Connect and logon when needed
+int Session::Open()
+{
+  if (open)
+  {
+    return 0;
+  }
+  Connects++;
+  if (pm.Connect(mac, transport))
+  {
+    pm.Close();
+    return SESSION_ERROR_CONNECT;
+  }
+  Logons++;
+  if (!pm.Logon(password))
+  {
+    pm.Close();
+    return SESSION_ERROR_LOGON;
+  }
+  open = true;
+  last_activity = TimeNow();
+  return 0;
+}
+
+// Run exchange, log on again and retry once on failure
+int Session::Run(int (*exchange)(ProtocolManager *pm, void *context), void *context, double deadline)
+{
+  pm.SetDeadline(deadline);
+  int status = Open();
+  if (status)
+  {
+    pm.SetDeadline(0);
+    return status;
+  }
+  status = exchange(&pm, context);
+  // Only link and protocol errors are retried, not e.g. a database error of the exchange. No time left for a retry
+  // after a time-out at the deadline
+  bool protocol_error = (status == PM_ERROR_SENDING_COMMAND || status == PM_ERROR_RECEIVING_REPLY ||
+                         status == PM_ERROR_INTERPRETING_REPLY || status == PM_ERROR_TIMEOUT);
+  if (protocol_error && (deadline == 0 || TimeNow() < deadline))
+  {
+    // Link error: reconnect. Otherwise, the inverter may have ended our logon: log on again on the same link.
+    if (status == PM_ERROR_SENDING_COMMAND || status == PM_ERROR_RECEIVING_REPLY || status == PM_ERROR_TIMEOUT)
+    {
+      Close();
+    }
+    else
+    {
+      Logons++;
+      if (!pm.Logon(password))
+      {
+        Close();
+      }
+    }
+    if ((status = Open()) == 0)
+    {
+      status = exchange(&pm, context);
+    }
+  }
+  if (status == 0)
+  {
+    last_activity = TimeNow();
+  }
+  pm.SetDeadline(0);
+  return status;
+}
+
+// Exchanges for the single requests
+typedef struct
+{
+  YieldInfo *yi;
+  HistoricInfo *hi;
+  int32_t from;
+  int32_t to;
+  bool daily;
+} _SessionRequest;
+
+static int YieldInfoExchange(ProtocolManager *pm, void *context)
+{
+  return pm->GetYieldInfo(*((_SessionRequest *) context)->yi);
+}
+
+static int HistoricYieldExchange(ProtocolManager *pm, void *context)
+{
+  _SessionRequest *r = (_SessionRequest *) context;
+  // Do not keep records of a failed attempt (GetHistoricYield clears them)
+  return pm->GetHistoricYield(r->from, r->to, *r->hi, r->daily);
+}
+
+int Session::GetYieldInfo(YieldInfo& yi)
+{
+  _SessionRequest r = { &yi, NULL, 0, 0, false };
+  return Run(YieldInfoExchange, &r);
+}
+
+int Session::GetHistoricYield(int32_t from, int32_t to, HistoricInfo& hi, bool daily)
+{
+  _SessionRequest r = { NULL, &hi, from, to, daily };
+  return Run(HistoricYieldExchange, &r);
+}
+
+// Keep alive when idle
+bool Session::KeepAlive()
+{
+  if (!open)
+  {
+    return false;
+  }
+  if (TimeNow() - last_activity < SESSION_KEEPALIVE_INTERVAL)
+  {
+    return true;
+  }
+  if (pm.BluetoothStrength() < 0)
+  { // Link broken; reconnect on next request
+    Close();
+    return false;
+  }
+  last_activity = TimeNow();
+  return true;
+}
+
+void Session::Close()
+{
+  pm.Close();
+  open = false;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "ProtocolManager.h"
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+// Send a keep alive when the session has been idle this long [s]
+#define SESSION_KEEPALIVE_INTERVAL    20
+
+#define SESSION_ERROR_CONNECT         -10
+#define SESSION_ERROR_LOGON           -11
+
+// Long-running connection to an inverter. Connects and logs on when needed, keeps the link alive between requests,
+// and reconnects/logs on again only when a request fails.
+class Session
+{
+  ProtocolManager pm;
+  char mac[18];
+  uint8_t password[13];
+  char transport[1024];
+  bool open;              // connected and logged on
+  double last_activity;   // time of the last successful exchange [s]
+  
+  public:
+  
+  // Number of connects and logons done
+  uint32_t Connects;
+  uint32_t Logons;
+  
+  Session(const char *mac_address, const uint8_t *password, const char *transport = NULL);
+  
+  ~Session()
+  {
+    Close();
+  }
+  
+  // Connect and logon when not done yet. Returns 0 on success
+  int Open();
+  
+  // Run an exchange with the inverter: exchange(pm, context) sends requests and waits for the replies, returning 0 or
+  // an error. When it fails with a PM_ERROR_... value, the session logs on again (after reconnecting on a link error)
+  // and the exchange is retried once, also when the session was opened for this run. Other errors of the exchange are
+  // returned at once. Everything, including connect and logon, ends at the deadline (TimeNow() based, 0: none).
+  int Run(int (*exchange)(ProtocolManager *pm, void *context), void *context, double deadline = 0);
+  
+  int GetYieldInfo(YieldInfo& yi);
+  int GetHistoricYield(int32_t from, int32_t to, HistoricInfo& hi, bool daily);
+  
+  // Send a keep alive (L1 request for info) when the session has been idle for SESSION_KEEPALIVE_INTERVAL. On 
+  // failure the session is closed; it is reopened by the next request. Returns false when the link is broken.
+  bool KeepAlive();
+  
+  // Close connection
+  void Close();
+  
+  ProtocolManager *Manager()
+  {
+    return &pm;
+  }
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "TimeSeries.h"
+
+// Zigzag encoding: small negative and positive numbers become small unsigned numbers
+static inline uint32_t ZigZag(int32_t n)
+{
+  return ((uint32_t) n << 1) ^ (uint32_t) (n >> 31);
+}
+
+static inline int32_t UnZigZag(uint32_t n)
+{
+  return (int32_t) (n >> 1) ^ -(int32_t) (n & 1);
+}
+
+// LEB128 varint: 7 bits per byte, high bit set when more bytes follow. Returns the number of bytes written
+static inline int WriteVarint(uint8_t *p, uint64_t n)
+{
+  int length = 0;
+  while (n >= 0x80)
+  {
+    p[length++] = (uint8_t) (n | 0x80);
+    n >>= 7;
+  }
+  p[length++] = (uint8_t) n;
+  return length;
+}
+
+static inline uint64_t ReadVarint(const uint8_t *&p)
+{
+  uint64_t n = *p & 0x7F;
+  for (int shift = 7; *p++ & 0x80; shift += 7)
+  {
+    n |= (uint64_t) (*p & 0x7F) << shift;
+  }
+  return n;
+}
+
+CompressedSeries::CompressedSeries()
+{
+  data = NULL;
+  blocks = NULL;
+  length = capacity = 0;
+  no_blocks = block_capacity = 0;
+  Clear();
+}
+
+CompressedSeries::~CompressedSeries()
+{
+  free(data);
+  free(blocks);
+}
+
+void CompressedSeries::Clear()
+{
+  length = 0;
+  no_blocks = 0;
+  NoRecords = 0;
+  last_timestamp = last_delta = 0;
+  last_value = 0;
+}
+
+bool CompressedSeries::Append(int32_t timestamp, uint32_t value)
+{
+  int32_t delta = (int32_t) ((uint32_t) timestamp - (uint32_t) last_timestamp);
+  delta = (NoRecords == 0) ? 0 : delta;
+  if (no_blocks == 0 || blocks[no_blocks - 1].NoRecords == TIMESERIES_BLOCK_SIZE)
+  {
+    // Start a new block
+    if (no_blocks == block_capacity)
+    {
+      uint32_t n = (block_capacity == 0) ? 16 : 2 * block_capacity;
+      TimeSeriesBlock *b = (TimeSeriesBlock *) realloc(blocks, n * sizeof(TimeSeriesBlock));
+      if (b == NULL)
+      {
+        return false;
+      }
+      blocks = b;
+      block_capacity = n;
+    }
+    TimeSeriesBlock& b = blocks[no_blocks++];
+    b.TimeStamp = timestamp;
+    b.Value = value;
+    b.Delta = delta;
+    b.Offset = length;
+    b.NoRecords = 1;
+  }
+  else
+  {
+    if (length + TIMESERIES_MAX_RECORD_LENGTH > capacity)
+    {
+      uint32_t n = (capacity == 0) ? 4096 : 2 * capacity;
+      uint8_t *d = (uint8_t *) realloc(data, n);
+      if (d == NULL)
+      {
+        return false;
+      }
+      data = d;
+      capacity = n;
+    }
+    int32_t delta_of_delta = (int32_t) ((uint32_t) delta - (uint32_t) last_delta);
+    uint64_t head = ((uint64_t) ZigZag((int32_t) (value - last_value)) << 1) | (delta_of_delta != 0);
+    length += WriteVarint(data + length, head);
+    if (delta_of_delta != 0)
+    {
+      length += WriteVarint(data + length, ZigZag(delta_of_delta));
+    }
+    blocks[no_blocks - 1].NoRecords++;
+  }
+  last_timestamp = timestamp;
+  last_value = value;
+  last_delta = delta;
+  NoRecords++;
+  return true;
+}
+
+bool CompressedSeries::Append(const int32_t *timestamps, const uint32_t *values, uint32_t no_records)
+{
+  for (uint32_t i = 0; i < no_records; i++)
+  {
+    if (!Append(timestamps[i], values[i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+int CompressedSeries::Records(HistoricInfoItem *records, int no_records)
+{
+  for (int i = 0; i < no_records; i++)
+  {
+    if (!Append(records[i].TimeStamp, records[i].Value))
+    {
+      return PM_ERROR_INTERPRETING_REPLY;
+    }
+  }
+  return 0;
+}
+
+uint32_t CompressedSeries::FindBlock(int32_t timestamp) const
+{
+  // Last block with blocks[].TimeStamp <= timestamp
+  uint32_t low = 0, high = no_blocks;
+  while (high - low > 1)
+  {
+    uint32_t middle = (low + high) / 2;
+    if (blocks[middle].TimeStamp <= timestamp)
+    {
+      low = middle;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+uint32_t CompressedSeries::Decode(uint32_t block, int32_t *timestamps, uint32_t *values) const
+{
+  if (block >= no_blocks)
+  {
+    return 0;
+  }
+  const TimeSeriesBlock& b = blocks[block];
+  const uint8_t *p = data + b.Offset;
+  int32_t timestamp = b.TimeStamp;
+  uint32_t value = b.Value;
+  uint32_t delta = b.Delta;
+  timestamps[0] = timestamp;
+  values[0] = value;
+  for (uint32_t i = 1; i < b.NoRecords; i++)
+  {
+    uint64_t head = ReadVarint(p);
+    if (head & 1)
+    {
+      delta += UnZigZag((uint32_t) ReadVarint(p));
+    }
+    timestamp = (int32_t) ((uint32_t) timestamp + delta);
+    value += UnZigZag((uint32_t) (head >> 1));
+    timestamps[i] = timestamp;
+    values[i] = value;
+  }
+  return b.NoRecords;
+}
+
+CompressedSeries::Reader::Reader(const CompressedSeries& series, uint32_t block)
+{
+  this->series = &series;
+  this->block = block;
+  index = 0;
+  p = NULL;
+  timestamp = delta = 0;
+  value = 0;
+}
+
+bool CompressedSeries::Reader::Next(int32_t& timestamp, uint32_t& value)
+{
+  if (block >= series->no_blocks)
+  {
+    return false;
+  }
+  const TimeSeriesBlock& b = series->blocks[block];
+  if (index == 0)
+  {
+    // First record of the block, from the index
+    p = series->data + b.Offset;
+    this->timestamp = b.TimeStamp;
+    this->value = b.Value;
+    delta = b.Delta;
+  }
+  else
+  {
+    uint64_t head = ReadVarint(p);
+    if (head & 1)
+    {
+      delta = (int32_t) ((uint32_t) delta + UnZigZag((uint32_t) ReadVarint(p)));
+    }
+    this->timestamp = (int32_t) ((uint32_t) this->timestamp + delta);
+    this->value += UnZigZag((uint32_t) (head >> 1));
+  }
+  timestamp = this->timestamp;
+  value = this->value;
+  if (++index == b.NoRecords)
+  {
+    block++;
+    index = 0;
+  }
+  return true;
+}
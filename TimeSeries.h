@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "ProtocolManager.h"
+
+#ifndef __TIME_SERIES_H__
+#define __TIME_SERIES_H__
+
+// Records per block: the unit of random access
+#define TIMESERIES_BLOCK_SIZE         256
+// Maximum encoded length of a record: two 64 bit varints
+#define TIMESERIES_MAX_RECORD_LENGTH  20
+
+// Start of a block: its first record (stored as-is) and where its encoded records begin
+typedef struct
+{
+  int32_t TimeStamp;
+  uint32_t Value;
+  int32_t Delta;          // timestamp step from the record before it (0 for the first block)
+  uint32_t Offset;        // of the second record in the data
+  uint32_t NoRecords;
+} TimeSeriesBlock;
+
+// Compressed in-memory series of (timestamp, value) records, e.g. years of 5 minute yield. The records are stored in
+// blocks of TIMESERIES_BLOCK_SIZE; the first record of a block is kept in the block index, every next record as
+// varints:
+//   (zigzag(value - previous value) << 1) | (delta of delta of the timestamp != 0)
+//   zigzag(delta of delta of the timestamp), only when not 0
+// Regular 5 minute data has delta of delta 0, so a record takes 1 byte (|value delta| < 32, e.g. at night) or 2
+// bytes (|value delta| < 4096). Records can be appended in any order, but regular steps compress best. Can be passed to
+// GetHistoricYield as sink.
+class CompressedSeries : public HistoricYieldSink
+{
+  uint8_t *data;
+  uint32_t length;
+  uint32_t capacity;
+  TimeSeriesBlock *blocks;
+  uint32_t no_blocks;
+  uint32_t block_capacity;
+  // Last record appended, and the step before it
+  int32_t last_timestamp;
+  uint32_t last_value;
+  int32_t last_delta;
+
+  public:
+
+  uint32_t NoRecords;
+
+  CompressedSeries();
+  ~CompressedSeries();
+
+  CompressedSeries(const CompressedSeries&) = delete;
+  CompressedSeries& operator=(const CompressedSeries&) = delete;
+
+  // Append record(s). Returns false when out of memory
+  bool Append(int32_t timestamp, uint32_t value);
+  bool Append(const int32_t *timestamps, const uint32_t *values, uint32_t no_records);
+
+  // HistoricYieldSink: append records. Returns 0, or PM_ERROR_INTERPRETING_REPLY when out of memory
+  int Records(HistoricInfoItem *records, int no_records);
+
+  // Remove all records; memory is kept
+  void Clear();
+
+  // Memory used by the records (data and block index) [bytes]
+  size_t Bytes() const
+  {
+    return length + no_blocks * sizeof(TimeSeriesBlock);
+  }
+
+  uint32_t NoBlocks() const
+  {
+    return no_blocks;
+  }
+
+  const TimeSeriesBlock& Block(uint32_t block) const
+  {
+    return blocks[block];
+  }
+
+  // Block to start decoding at for the first record at or after timestamp, when the timestamps are increasing: the
+  // last block that starts at or before timestamp, 0 when there is none (binary search in the block index)
+  uint32_t FindBlock(int32_t timestamp) const;
+
+  // Decode all records of a block (at most TIMESERIES_BLOCK_SIZE). Returns the number of records
+  uint32_t Decode(uint32_t block, int32_t *timestamps, uint32_t *values) const;
+
+  // Sequential decoding, from the start of a block
+  class Reader
+  {
+    const CompressedSeries *series;
+    uint32_t block;
+    uint32_t index;         // in the block
+    const uint8_t *p;
+    int32_t timestamp;
+    uint32_t value;
+    int32_t delta;
+
+    public:
+
+    Reader(const CompressedSeries& series, uint32_t block = 0);
+
+    // Next record. Returns false at the end of the series
+    bool Next(int32_t& timestamp, uint32_t& value);
+  };
+};
+
+#endif
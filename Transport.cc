@@ -0,0 +1,693 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include "Transport.h"
+
+
+// Create transport from description
+Transport *Transport::Create(const char *description, bool nonblocking)
+{
+  const char *arg = strchr(description, ':');
+  if (arg == NULL)
+  {
+    return NULL;
+  }
+  arg++;
+  if (!strncmp(description, "rfcomm:", 7))
+  {
+    bdaddr_t mac;
+    str2ba(arg, &mac);
+    RFCOMMTransport *t = new RFCOMMTransport();
+    if (t->Open(&mac, nonblocking) < 0)
+    {
+      delete t;
+      return NULL;
+    }
+    return t;
+  }
+  if (!strncmp(description, "tcp:", 4))
+  {
+    // Split host and port at the last ':'
+    char host[256];
+    const char *port = strrchr(arg, ':');
+    if (port == NULL || (port - arg) >= (int) sizeof(host))
+    {
+      return NULL;
+    }
+    memcpy(host, arg, port - arg);
+    host[port - arg] = 0;
+    TCPTransport *t = new TCPTransport();
+    if (t->Open(host, port + 1, nonblocking) < 0)
+    {
+      delete t;
+      return NULL;
+    }
+    return t;
+  }
+  if (!strncmp(description, "unix:", 5))
+  {
+    UnixTransport *t = new UnixTransport();
+    if (t->Open(arg, nonblocking) < 0)
+    {
+      delete t;
+      return NULL;
+    }
+    return t;
+  }
+  if (!strncmp(description, "replay:", 7))
+  {
+    ReplayTransport *t = new ReplayTransport();
+    if (t->Open(arg) < 0)
+    {
+      delete t;
+      return NULL;
+    }
+    return t;
+  }
+  if (!strncmp(description, "record:", 7))
+  {
+    // File name up to the first ',', followed by the description of the recorded transport
+    char filename[1024];
+    const char *recorded = strchr(arg, ',');
+    if (recorded == NULL || (recorded - arg) >= (int) sizeof(filename))
+    {
+      return NULL;
+    }
+    memcpy(filename, arg, recorded - arg);
+    filename[recorded - arg] = 0;
+    Transport *inner = Create(recorded + 1, nonblocking);
+    if (inner == NULL)
+    {
+      return NULL;
+    }
+    RecordingTransport *t = new RecordingTransport();
+    if (t->Open(filename, inner) < 0)
+    {
+      delete t;
+      return NULL;
+    }
+    return t;
+  }
+  if (!strncmp(description, "session:", 8))
+  {
+    // File name, optionally followed by ,realtime
+    char filename[1024];
+    const char *option = strchr(arg, ',');
+    int length = (option == NULL) ? strlen(arg) : (option - arg);
+    if (length >= (int) sizeof(filename))
+    {
+      return NULL;
+    }
+    memcpy(filename, arg, length);
+    filename[length] = 0;
+    SessionReplayTransport *t = new SessionReplayTransport();
+    if (t->Open(filename, option != NULL && !strcmp(option + 1, "realtime")) < 0)
+    {
+      delete t;
+      return NULL;
+    }
+    return t;
+  }
+  // Unknown transport
+  return NULL;
+}
+
+// Wait for data until the deadline, then read
+int Transport::Read(uint8_t *data, int length, double deadline)
+{
+  double remaining = deadline - TimeNow();
+  if (remaining <= 0)
+  {
+    return TRANSPORT_TIMED_OUT;
+  }
+  int status = Poll((int) (remaining * 1000 + 0.999));
+  if (status == 0)
+  {
+    return TRANSPORT_TIMED_OUT;
+  }
+  return (status < 0) ? status : Read(data, length);
+}
+
+// Socket transport
+
+int SocketTransport::Read(uint8_t *data, int length)
+{
+  int bytes_read = read(s, data, length);
+  BytesRead += (bytes_read > 0) ? bytes_read : 0;
+  return bytes_read;
+}
+
+int SocketTransport::Write(const uint8_t *data, int length)
+{
+  int bytes_written = write(s, data, length);
+  BytesWritten += (bytes_written > 0) ? bytes_written : 0;
+  return bytes_written;
+}
+
+// Write all buffers; continues after a partial write
+int SocketTransport::Writev(const struct iovec *iov, int count)
+{
+  struct iovec v[TRANSPORT_MAX_IOV];
+  int total = 0;
+  if (count < 0 || count > TRANSPORT_MAX_IOV)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(v, iov, count * sizeof(struct iovec));
+  iov = v;
+  while (count > 0)
+  {
+    int bytes_written = writev(s, iov, count);
+    if (bytes_written < 0)
+    {
+      return bytes_written;
+    }
+    total += bytes_written;
+    BytesWritten += bytes_written;
+    // Skip buffers that were written completely, adjust the partially written one
+    while (count > 0 && bytes_written >= (int) iov->iov_len)
+    {
+      bytes_written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      v[iov - v].iov_base = ((uint8_t *) iov->iov_base) + bytes_written;
+      v[iov - v].iov_len -= bytes_written;
+    }
+  }
+  return total;
+}
+
+int SocketTransport::Poll(int timeout_ms)
+{
+  struct pollfd p;
+  p.fd = s;
+  p.events = POLLIN;
+  p.revents = 0;
+  return poll(&p, 1, timeout_ms);
+}
+
+void SocketTransport::Close()
+{
+  if (s >= 0)
+  {
+    close(s);
+    s = -1;
+  }
+}
+
+void SocketTransport::SetTimeOut(int seconds)
+{
+  struct timeval timeout;      
+  timeout.tv_sec = seconds;
+  timeout.tv_usec = 0;
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));    
+}
+
+int SocketTransport::ConnectResult()
+{
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+  {
+    return errno;
+  }
+  return error;
+}
+
+// Wait for writable, check result, make blocking again
+int SocketTransport::WaitConnected(double deadline)
+{
+  struct pollfd p;
+  p.fd = s;
+  p.events = POLLOUT;
+  p.revents = 0;
+  double remaining = deadline - TimeNow();
+  if (remaining <= 0 || poll(&p, 1, (int) (remaining * 1000 + 0.999)) <= 0 || ConnectResult() != 0)
+  {
+    return -1;
+  }
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+  return 0;
+}
+
+int SocketTransport::Connect(const struct sockaddr *address, socklen_t length, bool nonblocking)
+{
+  if (nonblocking)
+  {
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+  }
+  int status = connect(s, address, length);
+  return (status < 0 && nonblocking && errno == EINPROGRESS) ? 0 : status;
+}
+
+// Bluetooth connect; returns < 0 on error.  
+int RFCOMMTransport::Open(bdaddr_t *mac_address, bool nonblocking)
+{
+  struct sockaddr_rc addr = { 0 };
+  // Close (when needed)
+  Close();
+  // allocate a socket (I do not specify non-blocking, so it should be blocking)
+  s = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+  if (s < 0)
+  {
+    return s;
+  }
+  SetTimeOut(TRANSPORT_TIMEOUT);
+  // set the connection parameters (who to connect to)
+  addr.rc_family = AF_BLUETOOTH;                                                                  
+  addr.rc_channel = (uint8_t) 1;
+  memcpy(&addr.rc_bdaddr, mac_address, sizeof(bdaddr_t));    
+  // connect to server, return status
+  return Connect((struct sockaddr *)&addr, sizeof(addr), nonblocking);
+}
+
+// TCP connect; returns < 0 on error
+int TCPTransport::Open(const char *host, const char *port, bool nonblocking)
+{
+  struct addrinfo hints, *result, *rp;
+  Close();
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &result) != 0)
+  {
+    return -1;
+  }
+  // Try all addresses until one connects
+  for (rp = result; rp != NULL; rp = rp->ai_next)
+  {
+    s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (s < 0)
+    {
+      continue;
+    }
+    if (Connect(rp->ai_addr, rp->ai_addrlen, nonblocking) == 0)
+    {
+      break;
+    }
+    Close();
+  }
+  freeaddrinfo(result);
+  if (s < 0)
+  {
+    return -1;
+  }
+  // Small request/reply packets: send immediately
+  int one = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  SetTimeOut(TRANSPORT_TIMEOUT);
+  return 0;
+}
+
+// Unix socket connect; returns < 0 on error
+int UnixTransport::Open(const char *path, bool nonblocking)
+{
+  struct sockaddr_un addr;
+  Close();
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0)
+  {
+    return s;
+  }
+  SetTimeOut(TRANSPORT_TIMEOUT);
+  return Connect((struct sockaddr *)&addr, sizeof(addr), nonblocking);
+}
+
+// Create socket pair; returns < 0 on error
+int SocketPairTransport::Open()
+{
+  int sv[2];
+  Close();
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+  {
+    return -1;
+  }
+  s = sv[0];
+  peer = sv[1];
+  SetTimeOut(TRANSPORT_TIMEOUT);
+  return 0;
+}
+
+void SocketPairTransport::Close()
+{
+  SocketTransport::Close();
+  if (peer >= 0)
+  {
+    close(peer);
+    peer = -1;
+  }
+}
+
+// Replay transport
+
+int ReplayTransport::Open(const char *filename)
+{
+  Close();
+  fd = open(filename, O_RDONLY);
+  return fd;
+}
+
+// Read from file. End of file is reported as a time-out, like a silent inverter
+int ReplayTransport::Read(uint8_t *data, int length)
+{
+  int bytes_read = read(fd, data, length);
+  BytesRead += (bytes_read > 0) ? bytes_read : 0;
+  return (bytes_read == 0) ? -1 : bytes_read;
+}
+
+// Sent data is discarded
+int ReplayTransport::Write(const uint8_t *data, int length)
+{
+  BytesWritten += length;
+  return length;
+}
+
+int ReplayTransport::Writev(const struct iovec *iov, int count)
+{
+  int total = 0;
+  for (int i = 0; i < count; i++)
+  {
+    total += iov[i].iov_len;
+  }
+  BytesWritten += total;
+  return total;
+}
+
+void ReplayTransport::Close()
+{
+  if (fd >= 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+}
+
+// Recording transport
+
+// Takes ownership of the transport, also on failure
+int RecordingTransport::Open(const char *filename, Transport *transport)
+{
+  Close();
+  t = transport;
+  f = fopen(filename, "wb");
+  if (f == NULL || fwrite(SESSION_MAGIC, SESSION_MAGIC_LENGTH, 1, f) != 1)
+  {
+    return -1;
+  }
+  start = TimeNow();
+  return 0;
+}
+
+int RecordingTransport::Read(uint8_t *data, int length)
+{
+  int bytes_read = t->Read(data, length);
+  Record(SESSION_RECEIVED, data, bytes_read);
+  return bytes_read;
+}
+
+int RecordingTransport::Read(uint8_t *data, int length, double deadline)
+{
+  int bytes_read = t->Read(data, length, deadline);
+  Record(SESSION_RECEIVED, data, bytes_read);
+  return bytes_read;
+}
+
+int RecordingTransport::Write(const uint8_t *data, int length)
+{
+  int bytes_written = t->Write(data, length);
+  Record(SESSION_SENT, data, bytes_written);
+  return bytes_written;
+}
+
+// Gather the buffers in records of at most a buffer full; the replay only counts the bytes sent
+int RecordingTransport::Writev(const struct iovec *iov, int count)
+{
+  int bytes_written = t->Writev(iov, count);
+  uint8_t data[1024];
+  int length = 0;
+  int done = 0;
+  for (int i = 0; i < count && done < bytes_written; i++)
+  {
+    const uint8_t *buffer = (const uint8_t *) iov[i].iov_base;
+    int left = ((int) iov[i].iov_len < bytes_written - done) ? iov[i].iov_len : (bytes_written - done);
+    while (left > 0)
+    {
+      int part = (left < (int) sizeof(data) - length) ? left : ((int) sizeof(data) - length);
+      memcpy(data + length, buffer, part);
+      buffer += part;
+      left -= part;
+      done += part;
+      length += part;
+      if (length == (int) sizeof(data))
+      {
+        Record(SESSION_SENT, data, length);
+        length = 0;
+      }
+    }
+  }
+  Record(SESSION_SENT, data, length);
+  return bytes_written;
+}
+
+void RecordingTransport::Record(uint8_t direction, const uint8_t *data, int length)
+{
+  if (length <= 0)
+  {
+    return;
+  }
+  if (direction == SESSION_RECEIVED)
+  {
+    BytesRead += length;
+  }
+  else
+  {
+    BytesWritten += length;
+  }
+  // Records hold at most 64 kB
+  for (int done = 0; f != NULL && done < length; )
+  {
+    int part = (length - done > 0xFFFF) ? 0xFFFF : (length - done);
+    SessionRecord r;
+    r.time = htobl((uint32_t) ((TimeNow() - start) * 1e6));
+    r.length = htobs(part);
+    r.direction = direction;
+    if (fwrite(&r, sizeof(r), 1, f) != 1 || fwrite(data + done, part, 1, f) != 1)
+    { // Stop recording
+      fclose(f);
+      f = NULL;
+    }
+    done += part;
+  }
+}
+
+void RecordingTransport::Close()
+{
+  if (t != NULL)
+  {
+    t->Close();
+    delete t;
+    t = NULL;
+  }
+  if (f != NULL)
+  {
+    fclose(f);
+    f = NULL;
+  }
+}
+
+// Session replay transport
+
+int SessionReplayTransport::Open(const char *filename, bool realtime)
+{
+  Close();
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+  {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  session = (uint8_t *) malloc((size > 0) ? size : 1);
+  bool ok = size >= SESSION_MAGIC_LENGTH && fread(session, size, 1, f) == 1 && 
+            memcmp(session, SESSION_MAGIC, SESSION_MAGIC_LENGTH) == 0;
+  fclose(f);
+  if (!ok)
+  {
+    Close();
+    return -1;
+  }
+  this->realtime = realtime;
+  Rewind();
+  return 0;
+}
+
+void SessionReplayTransport::Rewind()
+{
+  position = SESSION_MAGIC_LENGTH;
+  offset = 0;
+  written = 0;
+  base = last_write = TimeNow();
+}
+
+double SessionReplayTransport::Available()
+{
+  while (position + (int) sizeof(SessionRecord) <= size)
+  {
+    SessionRecord *r = (SessionRecord *) (session + position);
+    double time = btohl(r->time) * 1e-6;
+    if (r->direction == SESSION_RECEIVED)
+    {
+      return realtime ? (base + time) : 0;
+    }
+    // Sent record: wait until we have written as much
+    uint16_t length = btohs(r->length);
+    if (written < length)
+    {
+      return -1;
+    }
+    written -= length;
+    // The inverter's reply time counts from our write
+    base = (last_write - time > base) ? (last_write - time) : base;
+    position += sizeof(SessionRecord) + length;
+    offset = 0;
+  }
+  return -1;
+}
+
+int SessionReplayTransport::Take(uint8_t *data, int length)
+{
+  SessionRecord *r = (SessionRecord *) (session + position);
+  uint8_t *record_data = session + position + sizeof(SessionRecord);
+  int record_length = btohs(r->length);
+  // Truncated file: use what is there
+  if (record_data + record_length > session + size)
+  {
+    record_length = session + size - record_data;
+  }
+  int bytes_read = (record_length - offset < length) ? (record_length - offset) : length;
+  memcpy(data, record_data + offset, bytes_read);
+  offset += bytes_read;
+  if (offset >= record_length)
+  {
+    position += sizeof(SessionRecord) + btohs(r->length);
+    offset = 0;
+  }
+  BytesRead += bytes_read;
+  return bytes_read;
+}
+
+// Nothing more to read (end of the session, or the recording continues with data we did not send yet) is reported 
+// like a silent inverter
+int SessionReplayTransport::Read(uint8_t *data, int length)
+{
+  double at = Available();
+  if (at < 0)
+  {
+    return -1;
+  }
+  double wait = at - TimeNow();
+  if (wait > 0)
+  {
+    usleep((useconds_t) (wait * 1e6));
+  }
+  return Take(data, length);
+}
+
+int SessionReplayTransport::Read(uint8_t *data, int length, double deadline)
+{
+  return (Poll((int) ((deadline - TimeNow()) * 1000 + 0.999)) > 0) ? Take(data, length) : TRANSPORT_TIMED_OUT;
+}
+
+// As fast as possible, waits are skipped
+int SessionReplayTransport::Poll(int timeout_ms)
+{
+  double at = Available();
+  if (!realtime)
+  {
+    return (at < 0) ? 0 : 1;
+  }
+  double now = TimeNow();
+  timeout_ms = (timeout_ms < 0) ? 0 : timeout_ms;
+  if (at < 0 || at > now + timeout_ms * 1e-3)
+  {
+    usleep(timeout_ms * 1000);
+    return 0;
+  }
+  if (at > now)
+  {
+    usleep((useconds_t) ((at - now) * 1e6));
+  }
+  return 1;
+}
+
+int SessionReplayTransport::Write(const uint8_t *data, int length)
+{
+  written += length;
+  last_write = TimeNow();
+  BytesWritten += length;
+  return length;
+}
+
+int SessionReplayTransport::Writev(const struct iovec *iov, int count)
+{
+  int total = 0;
+  for (int i = 0; i < count; i++)
+  {
+    total += iov[i].iov_len;
+  }
+  return Write(NULL, total);
+}
+
+void SessionReplayTransport::Close()
+{
+  free(session);
+  session = NULL;
+  size = 0;
+}
+
+const uint8_t *SessionReplayTransport::FirstReceived(int *length)
+{
+  for (int p = SESSION_MAGIC_LENGTH; p + (int) sizeof(SessionRecord) <= size; p += sizeof(SessionRecord) + btohs(((SessionRecord *) (session + p))->length))
+  {
+    SessionRecord *r = (SessionRecord *) (session + p);
+    if (r->direction == SESSION_RECEIVED && p + (int) sizeof(SessionRecord) + btohs(r->length) <= size)
+    {
+      *length = btohs(r->length);
+      return session + p + sizeof(SessionRecord);
+    }
+  }
+  return NULL;
+}
+
+double SessionReplayTransport::Duration()
+{
+  double duration = 0;
+  for (int p = SESSION_MAGIC_LENGTH; p + (int) sizeof(SessionRecord) <= size; p += sizeof(SessionRecord) + btohs(((SessionRecord *) (session + p))->length))
+  {
+    duration = btohl(((SessionRecord *) (session + p))->time) * 1e-6;
+  }
+  return duration;
+}
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+// Default receive time-out [s]
+#define TRANSPORT_TIMEOUT             5
+
+// Read: deadline passed
+#define TRANSPORT_TIMED_OUT           -2
+
+// Maximum number of buffers in one Writev
+#define TRANSPORT_MAX_IOV             16
+
+// Session file (see RecordingTransport): SESSION_MAGIC, followed by a SessionRecord and its data for every read and
+// write
+#define SESSION_MAGIC                 "SMASES01"
+#define SESSION_MAGIC_LENGTH          8
+#define SESSION_RECEIVED              0
+#define SESSION_SENT                  1
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t time;          // since the start of the session [us]
+  uint16_t length;        // of the data that follows
+  uint8_t direction;      // SESSION_RECEIVED or SESSION_SENT
+} SessionRecord;
+
+// Monotonic time [s]
+inline double TimeNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Byte stream to/from the inverter. L1 packets are sent and received over a transport.
+class Transport
+{
+  public:
+  
+  // Bytes read and written so far
+  uint64_t BytesRead;
+  uint64_t BytesWritten;
+  
+  Transport()
+  {
+    BytesRead = BytesWritten = 0;
+  }
+  
+  virtual ~Transport()
+  {
+  }
+  
+  // Read (blocking) at most length bytes. Returns number of bytes read, 0 on end of stream, < 0 on time-out/error
+  virtual int Read(uint8_t *data, int length) = 0;
+  
+  // Read at most length bytes, waiting until deadline (TimeNow() based) at most. Returns number of bytes read, 0 on end
+  // of stream, TRANSPORT_TIMED_OUT when the deadline passed, < 0 on error
+  virtual int Read(uint8_t *data, int length, double deadline);
+  
+  // Write length bytes. Returns number of bytes written, < 0 on error
+  virtual int Write(const uint8_t *data, int length) = 0;
+  
+  // Write count (at most TRANSPORT_MAX_IOV) buffers in one go. Returns number of bytes written, < 0 on error
+  virtual int Writev(const struct iovec *iov, int count) = 0;
+  
+  // File descriptor that can be used in poll()/select(), -1 if there is none
+  virtual int Fd() = 0;
+  
+  // Wait at most timeout_ms [ms] for data to read. Returns > 0 when data is available, 0 on time-out, < 0 on error
+  virtual int Poll(int timeout_ms) = 0;
+  
+  // Close transport
+  virtual void Close() = 0;
+  
+  // Wait until deadline at most for a non-blocking connect (see Create) to complete; the transport is blocking again
+  // afterwards. Returns 0 when connected, < 0 on failure/time-out
+  virtual int WaitConnected(double deadline)
+  {
+    return 0;
+  }
+  
+  // Create and open a transport from a description. Returns NULL on failure. Descriptions:
+  //   rfcomm:01:23:45:67:89:ab    Bluetooth RFCOMM connection (channel 1)
+  //   tcp:host:port               TCP connection
+  //   unix:/path/to/socket        Unix domain socket connection
+  //   replay:/path/to/file        Read received bytes from file, discard sent bytes
+  //   record:/path/to/file,<transport description>
+  //                               Record all bytes read and written over the transport in a session file
+  //   session:/path/to/file[,realtime]
+  //                               Replay a session file: as fast as possible, or at the recorded speed
+  // nonblocking: the socket is non-blocking and the connect may still be in progress (see SocketTransport::ConnectResult)
+  static Transport *Create(const char *description, bool nonblocking = false);
+};
+
+// Transport over a socket (file descriptor)
+class SocketTransport : public Transport
+{
+  protected:
+  int s;
+  
+  public:
+  
+  SocketTransport()
+  {
+    s = -1;
+  }
+  
+  // Use an already connected socket
+  SocketTransport(int socket)
+  {
+    s = socket;
+  }
+  
+  ~SocketTransport()
+  {
+    Close();
+  }
+  
+  int Read(uint8_t *data, int length);
+  using Transport::Read;
+  int Write(const uint8_t *data, int length);
+  int Writev(const struct iovec *iov, int count);
+  int Poll(int timeout_ms);
+  int WaitConnected(double deadline);
+  
+  int Fd()
+  {
+    return s;
+  }
+  
+  void Close();
+  
+  // Set receive time-out [s]
+  void SetTimeOut(int seconds);
+  
+  // Result of a non-blocking connect once the socket is writable: 0 when connected, error number otherwise
+  int ConnectResult();
+  
+  protected:
+  // Connect socket s to address. When non-blocking, a connect in progress counts as success. Returns < 0 on error
+  int Connect(const struct sockaddr *address, socklen_t length, bool nonblocking);
+};
+
+// Bluetooth RFCOMM connection to an inverter
+class RFCOMMTransport : public SocketTransport
+{
+  public:
+  // Connect to given MAC address; returns < 0 on error
+  int Open(bdaddr_t *mac_address, bool nonblocking = false);
+};
+
+// TCP connection (e.g. to a serial/Bluetooth bridge or a simulator)
+class TCPTransport : public SocketTransport
+{
+  public:
+  // Connect to host:port; returns < 0 on error
+  int Open(const char *host, const char *port, bool nonblocking = false);
+};
+
+// Unix domain socket connection
+class UnixTransport : public SocketTransport
+{
+  public:
+  // Connect to socket at path; returns < 0 on error
+  int Open(const char *path, bool nonblocking = false);
+};
+
+// Connected pair of Unix sockets. We use one end, the other end (Peer) is driven by e.g. a test or simulator
+class SocketPairTransport : public SocketTransport
+{
+  int peer;
+  
+  public:
+  
+  SocketPairTransport()
+  {
+    peer = -1;
+  }
+  
+  ~SocketPairTransport()
+  {
+    Close();
+  }
+  
+  // Create the socket pair; returns < 0 on error
+  int Open();
+  
+  // Other end of the pair
+  int Peer()
+  {
+    return peer;
+  }
+  
+  void Close();
+};
+
+// Replays received bytes from a file. Sent bytes are discarded.
+class ReplayTransport : public Transport
+{
+  int fd;
+  
+  public:
+  
+  ReplayTransport()
+  {
+    fd = -1;
+  }
+  
+  ~ReplayTransport()
+  {
+    Close();
+  }
+  
+  // Open file; returns < 0 on error
+  int Open(const char *filename);
+  
+  int Read(uint8_t *data, int length);
+  int Write(const uint8_t *data, int length);
+  int Writev(const struct iovec *iov, int count);
+  
+  // The file has no timing information: deadlines do not apply
+  int Read(uint8_t *data, int length, double deadline)
+  {
+    return Read(data, length);
+  }
+  
+  // The file has no timing information: data is never pending, it is only delivered by Read
+  int Poll(int timeout_ms)
+  {
+    return 0;
+  }
+  
+  int Fd()
+  {
+    return fd;
+  }
+  
+  void Close();
+};
+
+// Records all bytes read from and written to another transport, with timestamps, in a session file
+class RecordingTransport : public Transport
+{
+  Transport *t;
+  FILE *f;
+  double start;
+  
+  public:
+  
+  RecordingTransport()
+  {
+    t = NULL;
+    f = NULL;
+    start = 0;
+  }
+  
+  ~RecordingTransport()
+  {
+    Close();
+  }
+  
+  // Record transport (owned from now on) into file; returns < 0 on error
+  int Open(const char *filename, Transport *transport);
+  
+  int Read(uint8_t *data, int length);
+  int Read(uint8_t *data, int length, double deadline);
+  int Write(const uint8_t *data, int length);
+  int Writev(const struct iovec *iov, int count);
+  
+  int Poll(int timeout_ms)
+  {
+    return t->Poll(timeout_ms);
+  }
+  
+  int WaitConnected(double deadline)
+  {
+    return t->WaitConnected(deadline);
+  }
+  
+  int Fd()
+  {
+    return t->Fd();
+  }
+  
+  void Close();
+  
+  private:
+  // Append record; on failure recording stops
+  void Record(uint8_t direction, const uint8_t *data, int length);
+};
+
+// Replays the received bytes of a session file. Causal: received data only becomes available after we have written
+// as many bytes as were sent before it in the recording, so the replay follows the same exchange. At the recorded 
+// speed, the inverter takes as long to answer as it did in the recording.
+class SessionReplayTransport : public Transport
+{
+  uint8_t *session;       // file contents
+  int size;
+  int position;           // current record
+  int offset;             // bytes of the current (received) record already read
+  uint64_t written;       // bytes written, not matched with sent records yet
+  bool realtime;
+  double base;            // recorded time 0 in TimeNow() time (realtime) [s]
+  double last_write;      // TimeNow() of the last write [s]
+  
+  public:
+  
+  SessionReplayTransport()
+  {
+    session = NULL;
+    size = 0;
+    realtime = false;
+    Rewind();
+  }
+  
+  ~SessionReplayTransport()
+  {
+    Close();
+  }
+  
+  // Load session file; returns < 0 when it cannot be read or is not a session file
+  int Open(const char *filename, bool realtime = false);
+  
+  // Start again at the beginning of the session
+  void Rewind();
+  
+  int Read(uint8_t *data, int length);
+  int Read(uint8_t *data, int length, double deadline);
+  int Write(const uint8_t *data, int length);
+  int Writev(const struct iovec *iov, int count);
+  int Poll(int timeout_ms);
+  
+  int Fd()
+  {
+    return -1;
+  }
+  
+  void Close();
+  
+  // Received data of the first record (e.g. the login ping, whose source is the inverter), NULL when there is none
+  const uint8_t *FirstReceived(int *length);
+  
+  // Recorded duration of the session [s]
+  double Duration();
+  
+  private:
+  // Copy at most length bytes of the current (received) record
+  int Take(uint8_t *data, int length);
+  // Skip sent records that have been matched by our writes. Returns the time (TimeNow() based) at which the next 
+  // received data is available, < 0 when there is none (yet)
+  double Available();
+};
+
+#endif
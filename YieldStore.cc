@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include "YieldStore.h"
+
+static const char *tables[YIELD_TABLES] = { "yield_5m", "yield_daily" };
+static const char *rollups[ROLLUP_TABLES] = { "rollup_hourly", "rollup_daily", "rollup_monthly" };
+
+// Start of the bucket of timestamp t, and of the bucket after it, in local time
+#define DAY_START(t)      "CAST(strftime('%s', " t ", 'unixepoch', 'localtime', 'start of day', 'utc') AS INTEGER)"
+#define DAY_END(t)        "CAST(strftime('%s', " t ", 'unixepoch', 'localtime', 'start of day', '+1 day', 'utc') AS INTEGER)"
+#define MONTH_START(t)    "CAST(strftime('%s', " t ", 'unixepoch', 'localtime', 'start of month', 'utc') AS INTEGER)"
+#define MONTH_END(t)      "CAST(strftime('%s', " t ", 'unixepoch', 'localtime', 'start of month', '+1 month', 'utc') AS INTEGER)"
+
+#define ROLLUP_COLUMNS    "(bucket, energy, peak_power, first_timestamp, first_energy, last_timestamp, last_energy, samples)"
+
+// Larger buckets from the smaller buckets of source: replace the buckets of the samples ?1 to ?2
+#define ROLLUP_FROM(table, source, START, END) \
+  "INSERT OR REPLACE INTO " table " " ROLLUP_COLUMNS " SELECT bucket, energy, peak_power, first_timestamp, " \
+  "(SELECT energy FROM yield_5m WHERE timestamp = first_timestamp), last_timestamp, " \
+  "(SELECT energy FROM yield_5m WHERE timestamp = last_timestamp), samples FROM (" \
+  "SELECT " START("r.bucket") " AS bucket, SUM(r.energy) AS energy, MAX(r.peak_power) AS peak_power, " \
+  "MIN(r.first_timestamp) AS first_timestamp, MAX(r.last_timestamp) AS last_timestamp, SUM(r.samples) AS samples " \
+  "FROM " source " r WHERE r.bucket >= " START("?1") " AND r.bucket < " END("?2") " GROUP BY 1)"
+
+// In order: hours before days before months. Hours are computed from the samples by UpdateRollups, which inserts
+// them one bucket at a time
+static const char *rollup_queries[ROLLUP_TABLES] =
+{
+  "INSERT OR REPLACE INTO rollup_hourly " ROLLUP_COLUMNS " VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+  ROLLUP_FROM("rollup_daily", "rollup_hourly", DAY_START, DAY_END),
+  ROLLUP_FROM("rollup_monthly", "rollup_daily", MONTH_START, MONTH_END)
+};
+
+YieldStore::YieldStore()
+{
+  db = NULL;
+  memset(insert_rows, 0, sizeof(insert_rows));
+  memset(insert_row, 0, sizeof(insert_row));
+  select_cursor = save_cursor = NULL;
+  memset(checked, 0, sizeof(checked));
+  next_sample = previous_sample = samples = NULL;
+  memset(rollup, 0, sizeof(rollup));
+  transaction = false;
+  touched_from = INT32_MAX;
+  touched_to = INT32_MIN;
+}
+
+const char *YieldStore::Table(int table)
+{
+  return tables[table];
+}
+
+const char *YieldStore::Rollup(int rollup)
+{
+  return rollups[rollup];
+}
+
+int YieldStore::Open(sqlite3 *db)
+{
+  Close();
+  this->db = db;
+  // WAL: readers are not blocked while a poll writes, a commit does not rewrite the pages twice
+  if (sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_exec(db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL) != SQLITE_OK)
+  {
+    return YIELD_ERROR_STORING;
+  }
+  if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS backfill (series TEXT PRIMARY KEY, cursor INTEGER)", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "SELECT cursor FROM backfill WHERE series = ?", -1, &select_cursor, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO backfill (series, cursor) VALUES (?, ?)", -1, &save_cursor, NULL) != SQLITE_OK)
+  {
+    return YIELD_ERROR_STORING;
+  }
+  // Checked ranges that overlap or touch [?2, ?3]
+  if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS checked_ranges (series TEXT, from_timestamp INTEGER, "
+                       "to_timestamp INTEGER, PRIMARY KEY (series, from_timestamp))", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "SELECT MIN(from_timestamp), MAX(to_timestamp) FROM checked_ranges WHERE series = ?1 AND "
+                             "from_timestamp <= ?3 + 1 AND to_timestamp >= ?2 - 1", -1, &checked[0], NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "DELETE FROM checked_ranges WHERE series = ?1 AND from_timestamp <= ?3 + 1 AND "
+                             "to_timestamp >= ?2 - 1", -1, &checked[1], NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "INSERT INTO checked_ranges (series, from_timestamp, to_timestamp) VALUES (?1, ?2, ?3)", 
+                         -1, &checked[2], NULL) != SQLITE_OK)
+  {
+    return YIELD_ERROR_STORING;
+  }
+  for (int t = 0; t < YIELD_TABLES; t++)
+  {
+    char query[64 + YIELD_ROWS_PER_INSERT * 8];
+    snprintf(query, sizeof(query), "CREATE TABLE IF NOT EXISTS %s (timestamp INTEGER PRIMARY KEY, energy INTEGER)", tables[t]);
+    if (sqlite3_exec(db, query, NULL, NULL, NULL) != SQLITE_OK)
+    {
+      return YIELD_ERROR_STORING;
+    }
+    int length = snprintf(query, sizeof(query), "INSERT OR REPLACE INTO %s (timestamp, energy) VALUES (?, ?)", tables[t]);
+    if (sqlite3_prepare_v2(db, query, -1, &insert_row[t], NULL) != SQLITE_OK)
+    {
+      return YIELD_ERROR_STORING;
+    }
+    for (int i = 1; i < YIELD_ROWS_PER_INSERT; i++)
+    {
+      length += snprintf(query + length, sizeof(query) - length, ", (?, ?)");
+    }
+    if (sqlite3_prepare_v2(db, query, -1, &insert_rows[t], NULL) != SQLITE_OK)
+    {
+      return YIELD_ERROR_STORING;
+    }
+  }
+  for (int r = 0; r < ROLLUP_TABLES; r++)
+  {
+    char query[256];
+    snprintf(query, sizeof(query), "CREATE TABLE IF NOT EXISTS %s (bucket INTEGER PRIMARY KEY, energy INTEGER, "
+             "peak_power INTEGER, first_timestamp INTEGER, first_energy INTEGER, last_timestamp INTEGER, "
+             "last_energy INTEGER, samples INTEGER)", rollups[r]);
+    if (sqlite3_exec(db, query, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, rollup_queries[r], -1, &rollup[r], NULL) != SQLITE_OK)
+    {
+      return YIELD_ERROR_STORING;
+    }
+  }
+  if (sqlite3_prepare_v2(db, "SELECT timestamp FROM yield_5m WHERE timestamp > ? ORDER BY timestamp LIMIT 1", -1, 
+                         &next_sample, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "SELECT timestamp, energy FROM yield_5m WHERE timestamp < ? ORDER BY timestamp DESC LIMIT 1",
+                         -1, &previous_sample, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "SELECT timestamp, energy FROM yield_5m WHERE timestamp >= ?1 AND timestamp < ?2 ORDER BY "
+                             "timestamp", -1, &samples, NULL) != SQLITE_OK)
+  {
+    return YIELD_ERROR_STORING;
+  }
+  return 0;
+}
+
+void YieldStore::Close()
+{
+  Commit();
+  for (int t = 0; t < YIELD_TABLES; t++)
+  {
+    sqlite3_finalize(insert_rows[t]);
+    sqlite3_finalize(insert_row[t]);
+    insert_rows[t] = insert_row[t] = NULL;
+  }
+  sqlite3_finalize(select_cursor);
+  sqlite3_finalize(save_cursor);
+  select_cursor = save_cursor = NULL;
+  for (int i = 0; i < 3; i++)
+  {
+    sqlite3_finalize(checked[i]);
+    checked[i] = NULL;
+  }
+  for (int r = 0; r < ROLLUP_TABLES; r++)
+  {
+    sqlite3_finalize(rollup[r]);
+    rollup[r] = NULL;
+  }
+  sqlite3_finalize(next_sample);
+  sqlite3_finalize(previous_sample);
+  sqlite3_finalize(samples);
+  next_sample = previous_sample = samples = NULL;
+  db = NULL;
+}
+
+int YieldStore::Begin()
+{
+  if (!transaction)
+  {
+    if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      return YIELD_ERROR_STORING;
+    }
+    transaction = true;
+  }
+  return 0;
+}
+
+int YieldStore::Commit()
+{
+  if (transaction)
+  {
+    transaction = false;
+    bool touched = (touched_from <= touched_to);
+    int32_t from = touched_from, to = touched_to;
+    touched_from = INT32_MAX;
+    touched_to = INT32_MIN;
+    if ((touched && UpdateRollups(from, to) != 0) || sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      // Do not leave a failed transaction open
+      sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+      return YIELD_ERROR_STORING;
+    }
+  }
+  return 0;
+}
+
+int YieldStore::Insert(int table, const HistoricInfoItem *records, int no_records)
+{
+  return Insert(table, &records[0].TimeStamp, &records[0].Value, sizeof(HistoricInfoItem) / sizeof(int32_t), no_records);
+}
+
+int YieldStore::Insert(int table, const int32_t *timestamps, const uint32_t *values, int no_records)
+{
+  return Insert(table, timestamps, values, 1, no_records);
+}
+
+int YieldStore::Insert(int table, const int32_t *timestamps, const uint32_t *values, int stride, int no_records)
+{
+  if (table == YIELD_5M)
+  {
+    for (int i = 0; i < no_records; i++)
+    {
+      touched_from = (timestamps[i * stride] < touched_from) ? timestamps[i * stride] : touched_from;
+      touched_to = (timestamps[i * stride] > touched_to) ? timestamps[i * stride] : touched_to;
+    }
+  }
+  int i = 0;
+  while (i < no_records)
+  {
+    // Full multi-row inserts, then single rows
+    sqlite3_stmt *statement = (no_records - i >= YIELD_ROWS_PER_INSERT) ? insert_rows[table] : insert_row[table];
+    int rows = (statement == insert_row[table]) ? 1 : YIELD_ROWS_PER_INSERT;
+    for (int r = 0; r < rows; r++, i++)
+    {
+      sqlite3_bind_int(statement, 2 * r + 1, timestamps[i * stride]);
+      sqlite3_bind_int64(statement, 2 * r + 2, values[i * stride]);
+    }
+    int status = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    if (status != SQLITE_DONE)
+    {
+      return YIELD_ERROR_STORING;
+    }
+  }
+  return 0;
+}
+
+int32_t YieldStore::Cursor(int table)
+{
+  int32_t result = 0;
+  sqlite3_bind_text(select_cursor, 1, tables[table], -1, SQLITE_STATIC);
+  if (sqlite3_step(select_cursor) == SQLITE_ROW)
+  {
+    result = sqlite3_column_int(select_cursor, 0);
+  }
+  sqlite3_reset(select_cursor);
+  return result;
+}
+
+int YieldStore::SaveCursor(int table, int32_t cursor)
+{
+  sqlite3_bind_text(save_cursor, 1, tables[table], -1, SQLITE_STATIC);
+  sqlite3_bind_int(save_cursor, 2, cursor);
+  int status = sqlite3_step(save_cursor);
+  sqlite3_reset(save_cursor);
+  return (status == SQLITE_DONE) ? 0 : YIELD_ERROR_STORING;
+}
+
+int YieldStore::SaveChecked(int table, int32_t from, int32_t to)
+{
+  // Replace the overlapping and adjacent ranges by their union with [from, to]
+  int32_t union_from = from, union_to = to;
+  sqlite3_bind_text(checked[0], 1, tables[table], -1, SQLITE_STATIC);
+  sqlite3_bind_int(checked[0], 2, from);
+  sqlite3_bind_int(checked[0], 3, to);
+  if (sqlite3_step(checked[0]) == SQLITE_ROW && sqlite3_column_type(checked[0], 0) != SQLITE_NULL)
+  {
+    union_from = (sqlite3_column_int(checked[0], 0) < from) ? sqlite3_column_int(checked[0], 0) : from;
+    union_to = (sqlite3_column_int(checked[0], 1) > to) ? sqlite3_column_int(checked[0], 1) : to;
+  }
+  sqlite3_reset(checked[0]);
+  for (int i = 1; i < 3; i++)
+  {
+    sqlite3_bind_text(checked[i], 1, tables[table], -1, SQLITE_STATIC);
+    sqlite3_bind_int(checked[i], 2, (i == 1) ? from : union_from);
+    sqlite3_bind_int(checked[i], 3, (i == 1) ? to : union_to);
+    int status = sqlite3_step(checked[i]);
+    sqlite3_reset(checked[i]);
+    if (status != SQLITE_DONE)
+    {
+      return YIELD_ERROR_STORING;
+    }
+  }
+  return 0;
+}
+
+int YieldStore::UpdateRollups(int32_t from, int32_t to)
+{
+  // The energy of the next sample starts at the last sample of the range
+  sqlite3_bind_int(next_sample, 1, to);
+  if (sqlite3_step(next_sample) == SQLITE_ROW)
+  {
+    to = sqlite3_column_int(next_sample, 0);
+  }
+  sqlite3_reset(next_sample);
+  // Offset of local time to UTC modulo an hour: the same with and without daylight saving time, 0 unless it has half
+  // or quarter hours. Hours start at it, so they nest in local days
+  time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+  int32_t offset = (int32_t) (local.tm_gmtoff % 3600 + 3600) % 3600;
+  if (UpdateHours(from - (from + offset) % 3600, to - (to + offset) % 3600 + 3600, offset) != 0)
+  {
+    return YIELD_ERROR_STORING;
+  }
+  for (int r = ROLLUP_DAILY; r < ROLLUP_TABLES; r++)
+  {
+    sqlite3_bind_int(rollup[r], 1, from);
+    sqlite3_bind_int(rollup[r], 2, to);
+    int status = sqlite3_step(rollup[r]);
+    sqlite3_reset(rollup[r]);
+    if (status != SQLITE_DONE)
+    {
+      return YIELD_ERROR_STORING;
+    }
+  }
+  return 0;
+}
+
+// Hour bucket while its samples are read
+typedef struct
+{
+  int32_t Start;
+  int64_t Energy;
+  int64_t PeakPower;
+  bool HasPeak;           // PeakPower is known (there is a sample before the first one)
+  int32_t FirstTimeStamp;
+  int64_t FirstEnergy;
+  int32_t LastTimeStamp;
+  int64_t LastEnergy;
+  int Samples;
+} HourBucket;
+
+// Insert or replace an hour bucket with the rollup statement. Returns 0 on success
+static int SaveHour(sqlite3_stmt *insert, const HourBucket& hour)
+{
+  sqlite3_bind_int(insert, 1, hour.Start);
+  sqlite3_bind_int64(insert, 2, hour.Energy);
+  if (hour.HasPeak)
+  {
+    sqlite3_bind_int64(insert, 3, hour.PeakPower);
+  }
+  else
+  {
+    sqlite3_bind_null(insert, 3);
+  }
+  sqlite3_bind_int(insert, 4, hour.FirstTimeStamp);
+  sqlite3_bind_int64(insert, 5, hour.FirstEnergy);
+  sqlite3_bind_int(insert, 6, hour.LastTimeStamp);
+  sqlite3_bind_int64(insert, 7, hour.LastEnergy);
+  sqlite3_bind_int(insert, 8, hour.Samples);
+  int status = sqlite3_step(insert);
+  sqlite3_reset(insert);
+  return (status == SQLITE_DONE) ? 0 : YIELD_ERROR_STORING;
+}
+
+int YieldStore::UpdateHours(int32_t from, int32_t to, int32_t offset)
+{
+  // The energy and average power of a sample count from the sample before it, in the bucket of the sample
+  bool found = false;
+  int32_t previous_timestamp = 0;
+  int64_t previous_energy = 0;
+  sqlite3_bind_int(previous_sample, 1, from);
+  if (sqlite3_step(previous_sample) == SQLITE_ROW)
+  {
+    previous_timestamp = sqlite3_column_int(previous_sample, 0);
+    previous_energy = sqlite3_column_int64(previous_sample, 1);
+    found = true;
+  }
+  sqlite3_reset(previous_sample);
+  HourBucket hour;
+  hour.Samples = 0;
+  int status;
+  int result = 0;
+  sqlite3_bind_int(samples, 1, from);
+  sqlite3_bind_int(samples, 2, to);
+  while (result == 0 && (status = sqlite3_step(samples)) == SQLITE_ROW)
+  {
+    int32_t timestamp = sqlite3_column_int(samples, 0);
+    int64_t energy = sqlite3_column_int64(samples, 1);
+    int32_t start = timestamp - (timestamp + offset) % 3600;
+    if (hour.Samples > 0 && start != hour.Start)
+    {
+      result = SaveHour(rollup[ROLLUP_HOURLY], hour);
+      hour.Samples = 0;
+    }
+    if (hour.Samples == 0)
+    {
+      hour.Start = start;
+      hour.Energy = 0;
+      hour.HasPeak = false;
+      hour.FirstTimeStamp = timestamp;
+      hour.FirstEnergy = energy;
+    }
+    if (found)
+    {
+      int64_t power = (energy - previous_energy) * 3600 / (timestamp - previous_timestamp);
+      hour.Energy += energy - previous_energy;
+      hour.PeakPower = (!hour.HasPeak || power > hour.PeakPower) ? power : hour.PeakPower;
+      hour.HasPeak = true;
+    }
+    hour.LastTimeStamp = timestamp;
+    hour.LastEnergy = energy;
+    hour.Samples++;
+    previous_timestamp = timestamp;
+    previous_energy = energy;
+    found = true;
+  }
+  sqlite3_reset(samples);
+  if (result == 0 && status != SQLITE_DONE)
+  {
+    result = YIELD_ERROR_STORING;
+  }
+  if (result == 0 && hour.Samples > 0)
+  {
+    result = SaveHour(rollup[ROLLUP_HOURLY], hour);
+  }
+  return result;
+}
+
+int YieldStore::RebuildRollups()
+{
+  sqlite3_stmt *compiled;
+  int32_t from = 0, to = -1;
+  if (Begin() != 0)
+  {
+    return YIELD_ERROR_STORING;
+  }
+  for (int r = 0; r < ROLLUP_TABLES; r++)
+  {
+    char query[64];
+    snprintf(query, sizeof(query), "DELETE FROM %s", rollups[r]);
+    if (sqlite3_exec(db, query, NULL, NULL, NULL) != SQLITE_OK)
+    {
+      sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+      transaction = false;
+      return YIELD_ERROR_STORING;
+    }
+  }
+  if (sqlite3_prepare_v2(db, "SELECT MIN(timestamp), MAX(timestamp) FROM yield_5m", -1, &compiled, NULL) != SQLITE_OK)
+  {
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    transaction = false;
+    return YIELD_ERROR_STORING;
+  }
+  if (sqlite3_step(compiled) == SQLITE_ROW && sqlite3_column_type(compiled, 0) != SQLITE_NULL)
+  {
+    from = sqlite3_column_int(compiled, 0);
+    to = sqlite3_column_int(compiled, 1);
+  }
+  sqlite3_finalize(compiled);
+  // Commit updates the whole range
+  touched_from = (from < touched_from) ? from : touched_from;
+  touched_to = (to > touched_to) ? to : touched_to;
+  return Commit();
+}
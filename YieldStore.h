@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sqlite3.h>
+#include "ProtocolManager.h"
+
+#ifndef __YIELD_STORE_H__
+#define __YIELD_STORE_H__
+
+// Yield tables
+#define YIELD_5M                      0
+#define YIELD_DAILY                   1
+#define YIELD_TABLES                  2
+
+// Rows per multi-row INSERT (2 parameters per row; SQLite allows at least 999 parameters)
+#define YIELD_ROWS_PER_INSERT         64
+
+// Rollup tables of yield_5m
+#define ROLLUP_HOURLY                 0
+#define ROLLUP_DAILY                  1
+#define ROLLUP_MONTHLY                2
+#define ROLLUP_TABLES                 3
+
+// Error storing records in the database
+#define YIELD_ERROR_STORING           -20
+
+// Bulk ingest of historic yield in the SQLite tables yield_5m and yield_daily (timestamp INTEGER PRIMARY KEY, energy
+// INTEGER). The database uses WAL journaling. Records are inserted with cached prepared statements,
+// YIELD_ROWS_PER_INSERT rows per statement, inside one transaction for both tables (Begin/Commit). Existing records
+// are replaced, so storing an overlapping range again is harmless. The backfill table (series TEXT PRIMARY KEY, cursor
+// INTEGER) keeps the backfill cursor of every yield table, so it is committed together with its records. The table
+// checked_ranges (series TEXT, from_timestamp INTEGER, to_timestamp INTEGER) keeps the ranges of every yield table
+// that were fetched completely or scanned without gaps: records missing in them are not available on the inverter
+// either (e.g. at night), so the GapScanner skips them. Overlapping and adjacent ranges are merged.
+// The rollup tables rollup_hourly, rollup_daily and rollup_monthly summarize yield_5m per bucket (bucket INTEGER
+// PRIMARY KEY: start of the hour, or of the day or month in local time):
+//   energy                  produced in the bucket [Wh]: from the sample before the bucket to its last sample
+//   peak_power              highest average power between two successive samples [W]
+//   first_timestamp/energy  first sample in the bucket
+//   last_timestamp/energy   last sample in the bucket
+//   samples                 number of samples
+// Commit first updates the buckets touched by the yield_5m records of the transaction (and the bucket of the next
+// sample, whose energy starts at them), so charts query O(buckets) rows instead of O(samples). The hours are computed
+// in one ordered pass over their samples, so a sample costs no more than reading it once; days come from the hours
+// and months from the days. RebuildRollups fills
+// them for an existing database.
+class YieldStore
+{
+  sqlite3 *db;
+  sqlite3_stmt *insert_rows[YIELD_TABLES];    // YIELD_ROWS_PER_INSERT rows
+  sqlite3_stmt *insert_row[YIELD_TABLES];     // a single row
+  sqlite3_stmt *select_cursor;
+  sqlite3_stmt *save_cursor;
+  sqlite3_stmt *checked[3];                   // union of the overlapping checked ranges, delete them, insert
+  sqlite3_stmt *next_sample;                  // first yield_5m timestamp after a timestamp
+  sqlite3_stmt *previous_sample;              // latest yield_5m sample before a timestamp
+  sqlite3_stmt *samples;                      // yield_5m samples from ?1 up to (excluding) ?2, in order
+  sqlite3_stmt *rollup[ROLLUP_TABLES];        // hours: insert a bucket; days and months: recompute the buckets from
+                                              // ?1 up to (including) ?2
+  bool transaction;
+  // Range of yield_5m timestamps inserted in the transaction; touched_from > touched_to when none
+  int32_t touched_from;
+  int32_t touched_to;
+
+  // Recompute the rollup buckets of the yield_5m timestamps from up to (including) to, and the bucket of the next
+  // sample. Returns 0 on success
+  int UpdateRollups(int32_t from, int32_t to);
+
+  // Recompute the hour buckets from up to (excluding) to in one ordered pass over their samples, with offset the
+  // offset of local time to UTC modulo an hour. Returns 0 on success
+  int UpdateHours(int32_t from, int32_t to, int32_t offset);
+
+  // Insert records: timestamps[i * stride], values[i * stride]
+  int Insert(int table, const int32_t *timestamps, const uint32_t *values, int stride, int no_records);
+
+  public:
+
+  YieldStore();
+
+  ~YieldStore()
+  {
+    Close();
+  }
+
+  // Name of a yield table
+  static const char *Table(int table);
+
+  // Use database (which stays open after Close): switch to WAL journaling, create the yield and backfill tables and
+  // prepare the statements. Returns 0 on success, YIELD_ERROR_STORING on failure
+  int Open(sqlite3 *db);
+
+  // Commit an open transaction, free the statements
+  void Close();
+
+  // Start a transaction, when none is open. Returns 0 on success
+  int Begin();
+
+  // Update the touched rollup buckets and commit the transaction, when one is open. Returns 0 on success; on failure
+  // the transaction is rolled back
+  int Commit();
+
+  // Recompute all rollup buckets from yield_5m. Returns 0 on success, YIELD_ERROR_STORING on failure
+  int RebuildRollups();
+
+  // Name of a rollup table
+  static const char *Rollup(int rollup);
+
+  // Insert or replace records in a yield table. Returns 0 on success, YIELD_ERROR_STORING on failure
+  int Insert(int table, const HistoricInfoItem *records, int no_records);
+  int Insert(int table, const int32_t *timestamps, const uint32_t *values, int no_records);
+
+  // Backfill cursor of a yield table: all records up to (including) this timestamp have been fetched. 0 when unknown
+  int32_t Cursor(int table);
+
+  // Save backfill cursor of a yield table. Returns 0 on success, YIELD_ERROR_STORING on failure
+  int SaveCursor(int table, int32_t cursor);
+
+  // Add range [from, to] of a yield table to the checked ranges. Returns 0 on success, YIELD_ERROR_STORING on failure
+  int SaveChecked(int table, int32_t from, int32_t to);
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <signal.h>
+#include "YieldWriter.h"
+
+YieldWriter::YieldWriter()
+{
+  store = NULL;
+  running = false;
+  pushed = 0;
+  processed.store(0);
+  status.store(0);
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&wakeup, NULL);
+  waiting.store(false);
+  Stalls = 0;
+}
+
+YieldWriter::~YieldWriter()
+{
+  Stop();
+  pthread_cond_destroy(&wakeup);
+  pthread_mutex_destroy(&mutex);
+}
+
+int YieldWriter::Start(YieldStore *store)
+{
+  Stop();
+  this->store = store;
+  pushed = 0;
+  processed.store(0);
+  status.store(0);
+  // The thread inherits a mask that blocks all signals, so they keep interrupting the protocol thread
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  int result = pthread_create(&thread, NULL, Run, this);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if (result != 0)
+  {
+    return -1;
+  }
+  running = true;
+  return 0;
+}
+
+int YieldWriter::Stop()
+{
+  if (!running)
+  {
+    return 0;
+  }
+  WriterMessage message;
+  message.Type = WRITER_STOP;
+  Push(message);
+  pthread_join(thread, NULL);
+  running = false;
+  return status.exchange(0);
+}
+
+void YieldWriter::Push(const WriterMessage& message)
+{
+  while (!queue.Push(message))
+  {
+    Stalls++;
+    usleep(WRITER_WAIT);
+  }
+  pushed++;
+  // Wake up the writer thread when it waits for a message. The fence orders the push before reading waiting; the
+  // writer thread has the same fence between setting waiting and looking at the queue, so either it sees the message
+  // or this sees it waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiting.load(std::memory_order_relaxed))
+  {
+    pthread_mutex_lock(&mutex);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+int YieldWriter::Insert(int table, const HistoricInfoItem *records, int no_records)
+{
+  WriterMessage message;
+  message.Type = WRITER_RECORDS;
+  message.Table = table;
+  for (int i = 0; i < no_records; i += WRITER_BATCH)
+  {
+    message.NoRecords = (no_records - i < WRITER_BATCH) ? no_records - i : WRITER_BATCH;
+    memcpy(message.Records, records + i, message.NoRecords * sizeof(HistoricInfoItem));
+    Push(message);
+  }
+  return Status();
+}
+
+int YieldWriter::Checkpoint(int table, int32_t cursor)
+{
+  WriterMessage message;
+  message.Type = WRITER_CHECKPOINT;
+  message.Table = table;
+  message.Cursor = cursor;
+  Push(message);
+  return Status();
+}
+
+int YieldWriter::Checked(int table, int32_t from, int32_t to)
+{
+  WriterMessage message;
+  message.Type = WRITER_CHECKED;
+  message.Table = table;
+  message.From = from;
+  message.To = to;
+  Push(message);
+  return Status();
+}
+
+int YieldWriter::Flush()
+{
+  WriterMessage message;
+  message.Type = WRITER_COMMIT;
+  Push(message);
+  while (processed.load(std::memory_order_acquire) != pushed)
+  {
+    usleep(WRITER_WAIT);
+  }
+  return status.exchange(0);
+}
+
+void YieldWriter::Apply(const WriterMessage& message)
+{
+  int result = 0;
+  bool failed = (status.load(std::memory_order_relaxed) != 0);
+  switch (message.Type)
+  {
+    case WRITER_RECORDS:
+      if (!failed && (result = store->Begin()) == 0)
+      {
+        result = store->Insert(message.Table, message.Records, message.NoRecords);
+      }
+      break;
+    case WRITER_CHECKED:
+      if (!failed && (result = store->Begin()) == 0)
+      {
+        result = store->SaveChecked(message.Table, message.From, message.To);
+      }
+      break;
+    case WRITER_CHECKPOINT:
+      if (!failed && (result = store->Begin()) == 0)
+      {
+        result = store->SaveCursor(message.Table, message.Cursor);
+      }
+      // Keep the records that did arrive, also after a failure
+      if (store->Commit() != 0)
+      {
+        result = YIELD_ERROR_STORING;
+      }
+      break;
+    default:
+      if (store->Commit() != 0)
+      {
+        result = YIELD_ERROR_STORING;
+      }
+      break;
+  }
+  if (result != 0 && !failed)
+  {
+    status.store(result, std::memory_order_release);
+  }
+}
+
+void *YieldWriter::Run(void *writer)
+{
+  YieldWriter *w = (YieldWriter *) writer;
+  while (true)
+  {
+    // Apply the message in place: the producer can not reuse its slot before it is popped
+    WriterMessage *message = w->queue.Front();
+    if (message == NULL)
+    {
+      // Sleep until the producer pushes a message
+      pthread_mutex_lock(&w->mutex);
+      w->waiting.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while ((message = w->queue.Front()) == NULL)
+      {
+        pthread_cond_wait(&w->wakeup, &w->mutex);
+      }
+      w->waiting.store(false, std::memory_order_relaxed);
+      pthread_mutex_unlock(&w->mutex);
+    }
+    int type = message->Type;
+    w->Apply(*message);
+    w->queue.Pop();
+    w->processed.fetch_add(1, std::memory_order_release);
+    if (type == WRITER_STOP)
+    {
+      return NULL;
+    }
+  }
+}
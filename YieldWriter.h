@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include "ProtocolManager.h"
+#include "YieldStore.h"
+#include "SPSCQueue.h"
+
+#ifndef __YIELD_WRITER_H__
+#define __YIELD_WRITER_H__
+
+// Messages in the writer queue (power of 2), and records per message
+#define WRITER_QUEUE_SIZE             256
+#define WRITER_BATCH                  64
+// Wait of the producer when the queue is full, or while Flush waits for the writer [us]. The writer thread blocks
+// while the queue is empty
+#define WRITER_WAIT                   200
+
+// Message types
+#define WRITER_RECORDS                0       // insert Records in Table
+#define WRITER_CHECKPOINT             1       // save Cursor of Table and commit
+#define WRITER_CHECKED                2       // add From..To of Table to the checked ranges
+#define WRITER_COMMIT                 3       // commit
+#define WRITER_STOP                   4       // commit and end the thread
+
+typedef struct
+{
+  int Type;
+  int Table;
+  int NoRecords;
+  int32_t Cursor;
+  int32_t From;
+  int32_t To;
+  HistoricInfoItem Records[WRITER_BATCH];
+} WriterMessage;
+
+// Writes historic yield to a YieldStore on a thread of its own, so the SQLite inserts and commits (fsyncs) overlap the
+// round trips to the inverter. The protocol thread (the only producer) hands over batches of records, cursors and
+// commits through a lock-free SPSCQueue; the writer thread applies them in order. When the queue is full the
+// producer waits (backpressure), so a slow disk slows down the acquisition instead of using more memory. When the
+// queue is empty the writer thread sleeps on a condition variable, which the producer only signals (taking the mutex)
+// when the writer is waiting, so an idle daemon does not wake up and a busy queue takes no lock. Between Start
+// and Stop the store must only be used through the writer, except after Flush, when the writer is idle.
+// After a failed insert or commit the writer skips further records and cursors until Flush, but still commits, so
+// the records that were stored before the failure are kept (as without a writer).
+class YieldWriter
+{
+  YieldStore *store;
+  SPSCQueue<WriterMessage, WRITER_QUEUE_SIZE> queue;
+  pthread_t thread;
+  bool running;
+  uint32_t pushed;                      // messages pushed (producer)
+  std::atomic<uint32_t> processed;      // messages applied (writer thread)
+  std::atomic<int> status;              // first error since the last Flush
+  // Wake-up of the writer thread when the queue is empty
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+  std::atomic<bool> waiting;            // the writer thread is (about to be) blocked on wakeup
+
+  // Push message, waiting while the queue is full
+  void Push(const WriterMessage& message);
+
+  // Apply a message to the store (writer thread)
+  void Apply(const WriterMessage& message);
+
+  // Writer thread
+  static void *Run(void *writer);
+
+  public:
+
+  // Waits for a full queue
+  uint64_t Stalls;
+
+  YieldWriter();
+
+  ~YieldWriter();
+
+  YieldWriter(const YieldWriter&) = delete;
+  YieldWriter& operator=(const YieldWriter&) = delete;
+
+  // Start the writer thread on an open store. Returns 0 on success, -1 when the thread could not be created
+  int Start(YieldStore *store);
+
+  // Apply everything that was queued, commit and end the thread. Returns the first error since the last Flush, also
+  // of this last commit (0 when none)
+  int Stop();
+
+  bool Running() const
+  {
+    return running;
+  }
+
+  // Queue records for a yield table. Returns the first error of the writer since the last Flush (0 when none), so a
+  // failing database stops the acquisition
+  int Insert(int table, const HistoricInfoItem *records, int no_records);
+
+  // Queue saving the backfill cursor of a yield table, followed by a commit: the records queued before it are then
+  // committed together with the cursor. Returns as Insert
+  int Checkpoint(int table, int32_t cursor);
+
+  // Queue adding [from, to] of a yield table to the checked ranges (committed with the next Checkpoint or Flush). 
+  // Returns as Insert
+  int Checked(int table, int32_t from, int32_t to);
+
+  // Commit and wait until the writer applied everything that was queued. Returns the first error since the last
+  // Flush (0 when none) and clears it
+  int Flush();
+
+  // First error since the last Flush, 0 when none
+  int Status() const
+  {
+    return status.load(std::memory_order_acquire);
+  }
+};
+
+#endif
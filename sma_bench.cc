@@ -0,0 +1,968 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include <math.h>
+#include "ProtocolManager.h"
+#include "TimeSeries.h"
+#include "YieldStore.h"
+#include "sma_bench.h"
+
+// Microbenchmarks of the protocol stack hot paths. Every benchmark first checks that the optimized code gives the
+// same result as the reference implementation. Recorded sessions with an inverter can be replayed through the whole
+// stack (L1 reader, L2 decoder, ProtocolManager) for reproducible throughput numbers. Results can be saved as a JSON
+// baseline and compared with a later run.
+
+#define BENCH_BYTES       (64*1024*1024)    // bytes processed per benchmark
+#define BENCH_RECORDS     10000             // historic records decoded per benchmark iteration
+#define BENCH_MAX_RESULTS 64
+
+// Count heap allocations: malloc, calloc and realloc (operator new uses malloc) are forwarded to glibc
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+
+static uint64_t allocations = 0;
+
+extern "C" void *malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+  allocations++;
+  return __libc_realloc(p, size);
+}
+
+// Monotonic time [s]
+static double Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fill buffer with pseudo random bytes
+static void FillRandom(uint8_t *data, int length, unsigned int seed)
+{
+  srand(seed);
+  for (int i = 0; i < length; i++)
+  {
+    data[i] = (uint8_t) rand();
+  }
+}
+
+// Result of a benchmark
+typedef struct
+{
+  char Name[64];
+  int Size;                   // bytes per operation
+  double NsPerByte;
+  double Allocations;         // per operation
+  double RecordsPerSecond;    // 0 when the benchmark does not decode records
+} BenchResult;
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static int no_results = 0;
+
+// Print result line and keep it for the baseline. operations of size bytes took seconds, with allocated heap blocks
+// and records decoded
+static void Report(const char *name, int size, double seconds, long operations, uint64_t allocated, long records = 0)
+{
+  double bytes = (double) size * operations;
+  BenchResult r;
+  strncpy(r.Name, name, sizeof(r.Name) - 1);
+  r.Name[sizeof(r.Name) - 1] = 0;
+  r.Size = size;
+  r.NsPerByte = seconds * 1e9 / bytes;
+  r.Allocations = (double) allocated / operations;
+  r.RecordsPerSecond = records / seconds;
+  printf("%-28s %8d B %10.3f ns/byte %10.1f MB/s %8.2f alloc/op", name, size, r.NsPerByte, bytes / seconds / 1e6, r.Allocations);
+  if (records > 0)
+  {
+    printf(" %12.0f records/s", r.RecordsPerSecond);
+  }
+  printf("\n");
+  if (no_results < BENCH_MAX_RESULTS)
+  {
+    results[no_results++] = r;
+  }
+}
+
+// Byte-wise FCS-16, as L2Packet::CheckSum was implemented before slicing-by-8
+static uint16_t FCS16Reference(uint16_t fcs, const uint8_t *p, int length)
+{
+  for (int i = 0; i < length; i++)
+  {
+    fcs = (fcs >> 8) ^ fcstab[(fcs ^ p[i]) & 0xff];
+  }
+  return fcs;
+}
+
+// Compare and time FCS-16 implementations. Returns false on mismatch.
+static bool BenchCheckSum()
+{
+  const int sizes[] = { 16, 64, 1024, 65536 };
+  uint8_t *data = (uint8_t *) malloc(65536);
+  FillRandom(data, 65536, 1);
+  // Verify: all lengths, whole buffer at once and split in two parts (incremental use)
+  for (int length = 0; length <= 1024; length++)
+  {
+    uint16_t expected = FCS16Reference(FCS16_INIT, data, length);
+    uint16_t split = FCS16Update(FCS16Update(FCS16_INIT, data, length / 3), data + length / 3, length - length / 3);
+    if (FCS16Update(FCS16_INIT, data, length) != expected || split != expected)
+    {
+      printf("FCS16Update differs from reference for length %d\n", length);
+      free(data);
+      return false;
+    }
+  }
+  // Time both
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    int size = sizes[i];
+    long iterations = BENCH_BYTES / size;
+    volatile uint16_t sink = 0;
+    uint64_t allocated = allocations;
+    double start = Now();
+    for (long n = 0; n < iterations; n++)
+    {
+      sink ^= FCS16Reference(FCS16_INIT, data, size);
+    }
+    Report("fcs16 byte-wise", size, Now() - start, iterations, allocations - allocated);
+    allocated = allocations;
+    start = Now();
+    for (long n = 0; n < iterations; n++)
+    {
+      sink ^= FCS16Update(FCS16_INIT, data, size);
+    }
+    Report("fcs16 slicing-by-8", size, Now() - start, iterations, allocations - allocated);
+    // Checksum of a whole L2 packet: header and data
+    L2Packet packet;
+    allocated = allocations;
+    start = Now();
+    for (long n = 0; n < iterations; n++)
+    {
+      sink ^= packet.CheckSum(data, size);
+    }
+    Report("l2 checksum", sizeof(L2PacketHeader) - 1 + size, Now() - start, iterations, allocations - allocated);
+  }
+  free(data);
+  return true;
+}
+
+// Names of the (un)escape kernels
+static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+
+// Check escape/unescape of length bytes of data with the selected kernel against the scalar reference, and the
+// round trip. Returns false on mismatch.
+static bool CheckEscape(const uint8_t *data, int length, uint8_t *expected, uint8_t *actual)
+{
+  int kernel = L2SelectKernel(L2_KERNEL_AVX2);
+  L2SelectKernel(L2_KERNEL_SCALAR);
+  int expected_length = L2Packet::EscapeData(expected, data, length);
+  for (int k = L2_KERNEL_SSE2; k <= kernel; k++)
+  {
+    L2SelectKernel(k);
+    int actual_length = L2Packet::EscapeData(actual, data, length);
+    if (actual_length != expected_length || memcmp(actual, expected, expected_length))
+    {
+      printf("EscapeData (%s) differs from reference for length %d\n", kernel_names[k], length);
+      return false;
+    }
+    // Round trip, in-place
+    actual_length = L2Packet::UnescapeData(actual, actual_length);
+    if (actual_length != length || memcmp(actual, data, length))
+    {
+      printf("UnescapeData (%s) does not restore data of length %d\n", kernel_names[k], length);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Compare and time (un)escape kernels. Returns false on mismatch.
+static bool BenchEscape()
+{
+  const int size = 65536;
+  uint8_t *data = (uint8_t *) malloc(size);
+  uint8_t *all_escape = (uint8_t *) malloc(size);
+  uint8_t *expected = (uint8_t *) malloc(2 * size);
+  uint8_t *actual = (uint8_t *) malloc(2 * size);
+  bool ok = true;
+  // Random data, all lengths up to 1 kB at all alignments within a vector, adversarial data: every byte escaped
+  FillRandom(data, size, 2);
+  const uint8_t escaped[] = { 0x7D, 0x7E, 0x11, 0x12, 0x13 };
+  for (int i = 0; i < size; i++)
+  {
+    all_escape[i] = escaped[i % sizeof(escaped)];
+  }
+  for (int length = 0; length <= 1024 && ok; length++)
+  {
+    ok = CheckEscape(data + (length & 31), length, expected, actual) && CheckEscape(all_escape + (length & 31), length, expected, actual);
+  }
+  ok = ok && CheckEscape(data, size, expected, actual) && CheckEscape(all_escape, size, expected, actual);
+  // Escaped input that ends with a lone 0x7D is kept as-is by all kernels
+  memset(expected, 0x41, 64);
+  expected[63] = 0x7D;
+  for (int k = L2_KERNEL_SCALAR; k <= L2_KERNEL_AVX2 && ok; k++)
+  {
+    if (L2SelectKernel(k) == k)
+    {
+      memcpy(actual, expected, 64);
+      ok = L2Packet::UnescapeData(actual, 64) == 64 && !memcmp(actual, expected, 64);
+      if (!ok)
+      {
+        printf("UnescapeData (%s) mishandles trailing escape byte\n", kernel_names[k]);
+      }
+    }
+  }
+  // Time kernels on random data (about 2% escaped) and all-escape data
+  for (int k = L2_KERNEL_SCALAR; k <= L2_KERNEL_AVX2 && ok; k++)
+  {
+    if (L2SelectKernel(k) != k)
+    {
+      continue;
+    }
+    const uint8_t *inputs[] = { data, all_escape };
+    for (int j = 0; j < 2; j++)
+    {
+      char name[64];
+      long iterations = BENCH_BYTES / size;
+      int escaped_length = 0;
+      uint64_t allocated = allocations;
+      double start = Now();
+      for (long n = 0; n < iterations; n++)
+      {
+        escaped_length = L2Packet::EscapeData(expected, inputs[j], size);
+      }
+      sprintf(name, "escape %s %s", kernel_names[k], (j == 0) ? "random" : "all-escape");
+      Report(name, size, Now() - start, iterations, allocations - allocated);
+      // Unescape a copy of the escaped data each iteration (in-place operation)
+      double copy_time = Now();
+      for (long n = 0; n < iterations; n++)
+      {
+        memcpy(actual, expected, escaped_length);
+      }
+      copy_time = Now() - copy_time;
+      allocated = allocations;
+      start = Now();
+      for (long n = 0; n < iterations; n++)
+      {
+        memcpy(actual, expected, escaped_length);
+        L2Packet::UnescapeData(actual, escaped_length);
+      }
+      sprintf(name, "unescape %s %s", kernel_names[k], (j == 0) ? "random" : "all-escape");
+      Report(name, escaped_length, Now() - start - copy_time, iterations, allocations - allocated);
+    }
+  }
+  // Back to the best kernel
+  L2SelectKernel(L2_KERNEL_AVX2);
+  free(data);
+  free(all_escape);
+  free(expected);
+  free(actual);
+  return ok;
+}
+
+// In-memory stream: written bytes are appended to a buffer, reads return them over and over again
+class MemoryTransport : public Transport
+{
+  uint8_t *buffer;
+  int length;
+  int capacity;
+  int position;       // next byte to read
+  
+  public:
+  
+  MemoryTransport()
+  {
+    buffer = NULL;
+    length = capacity = position = 0;
+  }
+  
+  ~MemoryTransport()
+  {
+    free(buffer);
+  }
+  
+  // Length of the stream
+  int Length()
+  {
+    return length;
+  }
+  
+  int Read(uint8_t *data, int max_length)
+  {
+    if (length == 0)
+    {
+      return 0;
+    }
+    int n = (max_length < length - position) ? max_length : (length - position);
+    memcpy(data, buffer + position, n);
+    position = (position + n) % length;
+    BytesRead += n;
+    return n;
+  }
+  
+  int Read(uint8_t *data, int max_length, double deadline)
+  {
+    return Read(data, max_length);
+  }
+  
+  int Write(const uint8_t *data, int data_length)
+  {
+    if (length + data_length > capacity)
+    {
+      capacity = 2 * (length + data_length);
+      buffer = (uint8_t *) realloc(buffer, capacity);
+    }
+    memcpy(buffer + length, data, data_length);
+    length += data_length;
+    BytesWritten += data_length;
+    return data_length;
+  }
+  
+  int Writev(const struct iovec *iov, int count)
+  {
+    int written = 0;
+    for (int i = 0; i < count; i++)
+    {
+      written += Write((const uint8_t *) iov[i].iov_base, iov[i].iov_len);
+    }
+    return written;
+  }
+  
+  int Fd()
+  {
+    return -1;
+  }
+  
+  // Data is always available
+  int Poll(int timeout_ms)
+  {
+    return 1;
+  }
+  
+  void Close()
+  {
+  }
+};
+
+#define BENCH_RECORDS_PER_TELEGRAM    60
+#define BENCH_TELEGRAMS               ((BENCH_RECORDS + BENCH_RECORDS_PER_TELEGRAM - 1) / BENCH_RECORDS_PER_TELEGRAM)
+#define BENCH_TELEGRAM_LENGTH         (sizeof(_FrameInfo) + BENCH_RECORDS_PER_TELEGRAM * sizeof(_HistoricYieldInfo))
+
+// Reply to a historic yield request of BENCH_RECORDS records, in telegrams of BENCH_RECORDS_PER_TELEGRAM records like
+// the inverter sends them: the data of every telegram and the escaped L2 packet
+typedef struct
+{
+  uint8_t Data[BENCH_TELEGRAMS][BENCH_TELEGRAM_LENGTH];
+  int DataLength[BENCH_TELEGRAMS];
+  uint8_t Packet[BENCH_TELEGRAMS][L2_MaxReplyLength(BENCH_TELEGRAM_LENGTH)];
+  int PacketLength[BENCH_TELEGRAMS];
+  L2PacketHeader Header;
+} HistoricReply;
+
+static HistoricReply *MakeHistoricReply()
+{
+  HistoricReply *reply = new HistoricReply;
+  L2Packet packet;
+  packet.SetFields(0xA0, 0x00, 0x00, 1, L2_command_historic_yield_5);
+  for (int t = 0, record = 0; t < BENCH_TELEGRAMS; t++)
+  {
+    int n = (BENCH_RECORDS - record > BENCH_RECORDS_PER_TELEGRAM) ? BENCH_RECORDS_PER_TELEGRAM : (BENCH_RECORDS - record);
+    _FrameInfo fi = { htobl(record), htobl(record + n - 1) };
+    _HistoricYieldInfo *hi = (_HistoricYieldInfo *) (reply->Data[t] + sizeof(_FrameInfo));
+    memcpy(reply->Data[t], &fi, sizeof(fi));
+    for (int i = 0; i < n; i++)
+    {
+      hi[i].timestamp = htobl(1500000000 + 300 * (record + i));
+      hi[i].value = htobl(1000000 + 7 * (record + i));
+      hi[i].fill = 0;
+    }
+    reply->DataLength[t] = sizeof(_FrameInfo) + n * sizeof(_HistoricYieldInfo);
+    // Telegrams count down to 0
+    packet.header.telegram_number = htons(BENCH_TELEGRAMS - 1 - t);
+    reply->PacketLength[t] = packet.PrepareReply(reply->Packet[t], reply->Data[t], reply->DataLength[t]);
+    record += n;
+  }
+  reply->Header = packet.header;
+  return reply;
+}
+
+// Check records decoded from a HistoricReply
+static bool CheckHistoricInfo(HistoricInfo& hi, const char *name)
+{
+  bool ok = hi.NoRecords == BENCH_RECORDS;
+  for (uint32_t i = 0; i < hi.NoRecords && ok; i++)
+  {
+    ok = hi.TimeStamp(i) == 1500000000 + 300 * (int32_t) i && hi.Value(i) == 1000000 + 7 * i;
+  }
+  if (!ok)
+  {
+    printf("%s: wrong records decoded\n", name);
+  }
+  return ok;
+}
+
+// Time building and reading of L2 packets: a request (PreparePacket, ReadRequest) and a historic yield telegram
+// (PrepareReply, ReadPacket). Returns false when the read packet differs from the original.
+static bool BenchPacket(HistoricReply *reply)
+{
+  uint8_t request[L2_MaxDataLength];
+  uint8_t escaped[sizeof(reply->Packet[0])];
+  uint8_t buffer[sizeof(reply->Packet[0])];
+  FillRandom(request, sizeof(request), 3);
+  L2Packet packet;
+  packet.SetFields(0xA0, 0x00, 0x00, 1, L2_command_historic_yield_5);
+  const uint8_t *inputs[] = { request, reply->Data[0] };
+  int sizes[] = { sizeof(request), reply->DataLength[0] };
+  for (int i = 0; i < 2; i++)
+  {
+    int size = sizes[i];
+    long iterations = BENCH_BYTES / size;
+    int escaped_length = 0;
+    uint64_t allocated = allocations;
+    double start = Now();
+    for (long n = 0; n < iterations; n++)
+    {
+      escaped_length = (i == 0) ? packet.PreparePacket(escaped, inputs[i], size) : packet.PrepareReply(escaped, inputs[i], size);
+    }
+    Report((i == 0) ? "l2 prepare request" : "l2 prepare telegram", size, Now() - start, iterations, allocations - allocated);
+    // Verify: reading gives the original data
+    L2Packet read;
+    memcpy(buffer, escaped, escaped_length);
+    int read_length = (i == 0) ? read.ReadRequest(buffer, escaped_length) : read.ReadPacket(buffer, escaped_length);
+    if (read_length != size || memcmp(buffer, inputs[i], size))
+    {
+      printf("reading does not restore the data of the prepared packet (%d bytes)\n", size);
+      return false;
+    }
+    // Read a copy of the escaped packet each iteration (ReadPacket works in-place)
+    double copy_time = Now();
+    for (long n = 0; n < iterations; n++)
+    {
+      memcpy(buffer, escaped, escaped_length);
+    }
+    copy_time = Now() - copy_time;
+    allocated = allocations;
+    start = Now();
+    for (long n = 0; n < iterations; n++)
+    {
+      memcpy(buffer, escaped, escaped_length);
+      if (i == 0)
+      {
+        read.ReadRequest(buffer, escaped_length);
+      }
+      else
+      {
+        read.ReadPacket(buffer, escaped_length);
+      }
+    }
+    Report((i == 0) ? "l2 read request" : "l2 read telegram", escaped_length, Now() - start - copy_time, iterations, allocations - allocated);
+  }
+  return true;
+}
+
+// Time the receive path of a historic yield reply of BENCH_RECORDS records: decoding the telegrams into a 
+// HistoricInfo (as GetHistoricYield does), L1Packet::Read of the L1 packets from an in-memory stream, and the whole 
+// path (L1 packets, L2Decoder, HistoricInfo). Returns false when the records are decoded wrongly.
+static bool BenchHistoric(HistoricReply *reply)
+{
+  L2_data_historic_yield request;   // the handler keeps its resume point up to date
+  int reply_length = 0;
+  for (int t = 0; t < BENCH_TELEGRAMS; t++)
+  {
+    reply_length += reply->DataLength[t];
+  }
+  long iterations = BENCH_BYTES / reply_length;
+  // Capacity reserved by GetHistoricYield for the requested range
+  uint32_t expected = HistoricInfo::ExpectedRecords(1500000000, 1500000000 + 300 * (BENCH_RECORDS - 1), false);
+  // Decode telegrams
+  {
+    HistoricInfo hi;
+    hi.Reserve(expected);
+    for (int t = 0; t < BENCH_TELEGRAMS; t++)
+    {
+      ProtocolManager::HistoricYieldReply(&hi, &reply->Header, reply->Data[t], reply->DataLength[t], (uint8_t *) &request);
+    }
+    if (!CheckHistoricInfo(hi, "HistoricYieldReply"))
+    {
+      return false;
+    }
+  }
+  uint64_t allocated = allocations;
+  double start = Now();
+  for (long n = 0; n < iterations; n++)
+  {
+    HistoricInfo hi;
+    hi.Reserve(expected);
+    for (int t = 0; t < BENCH_TELEGRAMS; t++)
+    {
+      ProtocolManager::HistoricYieldReply(&hi, &reply->Header, reply->Data[t], reply->DataLength[t], (uint8_t *) &request);
+    }
+  }
+  Report("historic decode", reply_length, Now() - start, iterations, allocations - allocated, iterations * BENCH_RECORDS);
+  // In-memory stream of the L1 packets of the reply
+  MemoryTransport t;
+  bdaddr_t sma, us;
+  str2ba("00:80:25:11:22:33", &sma);
+  str2ba("00:1A:7D:DA:71:13", &us);
+  int no_packets = 0;
+  for (int i = 0; i < BENCH_TELEGRAMS; i++)
+  {
+    for (int offset = 0; offset < reply->PacketLength[i]; offset += L1_MaxDataLength, no_packets++)
+    {
+      int part = (reply->PacketLength[i] - offset > L1_MaxDataLength) ? L1_MaxDataLength : (reply->PacketLength[i] - offset);
+      L1Packet packet(&sma, &us, (offset + part == reply->PacketLength[i]) ? L1_Command_L2_Packet : L1_Command_L2_PacketPart);
+      packet.Send(&t, reply->Packet[i] + offset, part);
+    }
+  }
+  iterations = BENCH_BYTES / t.Length();
+  L1Reader reader;
+  L1Packet packet;
+  reader.Attach(&t);
+  allocated = allocations;
+  start = Now();
+  for (long n = 0; n < iterations; n++)
+  {
+    for (int i = 0; i < no_packets; i++)
+    {
+      if (!packet.Read(&reader))
+      {
+        printf("L1Packet::Read failed\n");
+        return false;
+      }
+    }
+  }
+  Report("l1 read", t.Length(), Now() - start, iterations, allocations - allocated);
+  // Whole receive path
+  L2Decoder decoder;
+  for (long n = -1; n < iterations; n++)
+  {
+    // The first pass is checked, not timed
+    if (n == 0)
+    {
+      allocated = allocations;
+      start = Now();
+    }
+    HistoricInfo hi;
+    hi.Reserve(expected);
+    for (int i = 0; i < no_packets; i++)
+    {
+      packet.Read(&reader);
+      decoder.Add(packet.Data(), packet.DataLength());
+      if (packet.Command() == L1_Command_L2_Packet)
+      {
+        int data_length = decoder.Finish();
+        ProtocolManager::HistoricYieldReply(&hi, decoder.Header(), decoder.Data(), data_length, (uint8_t *) &request);
+        decoder.Reset();
+      }
+    }
+    if (n < 0 && !CheckHistoricInfo(hi, "L1/L2 receive path"))
+    {
+      return false;
+    }
+  }
+  Report("historic receive path", t.Length(), Now() - start, iterations, allocations - allocated, iterations * BENCH_RECORDS);
+  return true;
+}
+
+#define BENCH_SERIES_DAYS             (3*365)
+
+// Time appending to and decoding a CompressedSeries of BENCH_SERIES_DAYS days of 5 minute yield of a 5 kW inverter
+// (half a sine between 6:00 and 18:00, with random clouds). Returns false when the decoded records differ.
+static bool BenchSeries()
+{
+  uint32_t no_records = BENCH_SERIES_DAYS * 288;
+  int32_t *timestamps = (int32_t *) malloc(no_records * sizeof(int32_t));
+  uint32_t *values = (uint32_t *) malloc(no_records * sizeof(uint32_t));
+  int32_t *decoded_timestamps = (int32_t *) malloc(TIMESERIES_BLOCK_SIZE * sizeof(int32_t));
+  uint32_t *decoded_values = (uint32_t *) malloc(TIMESERIES_BLOCK_SIZE * sizeof(uint32_t));
+  double energy = 1e6;
+  srand(4);
+  for (uint32_t i = 0; i < no_records; i++)
+  {
+    double hour = (i % 288) / 12.0;
+    double power = (hour <= 6 || hour >= 18) ? 0 : 5000 * sin(M_PI * (hour - 6) / 12) * (0.3 + 0.7 * rand() / RAND_MAX);
+    energy += power / 12;
+    timestamps[i] = 1500000000 + 300 * i;
+    values[i] = (uint32_t) energy;
+  }
+  CompressedSeries series;
+  long iterations = BENCH_BYTES / (no_records * 8) + 1;
+  uint64_t allocated = allocations;
+  double start = Now();
+  for (long n = 0; n < iterations; n++)
+  {
+    series.Clear();
+    series.Append(timestamps, values, no_records);
+  }
+  Report("series append", no_records * 8, Now() - start, iterations, allocations - allocated, iterations * no_records);
+  printf("%-28s %8u r %10.3f bytes/record (%u blocks)\n", "series size", no_records, (double) series.Bytes() / no_records, series.NoBlocks());
+  // Verify: sequential, per block, random access
+  bool ok = series.NoRecords == no_records;
+  CompressedSeries::Reader reader(series);
+  int32_t timestamp;
+  uint32_t value;
+  for (uint32_t i = 0; i < no_records && ok; i++)
+  {
+    ok = reader.Next(timestamp, value) && timestamp == timestamps[i] && value == values[i];
+  }
+  ok = ok && !reader.Next(timestamp, value);
+  for (uint32_t b = 0, i = 0; b < series.NoBlocks() && ok; b++)
+  {
+    uint32_t n = series.Decode(b, decoded_timestamps, decoded_values);
+    ok = !memcmp(decoded_timestamps, timestamps + i, n * sizeof(int32_t)) && !memcmp(decoded_values, values + i, n * sizeof(uint32_t));
+    i += n;
+  }
+  for (int i = 0; i < 1000 && ok; i++)
+  {
+    uint32_t r = rand() % no_records;
+    CompressedSeries::Reader seek(series, series.FindBlock(timestamps[r]));
+    while (seek.Next(timestamp, value) && timestamp < timestamps[r]);
+    ok = timestamp == timestamps[r] && value == values[r];
+  }
+  if (!ok)
+  {
+    printf("CompressedSeries does not restore the records\n");
+  }
+  // Sequential decoding
+  allocated = allocations;
+  start = Now();
+  uint64_t sum = 0;
+  for (long n = 0; n < iterations && ok; n++)
+  {
+    CompressedSeries::Reader r(series);
+    while (r.Next(timestamp, value))
+    {
+      sum += value;
+    }
+  }
+  Report("series read", no_records * 8, Now() - start, iterations, allocations - allocated, iterations * no_records);
+  allocated = allocations;
+  start = Now();
+  for (long n = 0; n < iterations && ok; n++)
+  {
+    for (uint32_t b = 0; b < series.NoBlocks(); b++)
+    {
+      series.Decode(b, decoded_timestamps, decoded_values);
+      sum += decoded_values[0];
+    }
+  }
+  Report("series decode blocks", no_records * 8, Now() - start, iterations, allocations - allocated, iterations * no_records);
+  ok = ok && sum != 0;
+  free(timestamps);
+  free(values);
+  free(decoded_timestamps);
+  free(decoded_values);
+  return ok;
+}
+
+#define BENCH_INGEST_ROWS             1000000
+#define BENCH_INGEST_FILE             "/tmp/sma_bench.sql"
+
+// Count rows of a table
+static int CountRows(sqlite3 *db, const char *table)
+{
+  char query[64];
+  sqlite3_stmt *statement;
+  int rows = -1;
+  snprintf(query, sizeof(query), "SELECT COUNT(*) FROM %s", table);
+  if (sqlite3_prepare_v2(db, query, -1, &statement, NULL) == SQLITE_OK && sqlite3_step(statement) == SQLITE_ROW)
+  {
+    rows = sqlite3_column_int(statement, 0);
+  }
+  sqlite3_finalize(statement);
+  return rows;
+}
+
+// Time storing BENCH_INGEST_ROWS 5 minute records in a new database file with the YieldStore, in one transaction
+// (including the update of the rollup tables at the commit, which reads the records once more), and a tenth of them
+// with one INSERT statement per record (as sma_sqlite did before). Storing the records again must succeed without
+// adding rows. Returns false on failure
+static bool BenchIngest()
+{
+  HistoricInfoItem *records = (HistoricInfoItem *) malloc(BENCH_INGEST_ROWS * sizeof(HistoricInfoItem));
+  for (int i = 0; i < BENCH_INGEST_ROWS; i++)
+  {
+    records[i].TimeStamp = 1500000000 + 300 * i;
+    records[i].Value = 1000000 + 7 * i;
+  }
+  sqlite3 *db = NULL;
+  YieldStore store;
+  unlink(BENCH_INGEST_FILE);
+  bool ok = sqlite3_open(BENCH_INGEST_FILE, &db) == SQLITE_OK && store.Open(db) == 0;
+  if (ok)
+  {
+    // In telegrams of 60 records, like the sinks get them
+    uint64_t allocated = allocations;
+    double start = Now();
+    ok = store.Begin() == 0;
+    for (int i = 0; i < BENCH_INGEST_ROWS && ok; i += 60)
+    {
+      ok = store.Insert(YIELD_5M, records + i, (BENCH_INGEST_ROWS - i < 60) ? (BENCH_INGEST_ROWS - i) : 60) == 0;
+    }
+    ok = ok && store.Commit() == 0;
+    Report("sqlite ingest", sizeof(HistoricInfoItem), Now() - start, BENCH_INGEST_ROWS, allocations - allocated, BENCH_INGEST_ROWS);
+    // Overlapping range again: replaced
+    ok = ok && store.Begin() == 0 && store.Insert(YIELD_5M, records, BENCH_INGEST_ROWS / 10) == 0 && store.Commit() == 0;
+    ok = ok && CountRows(db, YieldStore::Table(YIELD_5M)) == BENCH_INGEST_ROWS;
+    // One statement per record
+    int rows = BENCH_INGEST_ROWS / 10;
+    char command[256];
+    allocated = allocations;
+    start = Now();
+    ok = ok && sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK;
+    for (int i = 0; i < rows && ok; i++)
+    {
+      sprintf(command, "INSERT INTO yield_daily (timestamp, energy) VALUES (%d, %d)", records[i].TimeStamp, records[i].Value);
+      ok = sqlite3_exec(db, command, NULL, NULL, NULL) == SQLITE_OK;
+    }
+    ok = ok && sqlite3_exec(db, "END", NULL, NULL, NULL) == SQLITE_OK;
+    Report("sqlite insert per record", sizeof(HistoricInfoItem), Now() - start, rows, allocations - allocated, rows);
+  }
+  if (!ok)
+  {
+    printf("Error storing records in %s\n", BENCH_INGEST_FILE);
+  }
+  store.Close();
+  sqlite3_close(db);
+  unlink(BENCH_INGEST_FILE);
+  free(records);
+  return ok;
+}
+
+// Write results as JSON, one benchmark per line. Returns false on failure
+static bool WriteBaseline(const char *filename)
+{
+  FILE *f = fopen(filename, "w");
+  if (f == NULL)
+  {
+    return false;
+  }
+  fprintf(f, "{\"benchmarks\": [\n");
+  for (int i = 0; i < no_results; i++)
+  {
+    BenchResult& r = results[i];
+    fprintf(f, "  {\"name\": \"%s\", \"size\": %d, \"ns_per_byte\": %.4f, \"allocations\": %.2f, \"records_per_second\": %.0f}%s\n",
+      r.Name, r.Size, r.NsPerByte, r.Allocations, r.RecordsPerSecond, (i == no_results - 1) ? "" : ",");
+  }
+  fprintf(f, "]}\n");
+  bool ok = !ferror(f);
+  return (fclose(f) == 0) && ok;
+}
+
+// Compare results with a baseline written by WriteBaseline. A benchmark regressed when it is more than tolerance [%]
+// slower or allocates more. Returns the number of regressions, < 0 when the baseline cannot be read
+static int CompareBaseline(const char *filename, double tolerance)
+{
+  FILE *f = fopen(filename, "r");
+  if (f == NULL)
+  {
+    printf("Error reading baseline %s\n", filename);
+    return -1;
+  }
+  char line[256];
+  int regressions = 0;
+  printf("\n%-28s %8s   %10s %10s %8s %8s %8s\n", "compared with baseline", "size", "ns/byte", "baseline", "change", "alloc/op", "baseline");
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    BenchResult b;
+    if (sscanf(line, " {\"name\": \"%63[^\"]\", \"size\": %d, \"ns_per_byte\": %lf, \"allocations\": %lf", b.Name, &b.Size, 
+          &b.NsPerByte, &b.Allocations) != 4)
+    {
+      continue;
+    }
+    int i;
+    for (i = 0; i < no_results && (strcmp(results[i].Name, b.Name) || results[i].Size != b.Size); i++);
+    if (i == no_results)
+    {
+      printf("%-28s %8d B not measured\n", b.Name, b.Size);
+      continue;
+    }
+    double change = (results[i].NsPerByte - b.NsPerByte) * 100 / b.NsPerByte;
+    bool regressed = change > tolerance || results[i].Allocations > b.Allocations;
+    regressions += regressed ? 1 : 0;
+    printf("%-28s %8d B %10.3f %10.3f %+7.1f%% %8.2f %8.2f%s\n", b.Name, b.Size, results[i].NsPerByte, b.NsPerByte, change,
+      results[i].Allocations, b.Allocations, regressed ? "  REGRESSION" : "");
+  }
+  fclose(f);
+  printf("%d regression(s), tolerance %.1f%%\n", regressions, tolerance);
+  return regressions;
+}
+
+// Counts the records of the historic yield
+class CountingSink : public HistoricYieldSink
+{
+  public:
+  
+  uint32_t NoRecords;
+  
+  CountingSink()
+  {
+    NoRecords = 0;
+  }
+  
+  int Records(HistoricInfoItem *records, int no_records)
+  {
+    NoRecords += no_records;
+    return 0;
+  }
+};
+
+// The exchange of a recorded session: logon, yield info and the 5 minute yield of the last days. The protocol 
+// manager is connected already. The days end at the time of the inverter in the yield info, not at the current time:
+// it is part of the recording, so a replay sends the same request (of the same escaped length). Returns 0 on success
+static int BenchExchange(ProtocolManager *pm, uint8_t *password, int days, CountingSink& sink)
+{
+  YieldInfo yi;
+  if (!pm->Logon(password))
+  {
+    printf("Error logging in to SMA inverter\n");
+    return -1;
+  }
+  if (pm->GetYieldInfo(yi) != 0 || yi.TimeStamp == 0 || 
+      pm->GetHistoricYield(yi.TimeStamp - days * 24 * 3600, yi.TimeStamp, sink, false) != 0)
+  {
+    printf("Error reading yield data\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Record a session with the inverter
+static int BenchRecord(Options& options)
+{
+  char description[sizeof(options.RecordFile) + sizeof(options.TransportDescription) + 32];
+  if (options.TransportDescription[0] == 0)
+  {
+    snprintf(description, sizeof(description), "record:%s,rfcomm:%s", options.RecordFile, options.MAC);
+  }
+  else
+  {
+    snprintf(description, sizeof(description), "record:%s,%s", options.RecordFile, options.TransportDescription);
+  }
+  ProtocolManager pm;
+  CountingSink sink;
+  if (pm.Connect(options.MAC, description) != 0)
+  {
+    printf("Error connecting to SMA inverter\n");
+    return -1;
+  }
+  double start = Now();
+  if (BenchExchange(&pm, options.Password, options.Days, sink) != 0)
+  {
+    return -1;
+  }
+  Metrics metrics = pm.GetMetrics();
+  printf("Recorded %s: %u records, %llu bytes received, %llu bytes sent in %.1f ms\n", options.RecordFile, sink.NoRecords, 
+    (unsigned long long) metrics.Counters[METRICS_BYTES_RECEIVED], (unsigned long long) metrics.Counters[METRICS_BYTES_SENT], 
+    (Now() - start) * 1e3);
+  return 0;
+}
+
+// Replay a recorded session Repeat times
+static int BenchReplay(Options& options)
+{
+  // The inverter's MAC address is the source of its first packet (the login ping)
+  SessionReplayTransport *t = new SessionReplayTransport();
+  int length = 0;
+  const uint8_t *first = (t->Open(options.ReplayFile) < 0) ? NULL : t->FirstReceived(&length);
+  char mac[18];
+  if (first == NULL || length < L1_BodyLength)
+  {
+    printf("Error reading session file %s\n", options.ReplayFile);
+    delete t;
+    return -1;
+  }
+  ba2str(&((L1Packet_t *) first)->source, mac);
+  double recorded = t->Duration();
+  delete t;
+  double total = 0;
+  uint64_t bytes = 0;
+  uint32_t records = 0;
+  uint64_t allocated = 0;
+  uint8_t password[13] = "0000";
+  for (int i = 0; i < options.Repeat; i++)
+  {
+    // Loading the file is not part of the measurement
+    t = new SessionReplayTransport();
+    if (t->Open(options.ReplayFile, options.RealTime) < 0)
+    {
+      printf("Error reading session file %s\n", options.ReplayFile);
+      delete t;
+      return -1;
+    }
+    ProtocolManager pm;
+    CountingSink sink;
+    uint64_t allocated_before = allocations;
+    double start = Now();
+    if (pm.Connect(t, mac) != 0)
+    {
+      printf("Error replaying connect\n");
+      return -1;
+    }
+    if (BenchExchange(&pm, password, options.Days, sink) != 0)
+    {
+      return -1;
+    }
+    total += Now() - start;
+    allocated += allocations - allocated_before;
+    bytes += pm.GetMetrics().Counters[METRICS_BYTES_RECEIVED];
+    records += sink.NoRecords;
+  }
+  printf("%-28s %8d x %10.3f ms/session (recorded %.3f ms)\n", "replay session", options.Repeat, total * 1e3 / options.Repeat, recorded * 1e3);
+  Report("replay session", bytes / options.Repeat, total, options.Repeat, allocated, records);
+  return 0;
+}
+
+// Main function
+int main(int argc, char **argv)
+{
+  Options options;
+  if (options.Initialize(argc, argv) < 0)
+  {
+    return -1;
+  }
+  if (options.RecordFile[0] != 0)
+  {
+    return BenchRecord(options);
+  }
+  int status = 0;
+  if (options.ReplayFile[0] != 0)
+  {
+    status = BenchReplay(options);
+  }
+  else
+  {
+    HistoricReply *reply = MakeHistoricReply();
+    status = (BenchCheckSum() && BenchEscape() && BenchPacket(reply) && BenchHistoric(reply) && BenchSeries() && BenchIngest()) ? 0 : -1;
+    delete reply;
+  }
+  if (status == 0 && options.BaselineFile[0] != 0 && !WriteBaseline(options.BaselineFile))
+  {
+    printf("Error writing baseline %s\n", options.BaselineFile);
+    status = -1;
+  }
+  if (status == 0 && options.CompareFile[0] != 0)
+  {
+    int regressions = CompareBaseline(options.CompareFile, options.Tolerance);
+    status = (regressions < 0) ? -1 : (regressions > 0) ? 1 : 0;
+  }
+  return status;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <unistd.h>
+
+// List with long options that we accept
+static struct option long_options[] =
+     {
+       /* These options set a flag. */
+       {"help",     no_argument,       0, '?'},
+       {"record",   required_argument, 0, 'r'},
+       {"replay",   required_argument, 0, 'R'},
+       {"realtime", no_argument,       0, 'T'},
+       {"repeat",   required_argument, 0, 'n'},
+       {"MAC",      required_argument, 0, 'M'},
+       {"password", required_argument, 0, 'p'},
+       {"transport",required_argument, 0, 't'},
+       {"days",     required_argument, 0, 'D'},
+       {"baseline", required_argument, 0, 'B'},
+       {"compare",  required_argument, 0, 'C'},
+       {"tolerance",required_argument, 0, 'X'},
+       {0, 0, 0, 0}
+     };
+
+// Class to process and store options
+class Options
+{
+  public:
+  char RecordFile[1024];
+  char ReplayFile[1024];
+  bool RealTime;
+  int Repeat;
+  char MAC[18];
+  uint8_t Password[13];
+  char TransportDescription[1024];
+  int Days;
+  char BaselineFile[1024];  // write results as JSON
+  char CompareFile[1024];   // compare results with this JSON baseline
+  double Tolerance;         // slow down [%] reported as regression
+
+  int Initialize(int argc, char **argv)
+  {
+    // Clear values, set defaults
+    memset(this, 0, sizeof(Options));
+    Repeat = 100;
+    Days = 7;
+    Tolerance = 10;
+    // Process arguments
+    while (true)
+    {
+      int option_index = 0;
+      int c = getopt_long (argc, argv, "M:p:", long_options, &option_index);
+      // Last option?
+      if (c == -1) break;
+
+      switch (c)
+      {
+        case 'r':
+        case 'R':
+            if (strlen(optarg) > sizeof(RecordFile)-1)
+            {
+              printf("Path to session file is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy((c == 'r') ? RecordFile : ReplayFile, optarg);
+        break;
+        case 'T': RealTime = true; break;
+        case 'n':
+            Repeat = atoi(optarg);
+            if (Repeat <= 0)
+            {
+              printf("Number of replays should be at least 1.\n");
+              return -1;
+            }
+        break;
+        case 'M':
+          if (strlen(optarg) != 17)
+          {
+            printf("MAC address is invalid, 01:23:45:67:89:ab format expected.\n");
+            return -1;
+          }
+          strcpy(MAC, optarg);
+          break;
+        case 'p':
+            if (strlen(optarg) > 12)
+            {
+              printf("Password is more than 12 characters.\n");
+              return -1;
+            }
+            strcpy((char *) Password, optarg);
+        break;
+        case 't':
+            if (strlen(optarg) > sizeof(TransportDescription)-1)
+            {
+              printf("Transport description is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy(TransportDescription, optarg);
+        break;
+        case 'D':
+            Days = atoi(optarg);
+            if (Days <= 0)
+            {
+              printf("Number of days should be at least 1.\n");
+              return -1;
+            }
+        break;
+        case 'B':
+        case 'C':
+            if (strlen(optarg) > sizeof(BaselineFile)-1)
+            {
+              printf("Path to baseline file is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy((c == 'B') ? BaselineFile : CompareFile, optarg);
+        break;
+        case 'X':
+            Tolerance = atof(optarg);
+            if (Tolerance <= 0)
+            {
+              printf("Tolerance should be more than 0%%.\n");
+              return -1;
+            }
+        break;
+        case '?':
+            printf("Usage:\nWithout options: microbenchmarks of the protocol stack\n--record Record a session (logon, yield info, 5 minute yield) with the inverter in this file; needs --MAC and --password\n--replay Replay a recorded session through the protocol stack and report its throughput\nOptional:\n--transport Connect using tcp:host:port or unix:path instead of Bluetooth (--record)\n--days Number of days of 5 minute yield to record, 7 by default\n--repeat Number of replays, 100 by default\n--realtime Replay at the recorded speed instead of as fast as possible\n--baseline Write the microbenchmark results to this JSON file\n--compare Compare the microbenchmark results with this JSON baseline; exit code 1 on a regression\n--tolerance Slow down in %% reported as regression, 10 by default\n");
+            return -1;
+        break;
+      }
+    }
+
+    // Check for required arguments
+    if (RecordFile[0] != 0 && (MAC[0] == 0 || Password[0] == 0))
+    {
+      printf("Password (--password) and/or MAC address (--MAC) missing!\n");
+      return -1;
+    }
+    // Success
+    return 0;
+  }
+};
@@ -0,0 +1,5 @@
+#!/bin/sh
+rm ./sma_bench
+clear
+g++ -O2 $1 -lbluetooth -lsqlite3 L1.cc L2.cc Transport.cc ProtocolManager.cc Metrics.cc TimeSeries.cc YieldStore.cc sma_bench.cc -o sma_bench
+./sma_bench
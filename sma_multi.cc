@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include "PollEngine.h"
+#include "sma_multi.h"
+
+// Print result of an inverter as soon as its poll is done
+void PrintResult(InverterPoll *inverter, void *context)
+{
+  double start = *(double *) context;
+  printf("%s: ", inverter->MAC());
+  switch (inverter->Status)
+  {
+    case 0: 
+      printf("total %u Wh, today %u Wh, time %d", inverter->Yield.Total, inverter->Yield.Today, inverter->Yield.TimeStamp);
+      printf(", %u 5 minute and %u daily records", inverter->Minute5.NoRecords, inverter->Daily.NoRecords);
+    break;
+    case POLL_ERROR_CONNECT: printf("error connecting"); break;
+    case POLL_ERROR_LOGON: printf("error logging in"); break;
+    case POLL_ERROR_TIMEOUT: printf("time-out"); break;
+    default: printf("error %d", inverter->Status); break;
+  }
+  printf(" (%.1f ms, done after %.1f ms, rtt %.1f ms)\n", (inverter->Finished - inverter->Started) * 1e3, 
+    (inverter->Finished - start) * 1e3, inverter->RoundTripTime() * 1e3);
+  fflush(stdout);
+}
+
+// Main function
+int main(int argc, char **argv)
+{
+    // Read options
+    Options options;
+    if (options.Initialize(argc, argv) < 0)
+    {
+      return -1;
+    }
+    // One poll per inverter, all driven by a single engine
+    PollEngine engine;
+    InverterPoll *inverters[MAX_INVERTERS];
+    time_t now = time(NULL);
+    for (int i = 0; i < options.NoInverters; i++)
+    {
+      inverters[i] = new InverterPoll(options.MAC[i], options.Password, options.TransportDescription[i]);
+      inverters[i]->SetTimeLimit(options.TimeOut);
+      if (options.Minute5Yield)
+      {
+        inverters[i]->RequestHistoric(now - options.Days * 24 * 3600, now, false);
+      }
+      if (options.DailyYield)
+      {
+        inverters[i]->RequestHistoric(now - options.Days * 24 * 3600, now, true);
+      }
+      if (!engine.Add(inverters[i]))
+      {
+        printf("At most %d inverters.\n", POLL_MAX_INVERTERS);
+        for (int j = 0; j <= i; j++)
+        {
+          delete inverters[j];
+        }
+        return -1;
+      }
+    }
+    double start = TimeNow();
+    int succeeded = engine.Run(PrintResult, &start);
+    printf("%d of %d inverters polled in %.1f ms\n", (succeeded < 0) ? 0 : succeeded, options.NoInverters, (TimeNow() - start) * 1e3);
+    if (options.MetricsFile[0] != 0)
+    {
+      Metrics *metrics[MAX_INVERTERS];
+      for (int i = 0; i < options.NoInverters; i++)
+      {
+        metrics[i] = &inverters[i]->Stats;
+      }
+      if (!Metrics::Write(options.MetricsFile, metrics, options.NoInverters))
+      {
+        printf("Error writing metrics to %s\n", options.MetricsFile);
+      }
+    }
+    for (int i = 0; i < options.NoInverters; i++)
+    {
+      delete inverters[i];
+    }
+    return (succeeded == options.NoInverters) ? 0 : -1;
+}
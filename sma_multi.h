@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <unistd.h>
+
+// Maximum number of inverters on the command line
+#define MAX_INVERTERS   64
+
+// List with long options that we accept
+static struct option long_options[] =
+     {
+       /* These options set a flag. */
+       {"help",     no_argument,       0, '?'},
+       {"daily",    no_argument,       0, 'd'},
+       {"5minute",  no_argument,       0, '5'},
+       {"inverter", required_argument, 0, 'i'},
+       {"password", required_argument, 0, 'p'},
+       {"days",     required_argument, 0, 'D'},
+       {"timeout",  required_argument, 0, 'T'},
+       {"metrics",  required_argument, 0, 'm'},
+       {0, 0, 0, 0}
+     };
+
+// Class to process and store options
+class Options
+{
+  public:  
+  bool DailyYield;
+  bool Minute5Yield;
+  int Days;
+  int TimeOut;
+  uint8_t Password[13]; 
+  // Inverters: MAC address and (optional) transport
+  int NoInverters;
+  char MAC[MAX_INVERTERS][18];
+  char TransportDescription[MAX_INVERTERS][1024];
+  char MetricsFile[1024];
+  
+  int Initialize(int argc, char **argv)
+  {
+    // Clear values, set defaults
+    memset(this, 0, sizeof(Options));
+    Days = 1;
+    TimeOut = POLL_TIME_LIMIT;
+    // Process arguments
+    while (true)
+    {
+      int option_index = 0;
+      int c = getopt_long (argc, argv, "d5i:p:", long_options, &option_index);
+      // Last option?    
+      if (c == -1) break;
+     
+      switch (c)
+      {
+        case 'd': DailyYield = true; break;
+        case '5': Minute5Yield = true; break;                    
+        case 'i':
+          // MAC address, optionally followed by ,transport
+          if (NoInverters == MAX_INVERTERS)
+          {
+            printf("At most %d inverters.\n", MAX_INVERTERS);
+            return -1;
+          }
+          if (strlen(optarg) < 17 || (optarg[17] != 0 && optarg[17] != ',') || strlen(optarg) > 17 + sizeof(TransportDescription[0]))
+          {
+            printf("Inverter is invalid, 01:23:45:67:89:ab or 01:23:45:67:89:ab,tcp:host:port format expected.\n");
+            return -1;
+          }
+          memcpy(MAC[NoInverters], optarg, 17);
+          if (optarg[17] == ',')
+          {
+            strcpy(TransportDescription[NoInverters], optarg + 18);
+          }
+          NoInverters++;
+          break;
+        case 'p':
+            if (strlen(optarg) > 12)
+            {
+              printf("Password is more than 12 characters.\n");
+              return -1;
+            }
+            strcpy((char *) Password, optarg);
+        break;
+        case 'D':
+            Days = atoi(optarg);
+            if (Days <= 0)
+            {
+              printf("Number of days should be at least 1.\n");
+              return -1;
+            }
+        break;
+        case 'T':
+            TimeOut = atoi(optarg);
+            if (TimeOut <= 0)
+            {
+              printf("Time-out should be at least 1 s.\n");
+              return -1;
+            }
+        break;
+        case 'm':
+            if (strlen(optarg) > sizeof(MetricsFile)-1)
+            {
+              printf("Path to metrics file is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy(MetricsFile, optarg);
+        break;
+        case '?':
+            printf("Usage:\n--inverter MAC address of SMA inverter, optionally followed by ,transport (e.g. 01:23:45:67:89:ab,tcp:host:port); repeat for every inverter\n--password Password (same for all inverters)\nOptional:\n--daily Get daily yields\n--5minute Get 5 minute yields\n--days Number of days of historic yields, 1 by default\n--timeout Maximum duration of the poll of an inverter in seconds, 300 by default\n--metrics Write counters and latencies per inverter to this file (Prometheus text format when it ends in .prom, JSON otherwise)\n");
+            return -1;
+        break;
+      }
+    }
+    
+    // Check for required arguments
+    if (NoInverters == 0 || Password[0] == 0)
+    {
+      printf("Password (--password) and/or inverter (--inverter) missing!\n");
+      return -1;
+    }
+    // Success
+    return 0;
+  }  
+};
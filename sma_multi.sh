@@ -0,0 +1,5 @@
+#!/bin/sh
+rm ./sma_multi
+clear
+g++ $1 -lbluetooth L1.cc L2.cc Transport.cc ProtocolManager.cc Metrics.cc PollEngine.cc sma_multi.cc -o sma_multi
+./sma_multi --password 0000 --inverter 00:00:00:00:00:00 --inverter 00:00:00:00:00:01
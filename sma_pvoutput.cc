@@ -15,7 +15,7 @@
 
 using namespace std;
 
-#define EXIT_ERR(a)       { printf(a); if (pm != NULL) { pm->Close(); }; return -1; }
+#define EXIT_ERR(a)       { printf(a); WriteMetrics(&options, pm, &sink_metrics); delete pm; if (curl != NULL) { curl_easy_cleanup(curl); curl_global_cleanup(); }; return -1; }
 #define GETSTATUS         "http://pvoutput.org/service/r2/getstatus.jsp"
 #define ADDBATCHSTATUS    "http://pvoutput.org/service/r2/addbatchstatus.jsp"
 
@@ -30,6 +30,22 @@ size_t store_curl_data(void *buffer, size_t size, size_t nmemb, void *userp)
   return size*nmemb;
 }
 
+// Write metrics of the inverter exchanges and the uploads, if requested
+void WriteMetrics(Options *options, ProtocolManager *pm, Metrics *sink_metrics)
+{
+  if (options->MetricsFile[0] == 0 || pm == NULL)
+  {
+    return;
+  }
+  Metrics metrics = pm->GetMetrics();
+  Metrics *list[1] = { &metrics };
+  metrics.Add(*sink_metrics);
+  if (!Metrics::Write(options->MetricsFile, list, 1))
+  {
+    printf("Error writing metrics to %s\n", options->MetricsFile);
+  }
+}
+
 // Get timestamp of latest addition to PVOutput.org
 time_t GetTimeStamp(CURL *curl, Options *options)
 {
@@ -74,9 +90,11 @@ time_t GetTimeStamp(CURL *curl, Options *options)
 // Main function
 int main(int argc, char **argv)
 {
-    CURL *curl;
+    CURL *curl = NULL;
     Options options;
-    ProtocolManager *pm;    
+    ProtocolManager *pm = NULL;    
+    // Time spent on HTTP requests
+    Metrics sink_metrics;
     // Read options    
     if (options.Initialize(argc, argv) < 0)
     {
@@ -85,7 +103,7 @@ int main(int argc, char **argv)
     // Start protocol manager    
     pm = new ProtocolManager();    
     // Connect
-    if (pm->Connect(options.MAC))
+    if (pm->Connect(options.MAC, options.TransportDescription))
     {
       EXIT_ERR("Error connecting to SMA inverter\n");      
     }
@@ -111,7 +129,9 @@ int main(int argc, char **argv)
     // Get timestamp round down to 5 minutes -> latest available timestamp
     time_t current_time = ((uint32_t)(yi.TimeStamp / 300)) * 300;    
     // Get timestamp of latest upload to pvoutput
+    double start = TimeNow();
     time_t latest_upload = GetTimeStamp(curl, &options);
+    sink_metrics.Latency(METRICS_SINK, TimeNow() - start);
     if (latest_upload < 0)
     {
       EXIT_ERR("Error getting timestamp of latest live upload from PVOutput.org.\n");
@@ -137,17 +157,20 @@ printf( "%d records retrieved\n", hi.NoRecords);
       get_query << "?sid=" << options.SystemID << "&key=" << options.APIKey;
       // Add data part (cumulative energy)
       get_query << "&c1=1&data=" << setfill('0');
+      const int32_t *timestamps = hi.TimeStamps();
+      const uint32_t *values = hi.Values();
       for (int i = 1; i < hi.NoRecords && i <= options.BatchMaximum; i++)
       {
         // Convert timestamp to local time, add to get_query
-        struct tm* ti = localtime((time_t *) &hi.Records[i].TimeStamp);
+        time_t timestamp = timestamps[i];
+        struct tm* ti = localtime(&timestamp);
         get_query << setw(4) << (1900+ti->tm_year) << setw(2) << (1+ti->tm_mon) << setw(2) << ti->tm_mday << ',';
         get_query << setw(2) << ti->tm_hour << ':' << setw(2) << ti->tm_min << ',';
         // Add Wh produced to get_query
-        time_t dt = hi.Records[i].TimeStamp - hi.Records[i-1].TimeStamp;
-        int Wh = hi.Records[i].Value - hi.Records[i-1].Value;
+        time_t dt = timestamps[i] - timestamps[i-1];
+        int Wh = values[i] - values[i-1];
         int power = (int) round((double) Wh * 3600.0/(double)dt);
-        get_query << hi.Records[i].Value << ',' << power << ';';
+        get_query << values[i] << ',' << power << ';';
       }       
 #ifdef __DEBUG__
 printf("%s\n", get_query.str().c_str());
@@ -160,10 +183,13 @@ printf("%s\n", get_query.str().c_str());
       curl_easy_setopt(curl, CURLOPT_FAILONERROR, 0);
       curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, store_curl_data); 
       curl_easy_setopt(curl, CURLOPT_WRITEDATA, &post_result);      
+      start = TimeNow();
       int result = curl_easy_perform(curl);      
+      sink_metrics.Latency(METRICS_SINK, TimeNow() - start);
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
 	    curl_easy_cleanup(curl);      
       curl_global_cleanup();
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+      curl = NULL;
       if (result != 0 || response_code != 200)
       { // Post went wrong: show message
         printf("%s\n", post_result.c_str());
@@ -174,9 +200,15 @@ printf("%s\n", get_query.str().c_str());
         printf("Could not upload all data due to batch limits; %d intervals remaining.\n", (hi.NoRecords-1) - options.BatchMaximum);
       }
     }    
-    free(hi.Records);          
-    // Close bluetooth connection (@@@ not closed wen exiting in error)
-    pm->Close();
+    // Nothing uploaded: CURL session still open
+    if (curl != NULL)
+    {
+      curl_easy_cleanup(curl);
+      curl_global_cleanup();
+    }
+    WriteMetrics(&options, pm, &sink_metrics);
+    // Close bluetooth connection
+    delete pm;
     // Success!
     return 0;
 }
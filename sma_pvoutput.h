@@ -8,10 +8,12 @@ static struct option long_options[] =
        {"help",     no_argument,       0, '?'},
        {"MAC",      required_argument, 0, 'M'},
        {"password", required_argument, 0, 'p'},
+       {"transport",required_argument, 0, 't'},
        {"api_key",  required_argument, 0, 'a'},
        {"sid",      required_argument, 0, 's'},
        {"batch_max",required_argument, 0, 'b'},
        {"days_max", required_argument, 0, 'd'},
+       {"metrics",  required_argument, 0, 'm'},
        {0, 0, 0, 0}
      };
 
@@ -21,8 +23,10 @@ class Options
   public:  
   char MAC[18];
   uint8_t Password[13]; 
+  char TransportDescription[1024];
   char APIKey[1024];
   char SystemID[1024];
+  char MetricsFile[1024];
   int BatchMaximum;
   int DaysMaximum;
   
@@ -80,8 +84,24 @@ class Options
         case 'd':
           DaysMaximum = atoi(optarg);
         break;           
+        case 't':
+            if (strlen(optarg) > sizeof(TransportDescription)-1)
+            {
+              printf("Transport description is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy(TransportDescription, optarg);
+        break;
+        case 'm':
+            if (strlen(optarg) > sizeof(MetricsFile)-1)
+            {
+              printf("Path to metrics file is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy(MetricsFile, optarg);
+        break;
         case '?':
-            printf("Usage:\n--MAC MAC address of SMA inverter\n--password Password\n--api_key API key set in pvoutput settings\n--sid System ID as known by pvoutput\nOptional:\n--batch_max Maximum number of entries in an upload (30)\n--days_max Maximum number of days in the past that will be uploaded (12).");
+            printf("Usage:\n--MAC MAC address of SMA inverter\n--password Password\n--api_key API key set in pvoutput settings\n--sid System ID as known by pvoutput\nOptional:\n--batch_max Maximum number of entries in an upload (30)\n--days_max Maximum number of days in the past that will be uploaded (12).\n--transport Connect using tcp:host:port, unix:path, or replay:file instead of Bluetooth\n--metrics Write counters and latencies to this file at the end of the run (Prometheus text format when it ends in .prom, JSON otherwise)\n");
             return -1;
         break;
       }
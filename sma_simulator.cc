@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include "ProtocolManager.h"
+#include "sma_simulator.h"
+
+// Simulator of SMA inverters for load and latency tests. Speaks L1/L2 over TCP or Unix sockets: login ping and
+// Login_3 handshake, logon, yield info, spot values and historic 5 minute/daily yield, from a synthetic generation
+// curve. Every connection is served by its own process.
+
+#define SIM_RECORDS_PER_TELEGRAM      60        // historic records per reply telegram
+#define SIM_CLIENT_MAC                "00:1A:7D:DA:71:13"     // MAC address reported to the client in Login_3
+
+// Simulated inverter: MAC address and start of its history
+typedef struct
+{
+  bdaddr_t mac;
+  int32_t installed;
+} Inverter;
+
+// One connection with a client
+typedef struct
+{
+  Transport *t;
+  Inverter *inverter;
+  Options *options;
+  bdaddr_t client;
+  unsigned int random;    // state of rand_r
+} Connection;
+
+// Random number 0...1
+static double Random(Connection& c)
+{
+  return rand_r(&c.random) / (RAND_MAX + 1.0);
+}
+
+// Synthetic generation: half a sine between 6:00 and 18:00 (UTC), peak at noon [W]
+static double Power(Options *options, int32_t t)
+{
+  double hour = (t % 86400) / 3600.0;
+  return (hour <= 6 || hour >= 18) ? 0 : options->PeakPower * sin(M_PI * (hour - 6) / 12);
+}
+
+// Energy produced from 1970 until t: integral of Power [Wh]
+static double Energy(Options *options, int32_t t)
+{
+  double hour = (t % 86400) / 3600.0;
+  double day = options->PeakPower * 24 / M_PI;
+  double today = (hour <= 6) ? 0 : (hour >= 18) ? day : options->PeakPower * 12 / M_PI * (1 - cos(M_PI * (hour - 6) / 12));
+  return (t / 86400) * day + today;
+}
+
+// Total yield counter of the inverter at t [Wh]
+static uint32_t Total(Connection& c, int32_t t)
+{
+  return (t <= c.inverter->installed) ? 0 : (uint32_t) (Energy(c.options, t) - Energy(c.options, c.inverter->installed));
+}
+
+// Send L1 packet from the inverter to the client
+static bool SendL1(Connection& c, uint16_t command, bdaddr_t *destination, uint8_t *data, int length)
+{
+  L1Packet packet(&c.inverter->mac, destination, command);
+  return packet.Send(c.t, data, length);
+}
+
+// Send reply telegram to request: escaped L2 packet in L1 packets of at most Fragment data bytes
+static bool SendReply(Connection& c, L2PacketHeader *request, uint16_t telegram_number, const uint8_t *data, int data_length)
+{
+  static uint8_t packet[L2_MaxReplyLength(L2_MaxReceiveLength)];
+  // Reply from the inverter to the client
+  L2Packet reply;
+  reply.header = *request;
+  reply.header.head = L2_head;
+  reply.header.destination_prefix = request->source_prefix;
+  memcpy(reply.header.destination, request->source, sizeof(reply.header.destination));
+  reply.header.source_prefix = request->destination_prefix;
+  memcpy(reply.header.source, request->destination, sizeof(reply.header.source));
+  reply.header.telegram_number = htons(telegram_number);
+  int length = reply.PrepareReply(packet, data, data_length, (Random(c) < c.options->CorruptRate) ? 0x5555 : 0);
+  for (int offset = 0; offset < length; offset += c.options->Fragment)
+  {
+    int part = (length - offset > c.options->Fragment) ? c.options->Fragment : (length - offset);
+    uint16_t command = (offset + part == length) ? L1_Command_L2_Packet : L1_Command_L2_PacketPart;
+    if (!SendL1(c, command, &c.client, packet + offset, part))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Requested range of value codes
+static bool InRange(const uint8_t *data, int data_length, uint16_t code)
+{
+  if (data_length < (int) sizeof(L2_data_value_range))
+  {
+    return false;
+  }
+  L2_data_value_range *range = (L2_data_value_range *) data;
+  return code >= (btohl(range->first) >> 8) && code <= (btohl(range->last) >> 8);
+}
+
+// Yield info: counters in the requested range
+static bool ReplyYieldInfo(Connection& c, L2PacketHeader *request, uint8_t *data, int data_length)
+{
+  uint8_t reply[sizeof(_FrameInfo) + 4 * sizeof(_ValueInfo)];
+  _ValueInfo *vi = (_ValueInfo *) (reply + sizeof(_FrameInfo));
+  int32_t now = time(NULL);
+  int32_t midnight = now - now % 86400;
+  uint32_t total = Total(c, now);
+  uint32_t operating = (now > c.inverter->installed) ? (now - c.inverter->installed) : 0;
+  struct { uint16_t code; uint32_t value; } counters[4] =
+  {
+    { 0x2601, total },
+    { 0x2622, total - Total(c, midnight) },
+    { 0x462E, operating },
+    { 0x462F, operating / 2 }
+  };
+  int n = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    if (InRange(data, data_length, counters[i].code))
+    {
+      memset(&vi[n], 0, sizeof(_ValueInfo));
+      vi[n].one = 1;
+      vi[n].code = htobs(counters[i].code);
+      vi[n].timestamp = htobl(now);
+      vi[n].value = htobl(counters[i].value);
+      n++;
+    }
+  }
+  _FrameInfo fi = { htobl(0), htobl((uint32_t) (n - 1)) };
+  memcpy(reply, &fi, sizeof(fi));
+  return SendReply(c, request, 0, reply, sizeof(_FrameInfo) + n * sizeof(_ValueInfo));
+}
+
+// Spot values in the requested range: single phase, two strings
+static bool ReplySpotValues(Connection& c, L2PacketHeader *request, uint8_t *data, int data_length)
+{
+  uint8_t reply[sizeof(_FrameInfo) + 16 * sizeof(_SpotValueInfo)];
+  _SpotValueInfo *vi = (_SpotValueInfo *) (reply + sizeof(_FrameInfo));
+  int32_t now = time(NULL);
+  int32_t power = (int32_t) Power(c.options, now);
+  int32_t dc_power = power * 52 / 100;
+  int32_t dc_voltage = (power > 0) ? 30000 + 8000 * power / c.options->PeakPower : 0;
+  struct { uint16_t code; uint8_t index; int32_t value; } values[] =
+  {
+    { 0x263F, 0, power },
+    { 0x4640, 1, power },
+    { 0x4648, 1, 23000 },
+    { 0x4653, 1, power * 1000 / 230 },
+    { 0x4657, 0, 5000 },
+    { 0x2377, 0, 2500 + 2000 * power / c.options->PeakPower },
+    { 0x251E, 1, dc_power },
+    { 0x251E, 2, dc_power },
+    { 0x451F, 1, dc_voltage },
+    { 0x451F, 2, dc_voltage },
+    { 0x4521, 1, (dc_voltage > 0) ? (int32_t) (dc_power * 100000LL / dc_voltage) : 0 },
+    { 0x4521, 2, (dc_voltage > 0) ? (int32_t) (dc_power * 100000LL / dc_voltage) : 0 }
+  };
+  int n = 0;
+  for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+  {
+    if (InRange(data, data_length, values[i].code))
+    {
+      memset(&vi[n], 0, sizeof(_SpotValueInfo));
+      vi[n].index = values[i].index;
+      vi[n].code = htobs(values[i].code);
+      vi[n].type = 0x40;
+      vi[n].timestamp = htobl(now);
+      vi[n].value = htobl(values[i].value);
+      n++;
+    }
+  }
+  _FrameInfo fi = { htobl(0), htobl((uint32_t) (n - 1)) };
+  memcpy(reply, &fi, sizeof(fi));
+  return SendReply(c, request, 0, reply, sizeof(_FrameInfo) + n * sizeof(_SpotValueInfo));
+}
+
+// Historic yield between the requested timestamps, SIM_RECORDS_PER_TELEGRAM records per telegram
+static bool ReplyHistoricYield(Connection& c, L2PacketHeader *request, uint8_t *data, int data_length, int32_t interval)
+{
+  uint8_t reply[sizeof(_FrameInfo) + SIM_RECORDS_PER_TELEGRAM * sizeof(_HistoricYieldInfo)];
+  _HistoricYieldInfo *hi = (_HistoricYieldInfo *) (reply + sizeof(_FrameInfo));
+  if (data_length != sizeof(L2_data_historic_yield))
+  {
+    return true;
+  }
+  int32_t from = btohl(((L2_data_historic_yield *) data)->timestamp_from);
+  int32_t to = btohl(((L2_data_historic_yield *) data)->timestamp_to);
+  int32_t now = time(NULL);
+  from = (from < c.inverter->installed) ? c.inverter->installed : from;
+  to = (to > now) ? now : to;
+  // Records at multiples of the interval
+  int32_t first = ((from + interval - 1) / interval) * interval;
+  int no_records = (to >= first) ? (to - first) / interval + 1 : 0;
+  int no_telegrams = (no_records + SIM_RECORDS_PER_TELEGRAM - 1) / SIM_RECORDS_PER_TELEGRAM;
+  no_telegrams = (no_telegrams == 0) ? 1 : no_telegrams;
+  for (int telegram = 0, record = 0; telegram < no_telegrams; telegram++)
+  {
+    int n = (no_records - record > SIM_RECORDS_PER_TELEGRAM) ? SIM_RECORDS_PER_TELEGRAM : (no_records - record);
+    _FrameInfo fi = { htobl(record), htobl((uint32_t) (record + n - 1)) };
+    memcpy(reply, &fi, sizeof(fi));
+    for (int i = 0; i < n; i++)
+    {
+      int32_t timestamp = first + (record + i) * interval;
+      hi[i].timestamp = htobl(timestamp);
+      hi[i].value = htobl(Total(c, timestamp));
+      hi[i].fill = 0;
+    }
+    record += n;
+    // The last telegram has number 0
+    if (!SendReply(c, request, no_telegrams - 1 - telegram, reply, sizeof(_FrameInfo) + n * sizeof(_HistoricYieldInfo)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Handle L2 request. Returns false when the connection failed
+static bool Request(Connection& c, L2PacketHeader *request, uint8_t *data, int data_length)
+{
+  uint8_t *command = request->command;
+  uint8_t empty[8] = { 0 };
+  // login_2 has no reply; unknown requests are ignored
+  bool known = !memcmp(command, L2_command_login_1, 5) || !memcmp(command, L2_command_logon, 5) ||
+               !memcmp(command, L2_command_daily_yield, 5) || !memcmp(command, L2_command_spot_ac, 5) ||
+               !memcmp(command, L2_command_spot_status, 5) || !memcmp(command, L2_command_spot_dc, 5) ||
+               !memcmp(command, L2_command_historic_yield_5, 5) || !memcmp(command, L2_command_historic_yield_daily, 5);
+  if (!known || Random(c) < c.options->DropRate)
+  {
+    return true;
+  }
+  double latency = c.options->Latency + c.options->Jitter * (2 * Random(c) - 1);
+  if (latency > 0)
+  {
+    usleep((useconds_t) (latency * 1e6));
+  }
+  if (!memcmp(command, L2_command_login_1, 5) || !memcmp(command, L2_command_logon, 5))
+  {
+    return SendReply(c, request, 0, empty, sizeof(empty));
+  }
+  if (!memcmp(command, L2_command_daily_yield, 5))
+  {
+    return ReplyYieldInfo(c, request, data, data_length);
+  }
+  if (!memcmp(command, L2_command_historic_yield_5, 5) || !memcmp(command, L2_command_historic_yield_daily, 5))
+  {
+    return ReplyHistoricYield(c, request, data, data_length, !memcmp(command, L2_command_historic_yield_5, 5) ? 300 : 86400);
+  }
+  return ReplySpotValues(c, request, data, data_length);
+}
+
+// Serve one client: handshake, then answer requests until the client disconnects
+static void Serve(int fd, Inverter *inverter, Options *options, unsigned int seed)
+{
+  SocketTransport t(fd);
+  L1Reader reader;
+  L1Packet packet;
+  L2Packet l2;
+  uint8_t request[L2_MaxPacketLength];
+  int request_length = 0;
+  Connection c;
+  bdaddr_t empty_mac;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  memset(&empty_mac, 0, sizeof(bdaddr_t));
+  c.t = &t;
+  c.inverter = inverter;
+  c.options = options;
+  c.random = seed;
+  str2ba(SIM_CLIENT_MAC, &c.client);
+  reader.Attach(&t);
+  // Login ping; the client answers with the same data
+  uint8_t ping[13] = { 0x00, 0x04, 0x70, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 };
+  if (!SendL1(c, L1_Command_LoginPing, &empty_mac, ping, sizeof(ping)) || !packet.Read(&reader) ||
+      packet.Command() != L1_Command_LoginPing)
+  {
+    return;
+  }
+  // Login_1, Login_2 and Login_3 with both MAC addresses
+  L1Login3Data_t login_3;
+  memset(&login_3, 0, sizeof(login_3));
+  login_3.sma = inverter->mac;
+  login_3.us = c.client;
+  if (!SendL1(c, L1_Command_Login_1, &empty_mac, NULL, 0) || !SendL1(c, L1_Command_Login_2, &empty_mac, NULL, 0) ||
+      !SendL1(c, L1_Command_Login_3, &empty_mac, (uint8_t *) &login_3, sizeof(login_3)))
+  {
+    return;
+  }
+  while (packet.Read(&reader))
+  {
+    switch (packet.Command())
+    {
+      case L1_Command_RequestForInfo:
+      {
+        L1BluetoothStrengthData_t strength;
+        memset(&strength, 0, sizeof(strength));
+        strength.request_no = htobs(L1_Request_BluetoothStrength);
+        strength.strength = htobs(200);
+        if (!SendL1(c, L1_Command_ResponseToRequest, &c.client, (uint8_t *) &strength, sizeof(strength)))
+        {
+          return;
+        }
+      }
+      break;
+      case L1_Command_L2_PacketPart:
+      case L1_Command_L2_Packet:
+      {
+        // Collect the parts of the request
+        if (request_length + packet.DataLength() > (int) sizeof(request))
+        {
+          request_length = -1;
+        }
+        if (request_length >= 0)
+        {
+          memcpy(request + request_length, packet.Data(), packet.DataLength());
+          request_length += packet.DataLength();
+        }
+        if (packet.Command() == L1_Command_L2_PacketPart)
+        {
+          break;
+        }
+        int data_length = (request_length < 0) ? ERR_SMA_INVALID_PACKET : l2.ReadRequest(request, request_length);
+        request_length = 0;
+        // Requests with a bad checksum are dropped, like a real inverter does
+        if (data_length >= 0 && !Request(c, &l2.header, request, data_length))
+        {
+          return;
+        }
+      }
+      break;
+    }
+  }
+}
+
+// Listen on TCP port; returns socket or < 0 on error
+static int ListenTCP(const char *host, int port)
+{
+  struct addrinfo hints, *addresses;
+  char service[16];
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  snprintf(service, sizeof(service), "%d", port);
+  if (getaddrinfo(host, service, &hints, &addresses) != 0)
+  {
+    return -1;
+  }
+  int s = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+  int one = 1;
+  if (s >= 0 && (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+                 bind(s, addresses->ai_addr, addresses->ai_addrlen) < 0 || listen(s, 64) < 0))
+  {
+    close(s);
+    s = -1;
+  }
+  freeaddrinfo(addresses);
+  return s;
+}
+
+// Listen on Unix socket; returns socket or < 0 on error
+static int ListenUnix(const char *path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path))
+  {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  unlink(path);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s >= 0 && (bind(s, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(s, 64) < 0))
+  {
+    close(s);
+    s = -1;
+  }
+  return s;
+}
+
+// Main function
+int main(int argc, char **argv)
+{
+    Options options;
+    if (options.Initialize(argc, argv) < 0)
+    {
+      return -1;
+    }
+    // Inverters: MAC addresses count up from the given one, history starts at midnight
+    Inverter inverters[MAX_INVERTERS];
+    bdaddr_t mac;
+    str2ba(options.MAC, &mac);
+    int32_t now = time(NULL);
+    for (int i = 0; i < options.NoInverters; i++)
+    {
+      inverters[i].mac = mac;
+      // bdaddr_t is little endian: b[0] is the last byte of the text form
+      for (int b = 0, carry = i; b < 6 && carry > 0; b++)
+      {
+        carry += inverters[i].mac.b[b];
+        inverters[i].mac.b[b] = (uint8_t) carry;
+        carry >>= 8;
+      }
+      inverters[i].installed = now - now % 86400 - options.HistoryDays * 86400;
+    }
+    // Listening sockets: per inverter a TCP port and/or Unix socket
+    struct pollfd listeners[2 * MAX_INVERTERS];
+    int owner[2 * MAX_INVERTERS];
+    int no_listeners = 0;
+    for (int i = 0; i < options.NoInverters; i++)
+    {
+      char name[1100];
+      if (options.Port != 0)
+      {
+        snprintf(name, sizeof(name), "%s:%d", options.Host, options.Port + i);
+        listeners[no_listeners].fd = ListenTCP(options.Host, options.Port + i);
+      }
+      if (options.Port != 0 && listeners[no_listeners].fd < 0)
+      {
+        printf("Error listening on %s\n", name);
+        return -1;
+      }
+      owner[no_listeners] = i;
+      no_listeners += (options.Port != 0) ? 1 : 0;
+      if (options.SocketPath[0] != 0)
+      {
+        snprintf(name, sizeof(name), "%s.%d", options.SocketPath, i);
+        listeners[no_listeners].fd = ListenUnix(name);
+        if (listeners[no_listeners].fd < 0)
+        {
+          printf("Error listening on %s\n", name);
+          return -1;
+        }
+        owner[no_listeners++] = i;
+      }
+    }
+    for (int i = 0; i < no_listeners; i++)
+    {
+      listeners[i].events = POLLIN;
+    }
+    printf("Simulating %d inverter(s) from %s\n", options.NoInverters, options.MAC);
+    fflush(stdout);
+    // Serve every connection in its own process
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    for (unsigned int connection = 0; ; )
+    {
+      if (poll(listeners, no_listeners, -1) < 0 && errno != EINTR)
+      {
+        return -1;
+      }
+      for (int i = 0; i < no_listeners; i++)
+      {
+        if ((listeners[i].revents & POLLIN) == 0)
+        {
+          continue;
+        }
+        int fd = accept(listeners[i].fd, NULL, NULL);
+        if (fd < 0)
+        {
+          continue;
+        }
+        connection++;
+        if (fork() == 0)
+        {
+          for (int l = 0; l < no_listeners; l++)
+          {
+            close(listeners[l].fd);
+          }
+          Serve(fd, &inverters[owner[i]], &options, options.Seed + connection * 7919);
+          _exit(0);
+        }
+        close(fd);
+      }
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <unistd.h>
+
+// Maximum number of simulated inverters
+#define MAX_INVERTERS   256
+
+// List with long options that we accept
+static struct option long_options[] =
+     {
+       /* These options set a flag. */
+       {"help",     no_argument,       0, '?'},
+       {"tcp",      required_argument, 0, 't'},
+       {"unix",     required_argument, 0, 'u'},
+       {"inverters",required_argument, 0, 'n'},
+       {"MAC",      required_argument, 0, 'M'},
+       {"peak",     required_argument, 0, 'P'},
+       {"history",  required_argument, 0, 'H'},
+       {"fragment", required_argument, 0, 'f'},
+       {"latency",  required_argument, 0, 'l'},
+       {"jitter",   required_argument, 0, 'j'},
+       {"drop",     required_argument, 0, 'd'},
+       {"corrupt",  required_argument, 0, 'c'},
+       {"seed",     required_argument, 0, 's'},
+       {0, 0, 0, 0}
+     };
+
+// Class to process and store options
+class Options
+{
+  public:
+  int Port;                 // first TCP port, 0: none
+  char Host[256];
+  char SocketPath[1024];    // Unix socket path (prefix), empty: none
+  int NoInverters;
+  char MAC[18];             // MAC address of the first inverter
+  int PeakPower;            // [W]
+  int HistoryDays;          // history starts this many days ago
+  int Fragment;             // maximum data bytes per L1 packet
+  double Latency;           // reply latency [s]
+  double Jitter;            // reply latency varies +/- this much [s]
+  double DropRate;          // fraction of replies dropped
+  double CorruptRate;       // fraction of telegrams sent with a bad checksum
+  unsigned int Seed;
+
+  int Initialize(int argc, char **argv)
+  {
+    // Clear values, set defaults
+    memset(this, 0, sizeof(Options));
+    strcpy(Host, "127.0.0.1");
+    strcpy(MAC, "00:80:25:00:00:01");
+    NoInverters = 1;
+    PeakPower = 5000;
+    HistoryDays = 365;
+    Fragment = L1_MaxDataLength;
+    Seed = 1;
+    // Process arguments
+    while (true)
+    {
+      int option_index = 0;
+      int c = getopt_long (argc, argv, "t:u:n:M:", long_options, &option_index);
+      // Last option?
+      if (c == -1) break;
+
+      switch (c)
+      {
+        case 't':
+        {
+          // [host:]port
+          const char *port = strrchr(optarg, ':');
+          if (port != NULL)
+          {
+            if ((port - optarg) >= (int) sizeof(Host))
+            {
+              printf("Host name is too long.\n");
+              return -1;
+            }
+            memcpy(Host, optarg, port - optarg);
+            Host[port - optarg] = 0;
+          }
+          Port = atoi((port == NULL) ? optarg : (port + 1));
+          if (Port <= 0 || Port > 65535)
+          {
+            printf("TCP port is invalid.\n");
+            return -1;
+          }
+        }
+        break;
+        case 'u':
+            if (strlen(optarg) > sizeof(SocketPath)-8)
+            {
+              printf("Unix socket path is too long.\n");
+              return -1;
+            }
+            strcpy(SocketPath, optarg);
+        break;
+        case 'n':
+            NoInverters = atoi(optarg);
+            if (NoInverters <= 0 || NoInverters > MAX_INVERTERS)
+            {
+              printf("Number of inverters should be 1...%d.\n", MAX_INVERTERS);
+              return -1;
+            }
+        break;
+        case 'M':
+          if (strlen(optarg) != 17)
+          {
+            printf("MAC address is invalid, 01:23:45:67:89:ab format expected.\n");
+            return -1;
+          }
+          strcpy(MAC, optarg);
+          break;
+        case 'P': PeakPower = atoi(optarg); break;
+        case 'H': HistoryDays = atoi(optarg); break;
+        case 'f':
+            Fragment = atoi(optarg);
+            if (Fragment <= 0 || Fragment > L1_MaxDataLength)
+            {
+              printf("Fragment size should be 1...%d bytes.\n", L1_MaxDataLength);
+              return -1;
+            }
+        break;
+        case 'l': Latency = atof(optarg) / 1000; break;
+        case 'j': Jitter = atof(optarg) / 1000; break;
+        case 'd': DropRate = atof(optarg) / 100; break;
+        case 'c': CorruptRate = atof(optarg) / 100; break;
+        case 's': Seed = atoi(optarg); break;
+        case '?':
+            printf("Usage:\n--tcp [host:]port Listen on TCP port (one port per inverter, counting up)\n--unix path Listen on Unix socket path.0, path.1, ...\nOptional:\n--inverters Number of simulated inverters, 1 by default\n--MAC MAC address of the first inverter (the others count up), 00:80:25:00:00:01 by default\n--peak Peak power in W, 5000 by default\n--history Days of history, 365 by default\n--fragment Maximum data bytes per L1 packet, 73 by default\n--latency Reply latency in ms\n--jitter Reply latency varies +/- this many ms\n--drop Percentage of replies dropped\n--corrupt Percentage of telegrams with a bad checksum\n--seed Seed of the random drops, corruption and jitter\n");
+            return -1;
+        break;
+      }
+    }
+
+    // Check for required arguments
+    if (Port == 0 && SocketPath[0] == 0)
+    {
+      printf("TCP port (--tcp) and/or Unix socket (--unix) missing!\n");
+      return -1;
+    }
+    if (Port + NoInverters - 1 > 65535)
+    {
+      printf("Not enough TCP ports for all inverters.\n");
+      return -1;
+    }
+    // Success
+    return 0;
+  }
+};
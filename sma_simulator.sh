@@ -0,0 +1,5 @@
+#!/bin/sh
+rm ./sma_simulator
+clear
+g++ -O2 $1 -lbluetooth L1.cc L2.cc Transport.cc sma_simulator.cc -o sma_simulator
+./sma_simulator --tcp 9522 --inverters 4
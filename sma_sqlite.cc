@@ -1,15 +1,21 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include <sqlite3.h>
-#include "ProtocolManager.h"
+#include <signal.h>
+#include "Session.h"
+#include "Backfill.h"
+#include "GapScanner.h"
+#include "YieldStore.h"
+#include "YieldWriter.h"
 #include "sma_sqlite.h"
 
-#define EXIT_ERR(a)  { printf(a); if (db != NULL) { sqlite3_close(db); }; if (pm != NULL) { pm->Close(); }; return -1; }
+#define EXIT_ERR(a)  { printf("%s", a); poll.writer.Stop(); poll.store.Close(); if (db != NULL) { sqlite3_close(db); }; delete session; return -1; }
 
 // Query for maximum value of timestamp in given table
 int MaxTimeStamp(sqlite3 *db, const char *table)
@@ -32,54 +38,388 @@ int MaxTimeStamp(sqlite3 *db, const char *table)
   return result;
 }
 
-// Store historic data in indicated table
-int StoreHistoricData(sqlite3 *db, const char *table, HistoricInfo *hi)
+// Stores historic data in indicated yield table as the telegrams arrive: directly, or through the writer thread when 
+// it runs
+class TableSink : public HistoricYieldSink
 {
-  // Append the data to the yield_5m table            
-  sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
-  char command[256];
-  for (int i = 0; i < hi->NoRecords; i++)
+  YieldStore *store;
+  YieldWriter *writer;
+  int table;
+  Metrics *metrics;
+  
+  public:
+  
+  uint32_t NoRecords;
+  
+  TableSink(YieldStore *store, YieldWriter *writer, int table, Metrics *metrics)
   {
-    sprintf(command, "INSERT INTO %s (timestamp, energy) VALUES (%d, %d)", table, hi->Records[i].TimeStamp, hi->Records[i].Value);
-    if (sqlite3_exec(db, command, NULL, NULL, NULL) != SQLITE_OK)
+    this->store = store;
+    this->writer = writer;
+    this->table = table;
+    this->metrics = metrics;
+    NoRecords = 0;
+  }
+  
+  // Add the records to the table
+  int Records(HistoricInfoItem *records, int no_records)
+  {
+    double start = TimeNow();
+    int status = writer->Running() ? writer->Insert(table, records, no_records) : store->Insert(table, records, no_records);
+    if (status != 0)
     {      
-      return -1;
+      return YIELD_ERROR_STORING;
+    }
+    NoRecords += no_records;
+    metrics->Latency(METRICS_SINK, TimeNow() - start);
+    return 0;
+  }
+};
+
+
+// Historic series that is backfilled into a table, in the order of the YIELD_ tables
+typedef struct
+{
+  const char *table;
+  bool daily;
+  int32_t minimum_age;    // only fetch when the latest record is older [s]
+  int32_t settle;         // records younger than this may not be available yet [s]
+  const char *error;
+  const char *gap_error;
+} Series;
+
+static const Series series[2] = 
+{
+  { "yield_5m", false, 500, BACKFILL_SETTLE_5M, "Error reading 5 minute yield data.\n", "Error filling gaps in 5 minute yield data.\n" },
+  { "yield_daily", true, 24*3600, BACKFILL_SETTLE_DAILY, "Error reading daily yield data.\n", "Error filling gaps in daily yield data.\n" }
+};
+
+// Store spot values; unknown values are stored as NULL
+int StoreSpotValues(sqlite3 *db, SpotValues& sv)
+{
+  sqlite3_stmt *compiled;
+  int32_t values[] = { sv.TimeStamp, sv.ACPower, sv.GridFrequency, sv.DCPower[0], sv.DCPower[1], sv.DCVoltage[0], 
+                       sv.DCVoltage[1], sv.DCCurrent[0], sv.DCCurrent[1], sv.Temperature };
+  if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO spot (timestamp, ac_power, grid_frequency, dc_power_1, dc_power_2, "
+                             "dc_voltage_1, dc_voltage_2, dc_current_1, dc_current_2, temperature) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", -1, &compiled, NULL) != SQLITE_OK)
+  {
+    return YIELD_ERROR_STORING;
+  }
+  for (unsigned int i = 0; i < sizeof(values) / sizeof(int32_t); i++)
+  {
+    if (values[i] == SPOT_NAN)
+    {
+      sqlite3_bind_null(compiled, i + 1);
+    }
+    else
+    {
+      sqlite3_bind_int(compiled, i + 1, values[i]);
+    }
+  }
+  int status = sqlite3_step(compiled);
+  sqlite3_finalize(compiled);
+  return (status == SQLITE_DONE) ? 0 : YIELD_ERROR_STORING;
+}
+
+// Data of one poll of the inverter
+typedef struct
+{
+  sqlite3 *db;
+  YieldStore store;
+  YieldWriter writer;     // with --writer_thread
+  Options *options;
+  YieldInfo yi;
+  SpotValues sv;
+  const char *error;
+  Metrics sink_metrics;   // time spent storing data
+} PollData;
+
+// Add a completely fetched range to the checked ranges of a series: directly, or through the writer thread when it runs
+int SaveChecked(PollData *poll, int table, int32_t from, int32_t to)
+{
+  return poll->writer.Running() ? poll->writer.Checked(table, from, to) : poll->store.SaveChecked(table, from, to);
+}
+
+// Add the scanned part of a series between its gap ranges to the checked ranges: it has no gaps, so the next scan 
+// skips it. The gap ranges are added when they are fetched
+int SaveScanned(PollData *poll, int table, const GapScanner *gaps)
+{
+  int32_t from = gaps->ScannedFrom;
+  int status = 0;
+  for (int r = 0; r <= gaps->NoRanges && status == 0; r++)
+  {
+    int32_t to = (r < gaps->NoRanges) ? gaps->Ranges[r].From - 1 : gaps->ScannedTo;
+    if (from <= to)
+    {
+      status = SaveChecked(poll, table, from, to);
+    }
+    from = (r < gaps->NoRanges) ? gaps->Ranges[r].To + 1 : from;
+  }
+  return status;
+}
+
+// Fetch the gap ranges of the series, GAP_IN_FLIGHT requests at a time, oldest first. A range that was received 
+// completely is added to the checked ranges, so it is never requested again (also when the inverter has no records 
+// in it). Returns 0 on success; the requests still in flight after an error are left for WaitAll
+int FillGaps(ProtocolManager *pm, PollData *poll, GapScanner **gaps, TableSink **sinks)
+{
+  int requests[GAP_IN_FLIGHT];
+  int request_series[GAP_IN_FLIGHT];
+  const GapRange *request_ranges[GAP_IN_FLIGHT];
+  int first = 0, in_flight = 0;
+  int next_series = 0, next_range = 0;
+  int status = 0;
+  while (status == 0)
+  {
+    // Keep GAP_IN_FLIGHT requests in flight
+    while (in_flight < GAP_IN_FLIGHT && next_series < 2)
+    {
+      if (gaps[next_series] == NULL || next_range >= gaps[next_series]->NoRanges)
+      {
+        next_series++;
+        next_range = 0;
+        continue;
+      }
+      const GapRange *range = &gaps[next_series]->Ranges[next_range++];
+      int request = pm->BeginHistoricYield(range->From, range->To, *sinks[next_series], series[next_series].daily);
+      if (request < 0)
+      {
+        poll->error = series[next_series].gap_error;
+        return request;
+      }
+      int slot = (first + in_flight++) % GAP_IN_FLIGHT;
+      requests[slot] = request;
+      request_series[slot] = next_series;
+      request_ranges[slot] = range;
+    }
+    if (in_flight == 0)
+    {
+      break;
+    }
+    if ((status = pm->Wait(requests[first])) != 0)
+    {
+      poll->error = series[request_series[first]].gap_error;
+    }
+    else
+    {
+      status = SaveChecked(poll, request_series[first], request_ranges[first]->From, request_ranges[first]->To);
+    }
+    first = (first + 1) % GAP_IN_FLIGHT;
+    in_flight--;
+  }
+  return status;
+}
+
+// Exchange with the inverter. The yield info and spot value requests and the first chunk of every series are sent at 
+// once; the next
+// chunk of a series is requested as soon as the previous one is in. Historic data is stored while it arrives; the 
+// cursor of a series is saved with every completed chunk. Then the gaps before the latest record (e.g. left by failed 
+// polls) are fetched. With the writer thread the records and cursors are only queued here, and the poll waits for the
+// writer to catch up at its end (so the next poll reads the right cursors and checked ranges).
+int PollInverter(ProtocolManager *pm, void *context)
+{
+  PollData *poll = (PollData *) context;
+  TableSink *sinks[2] = { NULL, NULL };
+  BackfillPlanner *plans[2] = { NULL, NULL };
+  GapScanner *gaps[2] = { NULL, NULL };
+  bool wanted[2] = { poll->options->Minute5Yield, poll->options->DailyYield };
+  int status = 0;
+  time_t now = time(NULL);
+  bool threaded = poll->writer.Running();
+  if (!threaded)
+  {
+    poll->store.Begin();
+  }
+  // Get current totals AND SMA time
+  int yield_request = pm->BeginYieldInfo(poll->yi);
+  int spot_ids[SPOT_MAX_REQUESTS];
+  int spot_requests = poll->options->SpotValues ? pm->BeginSpotValues(poll->sv, spot_ids) : 0;
+  // Continue each series after its latest record or its cursor (which also covers ranges without records), and find
+  // the gaps before it
+  for (int i = 0; i < 2; i++)
+  {
+    if (!wanted[i])
+    {
+      continue;
+    }
+    int32_t cursor = poll->store.Cursor(i);
+    int32_t from_timestamp = MaxTimeStamp(poll->db, (char *) series[i].table);
+    from_timestamp = (cursor > from_timestamp) ? cursor : from_timestamp;
+    sinks[i] = new TableSink(&poll->store, &poll->writer, i, &poll->sink_metrics);
+    if ((now - from_timestamp) > series[i].minimum_age)
+    {
+      plans[i] = new BackfillPlanner(from_timestamp + 1, now, series[i].daily);
+      int request = plans[i]->Begin(pm, *sinks[i]);
+      if (request < 0 && status == 0)
+      {
+        status = request;
+        poll->error = series[i].error;
+      }
+    }
+    gaps[i] = new GapScanner(series[i].daily);
+    if (gaps[i]->Scan(poll->db, i, now - series[i].settle) != 0)
+    {
+      // Not fatal: the gaps are looked for again next time
+      gaps[i]->NoRanges = 0;
+    }
+  }
+  // Wait for the replies
+  if (status == 0 && (status = pm->Wait(yield_request)) != 0)
+  {
+    poll->error = "Error getting current totals\n";
+  }
+  // The spot values come in with the totals
+  int spot_status = (spot_requests < 0) ? spot_requests : 0;
+  for (int i = 0; i < spot_requests; i++)
+  {
+    int result = pm->Wait(spot_ids[i]);
+    spot_status = (spot_status == 0) ? result : spot_status;
+  }
+  bool busy = true;
+  while (status == 0 && busy)
+  {
+    busy = false;
+    for (int i = 0; i < 2 && status == 0; i++)
+    {
+      if (plans[i] == NULL || !plans[i]->Busy())
+      {
+        continue;
+      }
+      int32_t previous_cursor = plans[i]->Cursor();
+      if ((status = plans[i]->Wait(pm)) != 0)
+      {
+        poll->error = series[i].error;
+        break;
+      }
+      // Chunk complete: it needs no gap scan, commit it with its cursor (and the records of the other series so far)
+      if (plans[i]->Cursor() > previous_cursor)
+      {
+        status = SaveChecked(poll, i, previous_cursor + 1, plans[i]->Cursor());
+      }
+      if (status != 0)
+      {
+        break;
+      }
+      if (threaded)
+      {
+        status = poll->writer.Checkpoint(i, plans[i]->Cursor());
+      }
+      else
+      {
+        poll->store.SaveCursor(i, plans[i]->Cursor());
+        if ((status = poll->store.Commit()) == 0)
+        {
+          status = poll->store.Begin();
+        }
+      }
+      if (status != 0)
+      {
+        break;
+      }
+      if (!plans[i]->Finished())
+      {
+        int request = plans[i]->Begin(pm, *sinks[i]);
+        if (request < 0)
+        {
+          status = request;
+          poll->error = series[i].error;
+          break;
+        }
+        busy = true;
+      }
+    }
+  }
+  // Fill the gaps; the scanned history around them needs no scan anymore
+  for (int i = 0; i < 2 && status == 0; i++)
+  {
+    status = (gaps[i] == NULL) ? 0 : SaveScanned(poll, i, gaps[i]);
+  }
+  if (status == 0)
+  {
+    status = FillGaps(pm, poll, gaps, sinks);
+  }
+  // Do not leave replies of this exchange for the next one
+  pm->WaitAll();
+  // Keep the records that did arrive: the next attempt continues after them
+  if ((threaded ? poll->writer.Flush() : poll->store.Commit()) != 0 && status == 0)
+  {
+    status = YIELD_ERROR_STORING;
+  }
+  poll->sink_metrics.Count(METRICS_WRITER_STALLS, poll->writer.Stalls);
+  poll->writer.Stalls = 0;
+  for (int i = 0; i < 2; i++)
+  {
+    if (plans[i] != NULL && plans[i]->Chunks >= BACKFILL_MAX_CHUNKS && status == 0)
+    {
+      printf("%s: backfilled %u chunks up to %d, continuing next time.\n", series[i].table, plans[i]->Chunks, plans[i]->Cursor());
+    }
+    if (gaps[i] != NULL && gaps[i]->NoRanges > 0 && status == 0)
+    {
+      printf("%s: filled %u gaps in %d requests%s.\n", series[i].table, gaps[i]->Gaps, gaps[i]->NoRanges, 
+             gaps[i]->Truncated ? ", continuing next time" : "");
+    }
+    delete gaps[i];
+    delete plans[i];
+    delete sinks[i];
+  }
+  if (status == YIELD_ERROR_STORING)
+  {
+    poll->error = "Error storing historic data in SQLite database.\n";
+  }
+  if (status == 0 && spot_requests != 0)
+  {
+    // Without any value (no timestamp) there is nothing to store
+    status = (spot_status == 0 && poll->sv.TimeStamp == 0) ? PM_ERROR_INTERPRETING_REPLY : spot_status;
+    if (status != 0)
+    {
+      poll->error = "Error reading spot values.\n";
+    }
+    else if ((status = StoreSpotValues(poll->db, poll->sv)) != 0)
+    {
+      poll->error = "Error storing spot values in SQLite database.\n";
     }
   }
-  sqlite3_exec(db, "END", NULL, NULL, NULL);
-  return 0;
+  return status;
+}
+
+// Write metrics of the session and the sinks
+void WriteMetrics(Options& options, Session *session, PollData& poll)
+{
+  Metrics metrics = session->Manager()->GetMetrics();
+  Metrics *list[1] = { &metrics };
+  metrics.Add(poll.sink_metrics);
+  if (!Metrics::Write(options.MetricsFile, list, 1))
+  {
+    printf("Error writing metrics to %s\n", options.MetricsFile);
+  }
 }
 
+// Stop daemon on signal
+static volatile sig_atomic_t running = 1;
+static void Stop(int signal)
+{
+  running = 0;
+}
+
+// Write metrics on signal
+static volatile sig_atomic_t write_metrics = 0;
+static void WriteMetricsSignal(int signal)
+{
+  write_metrics = 1;
+}
 
 // Main function
 int main(int argc, char **argv)
 {
     
     sqlite3 *db = NULL;
+    Session *session = NULL;
+    PollData poll;
     // Read options
     Options options;
     if (options.Initialize(argc, argv) < 0)
     {
       return -1;
     }    
-    // Start protocol manager    
-    ProtocolManager *pm = new ProtocolManager();
-    // Connect
-    if (pm->Connect(options.MAC))
-    {
-      EXIT_ERR("Error connecting to SMA inverter\n");      
-    }     
-    // Login 
-    if (!pm->Logon(options.Password))
-    {
-      EXIT_ERR("Error logging in to SMA inverter\n");
-    }
-    // Get current totals AND SMA time
-    YieldInfo yi;
-    if (pm->GetYieldInfo(yi))
-    {
-      EXIT_ERR("Error getting current totals\n");
-    }    
     // Connect to database    
     if (sqlite3_open(options.Database, &db))
     {
@@ -87,59 +427,105 @@ int main(int argc, char **argv)
     }
     // Create required tables
     if (
-      sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS yield_5m (timestamp INTEGER PRIMARY KEY, energy INTEGER)", NULL, NULL, NULL) != SQLITE_OK ||
-      sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS yield_daily (timestamp INTEGER PRIMARY KEY, energy INTEGER)", NULL, NULL, NULL) != SQLITE_OK)
+      sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS spot (timestamp INTEGER PRIMARY KEY, ac_power INTEGER, grid_frequency INTEGER, "
+                       "dc_power_1 INTEGER, dc_power_2 INTEGER, dc_voltage_1 INTEGER, dc_voltage_2 INTEGER, "
+                       "dc_current_1 INTEGER, dc_current_2 INTEGER, temperature INTEGER)", NULL, NULL, NULL) != SQLITE_OK)
     {
       EXIT_ERR("Error creating tables in SQLite database\n");
     } 
-    // Get 5 minute yield values
-    if (options.Minute5Yield)
-    {
-      // Find timestamp from latest insertion
-      int from_timestamp =  MaxTimeStamp(db, (char *) "yield_5m");
-      // Check whether we have something to do: is it more than 5 minutes later?
-      if ((yi.TimeStamp - from_timestamp) > 500)
-      { // Yes, more than 5 minutes between now and latest stored point
-        // Get historic 5 minute data, starting 1 second after the latest timestamp 
-        HistoricInfo hi;    
-        if (pm->GetHistoricYield(from_timestamp + 1, time(NULL), hi, false) != 0)
+    // Yield, backfill and rollup tables (WAL journaling, prepared inserts)
+    if (poll.store.Open(db) != 0)
+    {
+      EXIT_ERR("Error creating tables in SQLite database\n");
+    }
+    // Only fill the rollup tables of an existing database
+    if (options.RebuildRollups)
+    {
+      if (poll.store.RebuildRollups() != 0)
+      {
+        EXIT_ERR("Error rebuilding rollup tables in SQLite database\n");
+      }
+      poll.store.Close();
+      sqlite3_close(db);
+      return 0;
+    }
+    // Write the records on a thread of their own
+    if (options.WriterThread && poll.writer.Start(&poll.store) != 0)
+    {
+      EXIT_ERR("Error starting database writer thread\n");
+    }
+    // Session with the inverter: connects and logs on at the first poll
+    session = new Session(options.MAC, options.Password, options.TransportDescription);
+    poll.db = db;
+    poll.error = NULL;
+    poll.options = &options;
+    // Single poll
+    if (options.Interval == 0)
+    {
+      int status = session->Run(PollInverter, &poll, TimeNow() + options.TimeOut);
+      if (options.MetricsFile[0] != 0)
+      {
+        WriteMetrics(options, session, poll);
+      }
+      if (status == SESSION_ERROR_CONNECT)
+      {
+        EXIT_ERR("Error connecting to SMA inverter\n");      
+      }
+      if (status == SESSION_ERROR_LOGON)
+      {
+        EXIT_ERR("Error logging in to SMA inverter\n");
+      }
+      if (status == PM_ERROR_TIMEOUT)
+      {
+        EXIT_ERR("Time-out polling SMA inverter\n");
+      }
+      if (status != 0)
+      {
+        EXIT_ERR(poll.error);
+      }
+    }
+    // Daemon: poll every Interval seconds over the same session until stopped
+    else
+    {
+      signal(SIGINT, Stop);
+      signal(SIGTERM, Stop);
+      signal(SIGUSR1, WriteMetricsSignal);
+      while (running)
+      {
+        double next_poll = TimeNow() + options.Interval;
+        poll.error = NULL;
+        int status = session->Run(PollInverter, &poll, TimeNow() + options.TimeOut);
+        if (status != 0)
         {
-          EXIT_ERR("Error reading 5 minute yield data.\n");
-        }
-        // Append the data to the yield_5m table
-        if (StoreHistoricData(db, (char *) "yield_5m", &hi))
-        {            
-          EXIT_ERR("Error storing historic data in SQLite database.\n");
+          printf("%s", (status == SESSION_ERROR_CONNECT) ? "Error connecting to SMA inverter\n" : 
+                       (status == SESSION_ERROR_LOGON) ? "Error logging in to SMA inverter\n" : 
+                       (status == PM_ERROR_TIMEOUT) ? "Time-out polling SMA inverter\n" : poll.error);
         }
-        free(hi.Records);
-      }      
-    }
-    // Get daily yield values
-    if (options.DailyYield)
-    {
-      // Find timestamp from latest insertion
-      int from_timestamp =  MaxTimeStamp(db, (char *) "yield_daily");
-      // Check whether we have something to do
-      if ((yi.TimeStamp - from_timestamp) > (24*3600))
-      { // Yes, more than 24 hour between now and latest stored point
-        // Get historic dayly data, starting 1 second after the latest timestamp 
-        HistoricInfo hi;    
-        if (pm->GetHistoricYield(from_timestamp + 1, time(NULL), hi, true) != 0)
+        fflush(stdout);
+        write_metrics = (options.MetricsFile[0] != 0);
+        // Wait for the next poll; keep the session alive in the mean time
+        while (running && TimeNow() < next_poll)
         {
-          EXIT_ERR("Error reading daily yield data.\n");
+          if (write_metrics && options.MetricsFile[0] != 0)
+          {
+            WriteMetrics(options, session, poll);
+          }
+          write_metrics = 0;
+          double wait = next_poll - TimeNow();
+          usleep((useconds_t) (((wait > 1) ? 1 : wait) * 1e6));
+          session->KeepAlive();
         }
-        // Append the data to the yield_5m table
-        if (StoreHistoricData(db, (char *) "yield_daily", &hi))
-        {            
-          EXIT_ERR("Error storing historic data in SQLite database.\n");
-        }
-        free(hi.Records);
-      }      
+      }
+    }
+    // Close database: the writer thread first stores everything that is still queued
+    if (poll.writer.Stop() != 0)
+    {
+      EXIT_ERR("Error storing historic data in SQLite database.\n");
     }
-    // Close database 
+    poll.store.Close();
     sqlite3_close(db);
-    // Close bluetooth connection (@@@ not closed wen exiting in error)
-    pm->Close();
+    // Close bluetooth connection
+    delete session;
     // Success!
     return 0;
 }
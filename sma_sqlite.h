@@ -8,9 +8,16 @@ static struct option long_options[] =
        {"help",     no_argument,       0, '?'},
        {"daily",    no_argument,       0, 'd'},
        {"5minute",  no_argument,       0, '5'},
+       {"spot",     no_argument,       0, 'S'},
        {"MAC",      required_argument, 0, 'M'},
        {"password", required_argument, 0, 'p'},
+       {"transport",required_argument, 0, 't'},
+       {"daemon",   required_argument, 0, 'D'},
+       {"timeout",  required_argument, 0, 'T'},
        {"sqlite",   required_argument, 0, 's'},
+       {"metrics",  required_argument, 0, 'm'},
+       {"writer_thread", no_argument,  0, 'W'},
+       {"rebuild_rollups", no_argument, 0, 'R'},
        {0, 0, 0, 0}
      };
 
@@ -20,14 +27,22 @@ class Options
   public:  
   bool DailyYield;
   bool Minute5Yield;
+  bool SpotValues;
+  bool WriterThread;
+  bool RebuildRollups;
   char MAC[18];
   uint8_t Password[13]; 
+  char TransportDescription[1024];
   char Database[1024];
+  char MetricsFile[1024];
+  int Interval;
+  int TimeOut;
   
   int Initialize(int argc, char **argv)
   {
-    // Clear values
+    // Clear values, set defaults
     memset(this, 0, sizeof(Options));
+    TimeOut = 300;        // a poll never takes longer than 5 minutes
     // Process arguments
     while (true)
     {
@@ -40,6 +55,9 @@ class Options
       {
         case 'd': DailyYield = true; break;
         case '5': Minute5Yield = true; break;                    
+        case 'S': SpotValues = true; break;
+        case 'W': WriterThread = true; break;
+        case 'R': RebuildRollups = true; break;
         case 'M':
           if (strlen(optarg) != 17)
           {
@@ -64,15 +82,52 @@ class Options
             }
             strcpy(Database, optarg);
         break;      
+        case 'D':
+            Interval = atoi(optarg);
+            if (Interval <= 0)
+            {
+              printf("Daemon poll interval should be at least 1 s.\n");
+              return -1;
+            }
+        break;
+        case 'T':
+            TimeOut = atoi(optarg);
+            if (TimeOut <= 0)
+            {
+              printf("Time-out should be at least 1 s.\n");
+              return -1;
+            }
+        break;
+        case 'm':
+            if (strlen(optarg) > sizeof(MetricsFile)-1)
+            {
+              printf("Path to metrics file is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy(MetricsFile, optarg);
+        break;
+        case 't':
+            if (strlen(optarg) > sizeof(TransportDescription)-1)
+            {
+              printf("Transport description is more than 1 kB.\n");
+              return -1;
+            }
+            strcpy(TransportDescription, optarg);
+        break;
         case '?':
-            printf("Usage:\n--MAC MAC address of SMA inverter\n--password Password\n--sqlite Filename in which the sqlite database will be residing\n--daily Get daily yields\n--5minute Get 5 minute yields\n");
+            printf("Usage:\n--MAC MAC address of SMA inverter\n--password Password\n--sqlite Filename in which the sqlite database will be residing\n--daily Get daily yields\n--5minute Get 5 minute yields\nOptional:\n--spot Also store current AC/DC power, voltage, current, grid frequency and temperature\n--transport Connect using tcp:host:port, unix:path, or replay:file instead of Bluetooth\n--daemon Keep running, poll every given number of seconds over a persistent session\n--timeout Maximum duration of a poll in seconds, 300 by default\n--metrics Write counters and latencies to this file after every poll, and on SIGUSR1 (Prometheus text format when it ends in .prom, JSON otherwise)\n--writer_thread Store the records on a separate thread, so database writes overlap the exchange with the inverter\n--rebuild_rollups Only recompute the hourly, daily and monthly rollup tables from the 5 minute yields (once, for an existing database), without polling the inverter\n");
             return -1;
         break;
       }
     }
     
     // Check for required arguments
-    if (MAC[0] == 0 || Password[0] == 0 || Database[0] == 0)
+    if (RebuildRollups && Database[0] == 0)
+    {
+      printf("SQLite database (--sqlite) missing!\n");
+      return -1;
+    }
+    if (!RebuildRollups && (MAC[0] == 0 || Password[0] == 0 || Database[0] == 0))
     {
       printf("Password (--password), MAC address (--MAC), and/or SQLite database (--sqlite) missing!\n");
       return -1;